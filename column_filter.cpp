@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#include "column_filter.h"
+
+ColumnRange ColumnRange::of(const Predicate &filter) {
+  assert(filter.kind == PRED::FILTER);
+  auto value = (uint64_t) filter.filter_val;
+  switch (filter.op) {
+    case '=':
+      return {value, value, false};
+    case '<':
+      return {0U, value - 1U, value == 0U};
+    case '>':
+      return {value + 1U, UINT64_MAX, value == UINT64_MAX};
+    default:
+      assert(false);
+      return all();
+  }
+}
+
+ColumnRange ColumnRange::intersect(ColumnRange rhs) const {
+  ColumnRange res{std::max(min, rhs.min), std::min(max, rhs.max), is_empty || rhs.is_empty};
+  res.is_empty = res.is_empty || res.min > res.max;
+  return res;
+}
+
+double ColumnRange::selectivity(uint64_t column_min, uint64_t column_max, size_t distinct) const {
+  uint64_t from = std::max(min, column_min);
+  uint64_t to = std::min(max, column_max);
+  if (is_empty || from > to)
+    return 0.0;
+  if (from == to)
+    return 1.0 / (double) std::max(distinct, (size_t) 1U);
+  double domain = (double) (column_max - column_min) + 1.0;
+  return std::min(1.0, ((double) (to - from) + 1.0) / domain);
+}
+
+StretchyBuf<ColumnFilter> merge_column_filters(const StretchyBuf<Predicate> &filters) {
+  StretchyBuf<ColumnFilter> res{};
+  for (size_t i = 0; i < filters.len; ++i) {
+    const Predicate &filter = filters.data[i];
+    size_t column = filter.lhs.second;
+    size_t f = 0U;
+    while (f != res.len && res.data[f].column != column) ++f;
+    if (f == res.len) {
+      res.push({column, ColumnRange::all(), 1.0});
+    }
+    res.data[f].range = res.data[f].range.intersect(ColumnRange::of(filter));
+  }
+  return res;
+}
+
+void order_column_filters(StretchyBuf<ColumnFilter> &filters) {
+  // Relations have a few filters, so an insertion sort is enough. It keeps the order of equal filters.
+  for (size_t i = 1; i < filters.len; ++i) {
+    ColumnFilter filter = filters.data[i];
+    size_t j = i;
+    for (; j != 0 && filters.data[j - 1].selectivity > filter.selectivity; --j) {
+      filters.data[j] = filters.data[j - 1];
+    }
+    filters.data[j] = filter;
+  }
+}
+
+RowBitmap RowBitmap::create(size_t row_n, bool set) {
+  RowBitmap rows{nullptr, row_n};
+  rows.words = (uint64_t *) malloc(rows.word_count() * sizeof(uint64_t));
+  assert(rows.words);
+  memset(rows.words, set ? 0xFF : 0x00, rows.word_count() * sizeof(uint64_t));
+  // The bits after the last row are never set.
+  rows.words[row_n / 64U] &= (UINT64_C(1) << (row_n % 64U)) - 1U;
+  return rows;
+}
+
+size_t RowBitmap::count() const {
+  size_t count = 0U;
+  for (size_t w = 0U; w != word_count(); ++w) {
+    count += __builtin_popcountll(words[w]);
+  }
+  return count;
+}
+
+void RowBitmap::free() {
+  ::free(words);
+  words = nullptr;
+}
+
+FilteredRows FilteredRows::compress(RowBitmap rows) {
+  FilteredRows res{rows, nullptr, rows.count()};
+  if (rows.row_n > UINT32_MAX || res.count * sizeof(uint32_t) >= rows.word_count() * sizeof(uint64_t))
+    return res;
+  res.row_ids = (uint32_t *) malloc(std::max(res.count, (size_t) 1U) * sizeof(uint32_t));
+  assert(res.row_ids);
+  size_t i = 0U;
+  for_each_row(rows, [&res, &i](size_t row) { res.row_ids[i++] = (uint32_t) row; });
+  rows.free();
+  res.bitmap.words = nullptr;
+  return res;
+}
+
+size_t FilteredRows::byte_size() const {
+  return is_list() ? count * sizeof(uint32_t) : bitmap.word_count() * sizeof(uint64_t);
+}
+
+RowBitmap FilteredRows::to_bitmap() const {
+  if (!is_list())
+    return bitmap;
+  RowBitmap rows = RowBitmap::create(bitmap.row_n, false);
+  for (size_t i = 0U; i != count; ++i) {
+    rows.words[row_ids[i] / 64U] |= UINT64_C(1) << (row_ids[i] % 64U);
+  }
+  return rows;
+}
+
+void FilteredRows::free() {
+  bitmap.free();
+  ::free(row_ids);
+  row_ids = nullptr;
+}
+
+/**
+ * @return A mask of the values of a word of 64 rows that are in the range [min, min + span].
+ * Every value is checked with a single unsigned comparison: value - min <= span.
+ */
+static __always_inline uint64_t match_word(const u64 *values, uint64_t min, uint64_t span) {
+  uint64_t mask = 0U;
+#if defined(__AVX512F__)
+  const __m512i mins = _mm512_set1_epi64((long long) min);
+  const __m512i spans = _mm512_set1_epi64((long long) span);
+  for (size_t k = 0U; k != 64U; k += 8U) {
+    __m512i offsets = _mm512_sub_epi64(_mm512_loadu_si512((const void *) (values + k)), mins);
+    mask |= (uint64_t) _mm512_cmple_epu64_mask(offsets, spans) << k;
+  }
+#elif defined(__AVX2__)
+  // AVX2 has only signed 64-bit comparisons, so flip the sign bits to compare unsigned offsets.
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i mins = _mm256_set1_epi64x((long long) min);
+  const __m256i spans = _mm256_xor_si256(_mm256_set1_epi64x((long long) span), sign);
+  for (size_t k = 0U; k != 64U; k += 4U) {
+    __m256i offsets = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *) (values + k)), mins);
+    __m256i above = _mm256_cmpgt_epi64(_mm256_xor_si256(offsets, sign), spans);
+    mask |= (uint64_t) (0xF & ~_mm256_movemask_pd(_mm256_castsi256_pd(above))) << k;
+  }
+#else
+  for (size_t k = 0U; k != 64U; ++k) {
+    mask |= (uint64_t) (values[k].v - min <= span) << k;
+  }
+#endif
+  return mask;
+}
+
+// A word with at most this many rows left checks them one by one instead of comparing all its values.
+static constexpr int sparse_word_rows = 8;
+
+/**
+ * Filters the words [from, to) of the bitmap.
+ * @return A word with any bit set if there are rows left in these words.
+ */
+static uint64_t filter_words(const u64 *column, uint64_t min, uint64_t span, RowBitmap rows, size_t from, size_t to) {
+  size_t full_words = rows.row_n / 64U;
+  uint64_t any_rows = 0U;
+  for (size_t w = from; w != to; ++w) {
+    uint64_t word = rows.words[w];
+    if (word == 0U)
+      continue;
+    if (w != full_words && __builtin_popcountll(word) > sparse_word_rows) {
+      word &= match_word(column + w * 64U, min, span);
+    } else {
+      for (uint64_t left = word; left != 0U; left &= left - 1U) {
+        size_t bit = __builtin_ctzll(left);
+        if (column[w * 64U + bit].v - min > span) {
+          word &= ~(UINT64_C(1) << bit);
+        }
+      }
+    }
+    rows.words[w] = word;
+    any_rows |= word;
+  }
+  return any_rows;
+}
+
+bool filter_column(const u64 *column, ColumnRange range, RowBitmap rows, const ZoneMap *zones) {
+  if (range.is_empty) {
+    memset(rows.words, 0, rows.word_count() * sizeof(uint64_t));
+    return false;
+  }
+  if (range.min == 0U && range.max == UINT64_MAX)
+    return rows.count() != 0U;
+  uint64_t span = range.max - range.min;
+  if (zones == nullptr)
+    return filter_words(column, range.min, span, rows, 0U, rows.word_count()) != 0U;
+  constexpr size_t block_words = ZoneMap::block_rows / 64U;
+  uint64_t any_rows = 0U;
+  for (size_t b = 0U; b != zones->block_count(); ++b) {
+    size_t from = b * block_words;
+    size_t to = b + 1U == zones->block_count() ? rows.word_count() : from + block_words;
+    uint64_t block_min = zones->mins[b].v;
+    uint64_t block_max = zones->maxs[b].v;
+    if (block_max < range.min || block_min > range.max) {
+      memset(rows.words + from, 0, (to - from) * sizeof(uint64_t));
+    } else if (block_min >= range.min && block_max <= range.max) {
+      for (size_t w = from; w != to; ++w) {
+        any_rows |= rows.words[w];
+      }
+    } else {
+      any_rows |= filter_words(column, range.min, span, rows, from, to);
+    }
+  }
+  return any_rows != 0U;
+}
+
+ZoneMap ZoneMap::build(const u64 *column, size_t row_n) {
+  size_t block_n = (row_n + block_rows - 1U) / block_rows;
+  ZoneMap zones{Array<u64>(std::max(block_n, (size_t) 1U)), Array<u64>(std::max(block_n, (size_t) 1U))};
+  for (size_t from = 0U; from < row_n; from += block_rows) {
+    size_t to = std::min(from + block_rows, row_n);
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0U;
+    for (size_t i = from; i != to; ++i) {
+      min = std::min(min, column[i].v);
+      max = std::max(max, column[i].v);
+    }
+    zones.mins.push(min);
+    zones.maxs.push(max);
+  }
+  return zones;
+}
+
+void ZoneMap::free() {
+  mins.clear_and_free();
+  maxs.clear_and_free();
+}
+
+double Histogram::selectivity(ColumnRange range) const {
+  if (range.is_empty || row_n == 0U)
+    return 0.0;
+  double rows = 0.0;
+  for (size_t b = 0U; b != bucket_n; ++b) {
+    uint64_t from = std::max(range.min, lower[b]);
+    uint64_t to = std::min(range.max, upper[b]);
+    if (distinct[b] == 0U || from > to)
+      continue;
+    double width = (double) (upper[b] - lower[b]) + 1.0;
+    double values = (double) distinct[b] * (((double) (to - from) + 1.0) / width);
+    if (from == to)
+      values = std::max(values, 1.0);
+    double bucket_rows = (double) (bucket_from(b + 1U, row_n) - bucket_from(b, row_n));
+    rows += bucket_rows * std::min(1.0, values / (double) distinct[b]);
+  }
+  return std::min(1.0, rows / (double) row_n);
+}
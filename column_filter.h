@@ -0,0 +1,230 @@
+#ifndef QUERY_JOINER__COLUMN_FILTER_H_
+#define QUERY_JOINER__COLUMN_FILTER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include "array.h"
+#include "common.h"
+#include "parse.h"
+#include "stretchy_buf.h"
+
+/**
+ * The values [min, max] of a column that pass one or more filters on it.
+ * Every filter is a range: "= c" is [c, c], "< c" is [0, c - 1] and "> c" is [c + 1, UINT64_MAX].
+ */
+struct ColumnRange {
+  uint64_t min;
+  uint64_t max;
+  bool is_empty;
+
+  static ColumnRange all() { return {0U, UINT64_MAX, false}; }
+
+  /**
+   * @return The values that pass a filter predicate. The value of the filter is compared as an unsigned value.
+   */
+  static ColumnRange of(const Predicate &filter);
+
+  /**
+   * @return The values that pass both ranges.
+   */
+  ColumnRange intersect(ColumnRange rhs) const;
+
+  bool contains(uint64_t value) const { return !is_empty && value - min <= max - min; }
+
+  /**
+   * @return The estimated fraction of the rows of a column that are in the range, assuming that "distinct"
+   * distinct values are spread uniformly over [column_min, column_max].
+   */
+  double selectivity(uint64_t column_min, uint64_t column_max, size_t distinct) const;
+};
+
+/**
+ * A filter of a relation, with all its filter predicates on the same column merged into a range.
+ */
+struct ColumnFilter {
+  size_t column;
+  ColumnRange range;
+  // The estimated fraction of the rows that pass the filter.
+  double selectivity;
+};
+
+/**
+ * Merges the filter predicates of a relation per column, in the order that their columns first appear.
+ * The selectivities of the merged filters are 1 until they are estimated.
+ */
+StretchyBuf<ColumnFilter> merge_column_filters(const StretchyBuf<Predicate> &filters);
+
+/**
+ * Orders the filters by their selectivity, the most selective first, so that the filters that follow
+ * only check the few rows that passed it.
+ */
+void order_column_filters(StretchyBuf<ColumnFilter> &filters);
+
+/**
+ * A set of rows of a relation, one bit per row. Word w holds the rows [64 * w, 64 * w + 64).
+ */
+struct RowBitmap {
+  uint64_t *words;
+  size_t row_n;
+
+  /**
+   * @return A bitmap of "row_n" rows, with all of them set or none.
+   */
+  static RowBitmap create(size_t row_n, bool set);
+
+  size_t word_count() const { return row_n / 64U + 1U; }
+
+  bool test(size_t row) const { return (words[row / 64U] & (UINT64_C(1) << (row % 64U))) != 0U; }
+
+  /**
+   * @return The number of rows in the set.
+   */
+  size_t count() const;
+
+  void free();
+};
+
+/**
+ * The rows of a relation that pass its filters. They are kept as a bitmap, or as a list of row-ids when so few rows
+ * pass that the list is smaller, which is what makes it cheap to keep them between queries.
+ */
+struct FilteredRows {
+  // The words are null if the rows are a list, the number of rows of the relation is kept either way.
+  RowBitmap bitmap;
+  // Null if the rows are a bitmap.
+  uint32_t *row_ids;
+  size_t count;
+
+  /**
+   * Takes over a bitmap of the rows, turning it into a list if that is smaller.
+   */
+  static FilteredRows compress(RowBitmap rows);
+
+  bool is_list() const { return row_ids != nullptr; }
+
+  size_t byte_size() const;
+
+  /**
+   * @return The rows as a bitmap. It must be freed if the rows are a list.
+   */
+  RowBitmap to_bitmap() const;
+
+  /**
+   * Calls f(row) for every row, in order.
+   */
+  template<typename F>
+  void for_each(F f) const;
+
+  void free();
+};
+
+/**
+ * The smallest and the biggest value of every block of "block_rows" consecutive rows of a column.
+ * A filter skips the blocks that are outside of its range and accepts the blocks that are inside it
+ * without reading their values, which pays off on clustered columns, like dates and ids.
+ */
+struct ZoneMap {
+  // A multiple of 64, so that every block is a run of whole words of a row bitmap.
+  static constexpr size_t block_rows = 4096U;
+
+  Array<u64> mins;
+  Array<u64> maxs;
+
+  /**
+   * Builds the zone map of a column of "row_n" values.
+   */
+  static ZoneMap build(const u64 *column, size_t row_n);
+
+  size_t block_count() const { return mins.size; }
+
+  void free();
+};
+
+/**
+ * An equi-depth histogram of a column: the sorted values are split into "bucket_n" buckets of the same number
+ * of rows, and every bucket keeps its smallest and biggest value and its number of distinct values.
+ * Skewed values get narrow buckets, so the estimates of ranges don't assume that the whole column is uniform,
+ * only every bucket. A value that fills whole buckets is a bucket of a single distinct value.
+ */
+struct Histogram {
+  static constexpr size_t bucket_n = 64U;
+
+  size_t row_n;
+  uint64_t lower[bucket_n];
+  uint64_t upper[bucket_n];
+  // The distinct values of every bucket, or 0 for the empty buckets of columns of fewer than bucket_n rows.
+  uint64_t distinct[bucket_n];
+
+  /**
+   * Builds the histogram of a column of "row_n" values, in one pass over its sorted values.
+   * @param key_at Returns the i-th smallest value of the column.
+   */
+  template<typename KeyAt>
+  static Histogram build(size_t row_n, KeyAt key_at) {
+    Histogram histogram{};
+    histogram.row_n = row_n;
+    for (size_t b = 0U; b != bucket_n; ++b) {
+      size_t from = bucket_from(b, row_n);
+      size_t to = bucket_from(b + 1U, row_n);
+      uint64_t distinct = 0U;
+      uint64_t previous = 0U;
+      for (size_t i = from; i != to; ++i) {
+        uint64_t key = key_at(i);
+        distinct += i == from || key != previous;
+        previous = key;
+      }
+      histogram.lower[b] = from != to ? key_at(from) : 0U;
+      histogram.upper[b] = from != to ? previous : 0U;
+      histogram.distinct[b] = distinct;
+    }
+    return histogram;
+  }
+
+  /**
+   * @return The estimated fraction of the rows of the column that are in the range. The distinct values of every
+   * bucket are assumed to be spread uniformly between its smallest and its biggest value,
+   * and a single value that falls in a bucket is assumed to be one of its values.
+   */
+  double selectivity(ColumnRange range) const;
+
+ private:
+  // The first row of bucket b, in the order of the sorted values.
+  static size_t bucket_from(size_t b, size_t row_n) { return b * row_n / bucket_n; }
+};
+
+/**
+ * Keeps in "rows" only the rows of "column" whose value is in "range", a word at a time.
+ * Only the rows still in the set are checked: a word with few of them checks them one by one, and a dense word
+ * compares all its values, 8 (AVX-512) or 4 (AVX2) at a time when the build targets these instruction sets.
+ * @param column The values of the column, one per row of the bitmap.
+ * @param zones The zone map of the column, if it has one.
+ * @return False if no rows are left, so that the rest of the filters can be skipped.
+ */
+bool filter_column(const u64 *column, ColumnRange range, RowBitmap rows, const ZoneMap *zones = nullptr);
+
+/**
+ * Calls f(row) for every row in the set, in order.
+ */
+template<typename F>
+static inline void for_each_row(const RowBitmap &rows, F f) {
+  for (size_t w = 0U; w != rows.word_count(); ++w) {
+    uint64_t word = rows.words[w];
+    while (word != 0U) {
+      f(w * 64U + __builtin_ctzll(word));
+      word &= word - 1U;
+    }
+  }
+}
+
+template<typename F>
+void FilteredRows::for_each(F f) const {
+  if (is_list()) {
+    for (size_t i = 0U; i != count; ++i) {
+      f((size_t) row_ids[i]);
+    }
+  } else {
+    for_each_row(bitmap, f);
+  }
+}
+
+#endif //QUERY_JOINER__COLUMN_FILTER_H_
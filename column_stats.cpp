@@ -0,0 +1,65 @@
+#include "column_stats.h"
+#include "hyperloglog.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Below this many values per chunk, the statistics of a column are not worth splitting among threads.
+static constexpr size_t min_stats_chunk = 256U * 1024U;
+
+ColumnStat compute_column_stat(const Array<u64> &column, TaskScheduler *scheduler) {
+  size_t row_n = column.size;
+  size_t nr_chunks = std::max((size_t) 1U, std::min(scheduler->thread_count() + 1U, row_n / min_stats_chunk));
+  size_t chunk_size = (row_n + nr_chunks - 1U) / nr_chunks;
+  auto *sketches = new HyperLogLog[nr_chunks];
+  StretchyBuf<uint64_t> mins(nr_chunks);
+  StretchyBuf<uint64_t> maxs(nr_chunks);
+  mins.len = maxs.len = nr_chunks;
+  scheduler->parallel_for(nr_chunks, [&](size_t chunk) {
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0U;
+    HyperLogLog &sketch = sketches[chunk];
+    size_t to = std::min(row_n, (chunk + 1U) * chunk_size);
+    for (size_t i = std::min(row_n, chunk * chunk_size); i < to; ++i) {
+      uint64_t value = column.data[i].v;
+      min = std::min(min, value);
+      max = std::max(max, value);
+      sketch.add(value);
+    }
+    mins[chunk] = min;
+    maxs[chunk] = max;
+  });
+  for (size_t chunk = 1; chunk < nr_chunks; ++chunk) {
+    sketches[0].merge(sketches[chunk]);
+  }
+  ColumnStat res;
+  res.l = (double) *std::min_element(mins.begin(), mins.end());
+  res.u = (double) *std::max_element(maxs.begin(), maxs.end());
+  res.f = row_n;
+  res.d = std::min(std::round(sketches[0].estimate()), (double) row_n);
+  res.histogram = nullptr;
+  if (row_n == 0U) {
+    res.l = res.u = 0.0;
+  }
+  delete[] sketches;
+  mins.free();
+  maxs.free();
+  return res;
+}
+
+Stats compute_stats(RelationStorage &rs, TaskScheduler *scheduler) {
+  assert(rs.size);
+  Stats stats;
+  stats.relations = Array<Array<ColumnStat>>(rs.size);
+  for (RelationData &rd : rs) {
+    size_t col_n = rd.size;
+    Array<ColumnStat> stat_arr(col_n);
+    for (size_t i = 0; i != col_n; ++i) {
+      ColumnStat col_stat = compute_column_stat(rd[i], scheduler);
+      col_stat.histogram = rd.histogram(i);
+      stat_arr.push(col_stat);
+    }
+    stats.relations.push(stat_arr);
+  }
+  return stats;
+}
@@ -0,0 +1,21 @@
+#ifndef QUERY_JOINER__COLUMN_STATS_H_
+#define QUERY_JOINER__COLUMN_STATS_H_
+
+#include "join_order.h"
+#include "relation_storage.h"
+#include "task_scheduler.h"
+
+/**
+ * Computes the statistics of a column in one pass, a chunk per thread.
+ * The distinct values are estimated with a HyperLogLog sketch per chunk, and the sketches are merged.
+ * The column has no histogram.
+ */
+ColumnStat compute_column_stat(const Array<u64> &column, TaskScheduler *scheduler);
+
+/**
+ * Computes the statistics of every column of every relation. The columns with a sorted index get its histogram,
+ * the histograms of the columns indexed later are given to their statistics when they are built.
+ */
+Stats compute_stats(RelationStorage &rs, TaskScheduler *scheduler);
+
+#endif //QUERY_JOINER__COLUMN_STATS_H_
@@ -0,0 +1,36 @@
+#include <algorithm>
+#include "filter_cache.h"
+
+bool FilterCacheKey::Filter::operator==(const Filter &rhs) const {
+  if (column != rhs.column || range.is_empty != rhs.range.is_empty)
+    return false;
+  // All the empty ranges of a column filter the same rows.
+  return range.is_empty || (range.min == rhs.range.min && range.max == rhs.range.max);
+}
+
+FilterCacheKey FilterCacheKey::create(size_t relation_index, const StretchyBuf<Predicate> &filters) {
+  FilterCacheKey key{};
+  key.relation_index = relation_index;
+  StretchyBuf<ColumnFilter> merged = merge_column_filters(filters);
+  key.column_n = merged.len;
+  if (key.can_be_cached()) {
+    for (size_t i = 0; i < merged.len; ++i) {
+      key.filters[i] = {merged.data[i].column, merged.data[i].range};
+    }
+    std::sort(key.filters, key.filters + key.column_n, [](const Filter &lhs, const Filter &rhs) {
+      return lhs.column < rhs.column;
+    });
+  }
+  merged.free();
+  return key;
+}
+
+bool FilterCacheKey::operator==(const FilterCacheKey &rhs) const {
+  if (relation_index != rhs.relation_index || column_n != rhs.column_n)
+    return false;
+  for (size_t i = 0; i < std::min(column_n, max_columns); ++i) {
+    if (!(filters[i] == rhs.filters[i]))
+      return false;
+  }
+  return true;
+}
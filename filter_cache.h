@@ -0,0 +1,46 @@
+#ifndef QUERY_JOINER__FILTER_CACHE_H_
+#define QUERY_JOINER__FILTER_CACHE_H_
+
+#include "column_filter.h"
+#include "lru_cache.h"
+#include "parse.h"
+
+/**
+ * Identifies the rows of a base relation that pass a conjunction of filters. The filters are normalized
+ * into one range per column, ordered by column, so "3.1 > 5 & 3.1 < 9" and "3.1 < 9 & 3.1 > 5 & 3.1 > 2" match.
+ */
+struct FilterCacheKey {
+  static constexpr size_t max_columns = 4;
+
+  struct Filter {
+    size_t column;
+    ColumnRange range;
+
+    bool operator==(const Filter &rhs) const;
+  };
+
+  size_t relation_index;
+  size_t column_n;
+  Filter filters[max_columns];
+
+  /**
+   * @param relation_index Global index of the relation.
+   * @param filters The filter predicates of the relation.
+   */
+  static FilterCacheKey create(size_t relation_index, const StretchyBuf<Predicate> &filters);
+
+  /**
+   * @return False if the filters are on too many columns for the key to hold.
+   */
+  bool can_be_cached() const { return column_n <= max_columns; }
+
+  bool operator==(const FilterCacheKey &rhs) const;
+};
+
+/**
+ * The filtered rows of the base relations, shared by all the queries.
+ * The cost of a value is its size in bytes.
+ */
+using FilterCache = LruCache<FilterCacheKey, FilteredRows>;
+
+#endif //QUERY_JOINER__FILTER_CACHE_H_
@@ -0,0 +1,47 @@
+#ifndef QUERY_JOINER__GATHER_H_
+#define QUERY_JOINER__GATHER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include "common.h"
+
+/**
+ * Gathers are the row-id to value lookups of the intermediate results: values[indexes[k]] for consecutive k.
+ * The indexes are random, so over a big column almost every lookup misses the cache and a plain loop stalls
+ * on memory for each of them. These loops prefetch the value "gather_prefetch_distance" indexes ahead,
+ * so that many misses are in flight at once. The indexes themselves are read sequentially.
+ */
+static constexpr size_t gather_prefetch_distance = 32U;
+
+/**
+ * Calls f(k, values[indexes[k]]) for every k in [0, n), in order.
+ */
+template<typename F>
+static inline void for_each_gathered(const u64 *values, const u64 *indexes, size_t n, F f) {
+  size_t k = 0U;
+  for (; k + gather_prefetch_distance < n; ++k) {
+    __builtin_prefetch(values + indexes[k + gather_prefetch_distance].v);
+    f(k, values[indexes[k].v]);
+  }
+  for (; k < n; ++k) {
+    f(k, values[indexes[k].v]);
+  }
+}
+
+/**
+ * Writes values[indexes[k]] to out[k] for every k in [0, n). "out" may be "indexes".
+ */
+static inline void gather(const u64 *values, const u64 *indexes, size_t n, u64 *out) {
+  for_each_gathered(values, indexes, n, [out](size_t k, u64 value) { out[k] = value; });
+}
+
+/**
+ * @return The sum of values[indexes[k]] for every k in [0, n).
+ */
+static inline uint64_t gather_sum(const u64 *values, const u64 *indexes, size_t n) {
+  uint64_t sum = 0U;
+  for_each_gathered(values, indexes, n, [&sum](size_t, u64 value) { sum += value.v; });
+  return sum;
+}
+
+#endif //QUERY_JOINER__GATHER_H_
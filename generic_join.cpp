@@ -0,0 +1,441 @@
+#include <cassert>
+#include <unistd.h>
+#include "generic_join.h"
+#include "task_scheduler.h"
+
+extern TaskScheduler scheduler;
+
+static size_t sort_threshold = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+
+// Above this many entries, sorting a relation is split among threads.
+static constexpr size_t parallel_sort_threshold = 1U << 20U;
+
+// Below this many entries of the first variable per chunk, the search is not worth splitting among threads.
+static constexpr size_t min_search_chunk = 4U * 1024U;
+
+/**
+ * Where the values of a variable are in the keys of a relation.
+ */
+struct TrieField {
+  bool present;
+  size_t shift;
+  uint64_t mask;
+};
+
+/**
+ * A relation sorted on its variables. Within a range of entries that agree on the variables bound so far,
+ * the entries are sorted on the next variable of the relation, so the sorted array works as a trie.
+ */
+struct TrieRelation {
+  Joinable entries;
+  Array<TrieField> fields;
+
+  uint64_t field(size_t i, size_t variable) const {
+    return (entries[i].first.v >> fields[variable].shift) & fields[variable].mask;
+  }
+};
+
+struct TrieRange {
+  size_t from;
+  size_t to;
+};
+
+struct SearchContext {
+  const TrieRelation *relations;
+  size_t relation_n;
+  size_t variable_n;
+  const Pair<int, int> *sums;
+  size_t sum_n;
+  // The running sums of every selected column, in the order of the entries of its relation.
+  const Array<u64> *prefix_sums;
+};
+
+static int find_root(int *parent, int x) {
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+GenericJoin::GenericJoin(RelationStorage &rs, const ParseQueryResult &pqr)
+    : relation_storage(rs), parse_query_result(pqr), variable_n(0), cyclic(false) {
+  constexpr int column_n = max_relations * max_columns;
+  int parent[column_n];
+  for (int i = 0; i < column_n; ++i) {
+    parent[i] = i;
+  }
+  for (auto predicate: pqr.predicates) {
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    int lhs = find_root(parent, predicate.lhs.first * max_columns + predicate.lhs.second);
+    int rhs = find_root(parent, predicate.rhs.first * max_columns + predicate.rhs.second);
+    parent[lhs] = rhs;
+  }
+  for (int r = 0; r < max_relations; ++r) {
+    for (int c = 0; c < max_columns; ++c) {
+      column_variables[r][c] = no_variable;
+    }
+  }
+  // Number the classes of the joined columns.
+  int class_variables[column_n];
+  for (int i = 0; i < column_n; ++i) {
+    class_variables[i] = no_variable;
+  }
+  for (auto predicate: pqr.predicates) {
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    for (auto side: {predicate.lhs, predicate.rhs}) {
+      int root = find_root(parent, side.first * max_columns + side.second);
+      if (class_variables[root] == no_variable) {
+        class_variables[root] = (int) variable_n++;
+      }
+      column_variables[side.first][side.second] = class_variables[root];
+    }
+  }
+
+  // Count the relations of every variable and detect cycles between relations and variables.
+  size_t relation_counts[column_n] = {0};
+  int node_parent[max_relations + column_n];
+  for (int i = 0; i < max_relations + column_n; ++i) {
+    node_parent[i] = i;
+  }
+  for (int r = 0; r < pqr.num_relations; ++r) {
+    for (size_t v = 0; v < variable_n; ++v) {
+      if (variable_column(r, v) == -1)
+        continue;
+      ++relation_counts[v];
+      int relation_root = find_root(node_parent, r);
+      int variable_root = find_root(node_parent, max_relations + (int) v);
+      if (relation_root == variable_root) {
+        cyclic = true;
+      }
+      node_parent[relation_root] = variable_root;
+    }
+  }
+
+  // Bind the variables shared by the most relations first, they narrow the ranges the most.
+  int order[column_n];
+  for (size_t v = 0; v < variable_n; ++v) {
+    order[v] = (int) v;
+  }
+  for (size_t i = 1; i < variable_n; ++i) {
+    for (size_t j = i; j > 0 && relation_counts[order[j]] > relation_counts[order[j - 1]]; --j) {
+      std::swap(order[j], order[j - 1]);
+    }
+  }
+  int positions[column_n];
+  for (size_t i = 0; i < variable_n; ++i) {
+    positions[order[i]] = (int) i;
+  }
+  for (int r = 0; r < max_relations; ++r) {
+    for (int c = 0; c < max_columns; ++c) {
+      if (column_variables[r][c] != no_variable) {
+        column_variables[r][c] = positions[column_variables[r][c]];
+      }
+    }
+  }
+}
+
+bool GenericJoin::is_cyclic() const {
+  return cyclic;
+}
+
+bool GenericJoin::can_execute() const {
+  for (int r = 0; r < parse_query_result.num_relations; ++r) {
+    size_t bits = 0;
+    for (size_t v = 0; v < variable_n; ++v) {
+      if (variable_column(r, v) != -1) {
+        bits += variable_bits(r, v);
+      }
+    }
+    if (bits > 64U)
+      return false;
+  }
+  return true;
+}
+
+int GenericJoin::variable_column(size_t relation_index, size_t variable) const {
+  for (int c = 0; c < max_columns; ++c) {
+    if (column_variables[relation_index][c] == (int) variable)
+      return c;
+  }
+  return -1;
+}
+
+size_t GenericJoin::variable_bits(size_t relation_index, size_t variable) const {
+  uint64_t max = get_relation(relation_index).column_max(variable_column(relation_index, variable));
+  return max == 0 ? 1U : 64U - __builtin_clzll(max);
+}
+
+RelationData &GenericJoin::get_relation(size_t local_relation_index) const {
+  return relation_storage[parse_query_result.actual_relations[local_relation_index]];
+}
+
+static void sort_relation(Joinable joinable) {
+  if (joinable.size < 2U)
+    return;
+  Joinable aux{joinable.size};
+  aux.size = joinable.size;
+  if (joinable.size >= parallel_sort_threshold) {
+    joinable.parallel_sort(&scheduler, aux, sort_threshold);
+  } else {
+    StretchyBuf<Joinable::SortContext> context_stack{};
+    joinable.sort({aux, context_stack}, sort_threshold);
+    context_stack.free();
+  }
+  aux.clear_and_free();
+}
+
+/**
+ * Finds the first entry in [from, to) whose field is not before the target, galloping from the start
+ * since the leapfrog moves forward by small steps most of the time.
+ */
+template<typename IsBefore>
+static size_t seek(const TrieRelation &relation, size_t variable, size_t from, size_t to, IsBefore is_before) {
+  if (from == to || !is_before(relation.field(from, variable)))
+    return from;
+  // Invariant: the entry at "low" is before the target, the one at "high" (if any) is not.
+  size_t low = from;
+  size_t step = 1U;
+  while (low + step < to && is_before(relation.field(low + step, variable))) {
+    low += step;
+    step <<= 1U;
+  }
+  size_t high = std::min(low + step, to);
+  while (high - low > 1U) {
+    size_t middle = low + (high - low) / 2U;
+    if (is_before(relation.field(middle, variable))) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return high;
+}
+
+static size_t seek_value(const TrieRelation &relation, size_t variable, size_t from, size_t to, uint64_t value) {
+  return seek(relation, variable, from, to, [value](uint64_t field) { return field < value; });
+}
+
+static size_t seek_past_value(const TrieRelation &relation, size_t variable, size_t from, size_t to, uint64_t value) {
+  return seek(relation, variable, from, to, [value](uint64_t field) { return field <= value; });
+}
+
+/**
+ * All the variables are bound, so every combination of the entries left in the ranges is a result tuple.
+ * The sums are computed from the sizes of the ranges, without enumerating the combinations.
+ */
+static void accumulate_sums(const SearchContext &context, const TrieRange *ranges, uint64_t *sums) {
+  for (size_t s = 0; s < context.sum_n; ++s) {
+    size_t relation_index = context.sums[s].first;
+    const Array<u64> &prefix = context.prefix_sums[s];
+    uint64_t sum = prefix[ranges[relation_index].to].v - prefix[ranges[relation_index].from].v;
+    for (size_t r = 0; r < context.relation_n; ++r) {
+      if (r != relation_index) {
+        sum *= ranges[r].to - ranges[r].from;
+      }
+    }
+    sums[s] += sum;
+  }
+}
+
+static void search(const SearchContext &context, size_t variable, const TrieRange *ranges, uint64_t *sums) {
+  if (variable == context.variable_n) {
+    accumulate_sums(context, ranges, sums);
+    return;
+  }
+  size_t participants[max_relations];
+  size_t participant_n = 0;
+  for (size_t r = 0; r < context.relation_n; ++r) {
+    if (context.relations[r].fields[variable].present) {
+      if (ranges[r].from == ranges[r].to)
+        return;
+      participants[participant_n++] = r;
+    }
+  }
+  assert(participant_n > 0);
+  TrieRange next[max_relations];
+  for (size_t r = 0; r < context.relation_n; ++r) {
+    next[r] = ranges[r];
+  }
+  size_t positions[max_relations];
+  for (size_t i = 0; i < participant_n; ++i) {
+    positions[i] = ranges[participants[i]].from;
+  }
+  uint64_t value = context.relations[participants[0]].field(positions[0], variable);
+  while (true) {
+    // Leapfrog: move the participants in turn to the current value until they all agree on it.
+    size_t agreed = 0;
+    for (size_t i = 0; agreed < participant_n; i = (i + 1U) % participant_n) {
+      const TrieRelation &relation = context.relations[participants[i]];
+      size_t to = ranges[participants[i]].to;
+      positions[i] = seek_value(relation, variable, positions[i], to, value);
+      if (positions[i] == to)
+        return;
+      uint64_t field = relation.field(positions[i], variable);
+      if (field == value) {
+        ++agreed;
+      } else {
+        value = field;
+        agreed = 1;
+      }
+    }
+    for (size_t i = 0; i < participant_n; ++i) {
+      size_t r = participants[i];
+      next[r].from = positions[i];
+      next[r].to = seek_past_value(context.relations[r], variable, positions[i], ranges[r].to, value);
+    }
+    search(context, variable + 1U, next, sums);
+    for (size_t i = 0; i < participant_n; ++i) {
+      positions[i] = next[participants[i]].to;
+      if (positions[i] == ranges[participants[i]].to)
+        return;
+    }
+    value = context.relations[participants[0]].field(positions[0], variable);
+  }
+}
+
+StretchyBuf<uint64_t> GenericJoin::execute() {
+  assert(can_execute());
+  size_t relation_n = parse_query_result.num_relations;
+  TrieRelation relations[max_relations];
+  for (size_t r = 0; r < relation_n; ++r) {
+    RelationData &relation = get_relation(r);
+    StretchyBuf<Predicate> filters;
+    for (auto predicate: parse_query_result.predicates) {
+      if (predicate.kind == PRED::FILTER && predicate.lhs.first == (int) r) {
+        filters.push(predicate);
+      }
+    }
+    TrieRelation &trie = relations[r];
+    trie.fields = Array<TrieField>(std::max(variable_n, (size_t) 1U));
+    trie.fields.size = variable_n;
+    size_t key_bits = 0;
+    for (size_t v = 0; v < variable_n; ++v) {
+      trie.fields[v].present = variable_column(r, v) != -1;
+      if (trie.fields[v].present) {
+        key_bits += variable_bits(r, v);
+      }
+    }
+    size_t shift = key_bits;
+    for (size_t v = 0; v < variable_n; ++v) {
+      if (!trie.fields[v].present) {
+        trie.fields[v].shift = 0;
+        trie.fields[v].mask = 0;
+        continue;
+      }
+      size_t bits = variable_bits(r, v);
+      shift -= bits;
+      trie.fields[v].shift = shift;
+      trie.fields[v].mask = bits == 64U ? UINT64_MAX : (UINT64_C(1) << bits) - 1U;
+    }
+    // The entries are sorted once they have their variables as keys.
+    trie.entries = relation.to_joinable(0, filters, false);
+    filters.free();
+    // Replace the keys with the variables of the relation, dropping the rows whose columns of the
+    // same variable disagree.
+    size_t kept = 0;
+    for (size_t i = 0; i < trie.entries.size; ++i) {
+      uint64_t row = trie.entries[i].second.v;
+      uint64_t key = 0;
+      bool is_match = true;
+      for (int c = 0; c < max_columns && is_match; ++c) {
+        int variable = column_variables[r][c];
+        if (variable == no_variable)
+          continue;
+        uint64_t value = relation[c][row].v;
+        int first_column = variable_column(r, variable);
+        if (first_column != c) {
+          is_match = value == relation[first_column][row].v;
+          continue;
+        }
+        key |= value << trie.fields[variable].shift;
+      }
+      if (is_match) {
+        trie.entries[kept++] = JoinableEntry{key, row};
+      }
+    }
+    trie.entries.size = kept;
+    sort_relation(trie.entries);
+  }
+
+  size_t sum_n = parse_query_result.sums.size;
+  StretchyBuf<Array<u64>> prefix_sums(std::max(sum_n, (size_t) 1U));
+  for (size_t s = 0; s < sum_n; ++s) {
+    auto pair = parse_query_result.sums[s];
+    const Joinable &entries = relations[pair.first].entries;
+    const u64 *column = get_relation(pair.first)[pair.second].data;
+    Array<u64> prefix(entries.size + 1U);
+    prefix.size = entries.size + 1U;
+    prefix[0] = 0;
+    for (size_t i = 0; i < entries.size; ++i) {
+      prefix[i + 1U] = prefix[i].v + column[entries[i].second.v].v;
+    }
+    prefix_sums.push(prefix);
+  }
+  SearchContext context{relations, relation_n, variable_n, parse_query_result.sums.data, sum_n, prefix_sums.data};
+
+  // Split the values of the first variable into chunks, at the entries of one of its relations.
+  TrieRange ranges[max_relations];
+  for (size_t r = 0; r < relation_n; ++r) {
+    ranges[r] = {0, relations[r].entries.size};
+  }
+  size_t splitter = 0;
+  if (variable_n > 0) {
+    while (!relations[splitter].fields[0].present) {
+      ++splitter;
+    }
+  }
+  const Joinable &splitter_entries = relations[splitter].entries;
+  size_t nr_chunks = std::max((size_t) 1U,
+                              std::min(4U * (scheduler.thread_count() + 1U), splitter_entries.size / min_search_chunk));
+  if (variable_n == 0) {
+    nr_chunks = 1;
+  }
+  // The sums of every chunk, next to each other.
+  Array<uint64_t> chunk_sums(std::max(nr_chunks * sum_n, (size_t) 1U));
+  chunk_sums.size = nr_chunks * sum_n;
+  for (size_t i = 0; i < chunk_sums.size; ++i) {
+    chunk_sums[i] = 0;
+  }
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    TrieRange chunk_ranges[max_relations];
+    for (size_t r = 0; r < relation_n; ++r) {
+      chunk_ranges[r] = ranges[r];
+    }
+    if (nr_chunks > 1U) {
+      // The chunk holds the values from the one at its first splitter entry, up to the one of the next chunk.
+      size_t from = chunk * splitter_entries.size / nr_chunks;
+      size_t to = (chunk + 1U) * splitter_entries.size / nr_chunks;
+      uint64_t first_value = relations[splitter].field(from, 0);
+      for (size_t r = 0; r < relation_n; ++r) {
+        if (!relations[r].fields[0].present)
+          continue;
+        chunk_ranges[r].from = chunk == 0 ? 0 : seek_value(relations[r], 0, 0, ranges[r].to, first_value);
+        if (to != splitter_entries.size) {
+          uint64_t last_value = relations[splitter].field(to, 0);
+          chunk_ranges[r].to = seek_value(relations[r], 0, 0, ranges[r].to, last_value);
+        }
+      }
+    }
+    search(context, 0, chunk_ranges, chunk_sums.data + chunk * sum_n);
+  });
+
+  StretchyBuf<uint64_t> result;
+  for (size_t s = 0; s < sum_n; ++s) {
+    uint64_t sum = 0;
+    for (size_t chunk = 0; chunk < nr_chunks; ++chunk) {
+      sum += chunk_sums[chunk * sum_n + s];
+    }
+    result.push(sum);
+    prefix_sums[s].clear_and_free();
+  }
+  prefix_sums.free();
+  chunk_sums.clear_and_free();
+  for (size_t r = 0; r < relation_n; ++r) {
+    relations[r].entries.clear_and_free();
+    relations[r].fields.clear_and_free();
+  }
+  return result;
+}
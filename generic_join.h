@@ -0,0 +1,64 @@
+#ifndef QUERY_JOINER__GENERIC_JOIN_H_
+#define QUERY_JOINER__GENERIC_JOIN_H_
+
+#include "stretchy_buf.h"
+#include "parse.h"
+#include "relation_storage.h"
+
+/**
+ * Worst-case optimal join (Generic Join with leapfrog intersections) of all the relations of a query.
+ *
+ * The joined columns are grouped into variables (the classes of columns that the join predicates make equal).
+ * Every relation is turned into a Joinable whose keys hold the values of its variables, most significant first,
+ * and sorted once. The join then binds one variable at a time, intersecting the sorted ranges of the relations
+ * that contain it, so a cyclic query never materializes the pairwise results that a chain of binary joins
+ * would produce before the closing predicate filters them. Only the sums of the select clause are computed.
+ */
+class GenericJoin {
+ public:
+  GenericJoin(RelationStorage &rs, const ParseQueryResult &pqr);
+
+  /**
+   * @return True if the graph of the relations and the variables they join on has a cycle.
+   * Two predicates between the same pair of relations on different columns form a cycle too.
+   */
+  bool is_cyclic() const;
+
+  /**
+   * @return True if the variables of every relation fit in a 64 bit key, based on the column maximums.
+   */
+  bool can_execute() const;
+
+  /**
+   * Executes the query. The result is the same as the one of QueryExecutor::execute_query.
+   * @return List of the sums.
+   */
+  StretchyBuf<uint64_t> execute();
+
+ private:
+  static constexpr int no_variable = -1;
+
+  RelationStorage &relation_storage;
+  ParseQueryResult parse_query_result;
+  /**
+   * The variable of every column of every relation, or no_variable if the column isn't joined.
+   * The variables are numbered in the order they are bound: the ones shared by the most relations first.
+   */
+  int column_variables[max_relations][max_columns];
+  size_t variable_n;
+  bool cyclic;
+
+  /**
+   * @return The first column of the relation that belongs to the variable, or -1 if there is none.
+   */
+  int variable_column(size_t relation_index, size_t variable) const;
+
+  /**
+   * @return The number of bits the values of the variable take in the relation.
+   */
+  size_t variable_bits(size_t relation_index, size_t variable) const;
+
+  RelationData &get_relation(size_t local_relation_index) const;
+};
+
+#endif //QUERY_JOINER__GENERIC_JOIN_H_
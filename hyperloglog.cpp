@@ -0,0 +1,30 @@
+#include <cmath>
+#include <cstring>
+#include "hyperloglog.h"
+
+HyperLogLog::HyperLogLog() {
+  memset(registers, 0, sizeof(registers));
+}
+
+void HyperLogLog::merge(const HyperLogLog &rhs) {
+  for (size_t i = 0; i < register_n; ++i) {
+    if (rhs.registers[i] > registers[i])
+      registers[i] = rhs.registers[i];
+  }
+}
+
+double HyperLogLog::estimate() const {
+  double m = register_n;
+  double sum = 0.0;
+  size_t zero_n = 0;
+  for (size_t i = 0; i < register_n; ++i) {
+    sum += std::ldexp(1.0, -registers[i]);
+    zero_n += registers[i] == 0;
+  }
+  double alpha = 0.7213 / (1.0 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  // Few values leave many registers empty, and counting them is more accurate then.
+  if (estimate <= 2.5 * m && zero_n != 0)
+    return m * std::log(m / (double) zero_n);
+  return estimate;
+}
@@ -0,0 +1,52 @@
+#ifndef QUERY_JOINER__HYPERLOGLOG_H_
+#define QUERY_JOINER__HYPERLOGLOG_H_
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * A HyperLogLog sketch of the distinct values of a column, in a fixed 4KB, with a standard error of about 1.6%.
+ * Every value is hashed to a register, which keeps the longest run of leading zeros of the hashes it has seen.
+ * Sketches of parts of a column merge into the sketch of the whole column, so the parts can be added in parallel.
+ */
+struct HyperLogLog {
+  static constexpr unsigned precision = 12U;
+  static constexpr size_t register_n = size_t(1) << precision;
+
+  uint8_t registers[register_n];
+
+  HyperLogLog();
+
+  void add(uint64_t value) {
+    uint64_t hash = mix(value);
+    size_t index = hash >> (64U - precision);
+    // The bit after the hash bits stops the run, so that a run is at most 64 - precision + 1 long.
+    uint64_t rest = (hash << precision) | (UINT64_C(1) << (precision - 1U));
+    auto rank = (uint8_t) (__builtin_clzll(rest) + 1);
+    if (rank > registers[index])
+      registers[index] = rank;
+  }
+
+  /**
+   * Adds the values of another sketch, as if they were added to this one.
+   */
+  void merge(const HyperLogLog &rhs);
+
+  /**
+   * @return The estimated number of distinct values that were added.
+   */
+  double estimate() const;
+
+ private:
+  // The finalizer of MurmurHash3, which spreads the bits of consecutive values over the whole hash.
+  static uint64_t mix(uint64_t value) {
+    value ^= value >> 33U;
+    value *= UINT64_C(0xff51afd7ed558ccd);
+    value ^= value >> 33U;
+    value *= UINT64_C(0xc4ceb9fe1a85ec53);
+    value ^= value >> 33U;
+    return value;
+  }
+};
+
+#endif //QUERY_JOINER__HYPERLOGLOG_H_
@@ -1,14 +1,20 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include "intermediate_result.h"
+#include "gather.h"
 
 extern TaskScheduler scheduler;
 
 IntermediateResult::IntermediateResult(RelationStorage &rs, const ParseQueryResult &pqr)
     : Array(rs.size), relation_storage(rs), parse_query_result(pqr), column_n(0),
-      row_n(0), max_column_n(rs.size), previous_join{nullptr} {
+      row_n(0), max_column_n(rs.size), previous_join{nullptr}, profile{nullptr}, selections{},
+      column_generations(rs.size) {
   this->size = rs.size;
+  this->column_generations.size = rs.size;
   for (size_t i = 0; i < this->size; i++) {
     this->operator[](i).data = nullptr;
+    this->column_generations[i] = 0;
   }
   this->sorting.set_none();
 }
@@ -30,21 +36,132 @@ bool IntermediateResult::is_empty() {
   return this->column_n == 0;
 }
 
+void IntermediateResult::set_column(size_t relation_index, StretchyBuf<u64> column) {
+  this->operator[](relation_index) = column;
+  this->column_generations[relation_index] = this->selections.len;
+}
+
+void IntermediateResult::push_selection(StretchyBuf<u64> selection) {
+  this->selections.push(selection);
+  this->row_n = selection.len;
+}
+
+// Below this many rows per chunk, a gather is not worth splitting among threads.
+static constexpr size_t min_gather_chunk = 64U * 1024U;
+
+// The rows of a gather are mapped through the selections a batch at a time, so that every step is a batched gather.
+static constexpr size_t gather_batch = 1024U;
+
+const u64 *IntermediateResult::column_positions(size_t relation_index, const u64 *rows, size_t from, size_t n,
+                                                u64 *buffer) {
+  const StretchyBuf<u64> *chain = this->selections.data;
+  size_t generation = this->column_generations[relation_index];
+  size_t current_generation = this->selections.len;
+  const u64 *batch = rows + from;
+  if (rows == nullptr) {
+    for (size_t k = 0; k < n; ++k) {
+      buffer[k] = from + k;
+    }
+    batch = buffer;
+  }
+  // Walk the selections back to the generation the column was written at.
+  for (size_t g = current_generation; g-- != generation;) {
+    gather(chain[g].data, batch, n, buffer);
+    batch = buffer;
+  }
+  return batch;
+}
+
+StretchyBuf<u64> IntermediateResult::gather_column(size_t relation_index, const u64 *rows, size_t row_count) {
+  assert(column_is_allocated(relation_index));
+  const u64 *column = this->operator[](relation_index).data;
+  StretchyBuf<u64> res(row_count);
+  size_t nr_chunks = std::max((size_t) 1U, std::min(scheduler.thread_count() + 1U, row_count / min_gather_chunk));
+  size_t chunk_size = (row_count + nr_chunks - 1U) / nr_chunks;
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    auto *batch_rows = (u64 *) malloc(gather_batch * sizeof(u64));
+    assert(batch_rows);
+    size_t to = std::min(row_count, (chunk + 1U) * chunk_size);
+    for (size_t from = chunk * chunk_size; from < to; from += gather_batch) {
+      size_t n = std::min(gather_batch, to - from);
+      gather(column, column_positions(relation_index, rows, from, n, batch_rows), n, res.data + from);
+    }
+    ::free(batch_rows);
+  });
+  res.len = row_count;
+  return res;
+}
+
+const StretchyBuf<u64> &IntermediateResult::materialize(size_t relation_index) {
+  if (column_is_allocated(relation_index) && this->column_generations[relation_index] != this->selections.len) {
+    StretchyBuf<u64> column = gather_column(relation_index, nullptr, this->row_n);
+    this->operator[](relation_index).free();
+    set_column(relation_index, column);
+    release_selections();
+  }
+  return this->operator[](relation_index);
+}
+
+void IntermediateResult::release_selections() {
+  size_t oldest_generation = this->selections.len;
+  for (size_t i = 0; i < this->max_column_n; ++i) {
+    if (column_is_allocated(i))
+      oldest_generation = std::min(oldest_generation, this->column_generations[i]);
+  }
+  // No column is older than "oldest_generation", so the selections before it are never walked again.
+  for (size_t g = 0; g < oldest_generation; ++g) {
+    this->selections[g].free();
+  }
+}
+
 Joinable IntermediateResult::to_joinable(size_t relation_index, size_t key_index) {
   assert(column_is_allocated(relation_index));
   // Oddly this is the number of columns of relation at "relation_index".
   assert(key_index < relation_storage[get_global_relation_index(relation_index)].size);
   assert(this->row_n != 0);
+  materialize(relation_index);
   RelationData target_relation = relation_storage[get_global_relation_index(relation_index)];
   Joinable joinable(this->row_n);
-  for (size_t i = 0; i < this->row_n; ++i) {
-    u64 rowid = this->operator[](relation_index)[i];
-    JoinableEntry entry{target_relation[key_index][rowid], i};
-    joinable.push(entry);
-  }
+  for_each_gathered(target_relation[key_index].data, this->operator[](relation_index).data, this->row_n,
+                    [&joinable](size_t i, u64 key) {
+                      joinable.data[i] = JoinableEntry{key, i};
+                    });
+  joinable.size = this->row_n;
+  return joinable;
+}
+
+PackedJoinable IntermediateResult::to_packed_joinable(size_t relation_index, size_t key_index) {
+  assert(column_is_allocated(relation_index));
+  assert(key_index < relation_storage[get_global_relation_index(relation_index)].size);
+  assert(this->row_n != 0);
+  RelationData target_relation = relation_storage[get_global_relation_index(relation_index)];
+  const u64 *keys = target_relation[key_index].data;
+  const u64 *rowids = materialize(relation_index).data;
+  PackedJoinable joinable(this->row_n);
+  for_each_gathered(keys, rowids, this->row_n, [&joinable](size_t i, u64 key) {
+    joinable.data[i] = PackedJoinable::pack(key.v, i);
+  });
+  joinable.size = this->row_n;
   return joinable;
 }
 
+JoinInput IntermediateResult::to_join_input(size_t relation_index, size_t key_index,
+                                                                bool packed) {
+  JoinInput input;
+  input.is_packed = packed;
+  if (packed) {
+    input.packed = to_packed_joinable(relation_index, key_index);
+  } else {
+    input.wide = to_joinable(relation_index, key_index);
+  }
+  return input;
+}
+
+bool IntermediateResult::join_key_can_be_packed(size_t relation_index, size_t key_index, size_t row_count) {
+  uint64_t max_key = relation_storage[get_global_relation_index(relation_index)].column_max(key_index);
+  return row_count != 0 && PackedJoinable::can_pack(max_key, row_count - 1U);
+}
+
 void IntermediateResult::execute_join(size_t left_relation_index,
                                       size_t left_key_index,
                                       size_t right_relation_index,
@@ -82,30 +199,214 @@ void IntermediateResult::execute_join(size_t left_relation_index,
 
 static size_t sort_threshold = sysconf(_SC_LEVEL1_DCACHE_SIZE);
 
+// Joinables bigger than this are sorted with all the threads of the scheduler.
+static constexpr size_t parallel_sort_threshold = 1U << 20U;
+
 static inline void sort_wrapper(Joinable joinable) {
   Joinable aux{joinable.size};
   aux.size = joinable.size;
+  if (joinable.size >= parallel_sort_threshold) {
+    joinable.parallel_sort(&scheduler, aux, sort_threshold);
+    aux.clear_and_free();
+    return;
+  }
   StretchyBuf<Joinable::SortContext> context_stack{};
   joinable.sort({aux, context_stack}, sort_threshold);
   aux.clear_and_free();
   context_stack.free();
 }
 
-static inline void perform_sort_if_necessary(Joinable lhs, Joinable rhs, bool lhs_sorted, bool rhs_sorted) {
+static inline void sort_wrapper(PackedJoinable joinable) {
+  PackedJoinable aux{joinable.size};
+  aux.size = joinable.size;
+  if (joinable.size >= parallel_sort_threshold) {
+    joinable.parallel_sort(&scheduler, aux, sort_threshold);
+  } else {
+    joinable.sort(aux, sort_threshold);
+  }
+  aux.clear_and_free();
+}
+
+static void sort_join_input(JoinInput input) {
+  if (input.size() < 2U)
+    return;
+  if (input.is_packed) {
+    sort_wrapper(input.packed);
+  } else {
+    sort_wrapper(input.wide);
+  }
+}
+
+/**
+ * @return A copy of a cached join input, that borrows its entries.
+ */
+static JoinInput borrow_join_input(const JoinInput *cached) {
+  JoinInput input = *cached;
+  input.shared = cached;
+  return input;
+}
+
+JoinInput IntermediateResult::relation_to_join_input(size_t relation_index, size_t key_index,
+                                                     StretchyBuf<Predicate> filters,
+                                                     bool packed, bool sorted) {
+  size_t global_relation_index = get_global_relation_index(relation_index);
+  RelationData relation = relation_storage[global_relation_index];
+  if (filters.len == 0 && relation.has_sorted_index(key_index) && relation.sorted_index(key_index).is_packed == packed) {
+    // Nothing to filter, so the sorted index of the column is the input itself.
+    JoinInput input = relation.sorted_index(key_index);
+    input.shared = nullptr;
+    input.is_view = true;
+    return input;
+  }
+  JoinableCache *cache = relation_storage.joinable_cache;
+  JoinableCacheKey cache_key = JoinableCacheKey::create(global_relation_index, key_index, packed, filters);
+  // Only sorted inputs are cached, the hash join has nothing to gain from them.
+  bool use_cache = sorted && cache != nullptr && cache_key.can_be_cached();
+  if (use_cache) {
+    const JoinInput *cached = cache->acquire(cache_key);
+    if (cached != nullptr)
+      return borrow_join_input(cached);
+  }
+  FilteredRows own_rows{};
+  const FilteredRows *rows = filters.len != 0 ? filter_relation(global_relation_index, filters, &own_rows) : nullptr;
+  JoinInput input;
+  input.is_packed = packed;
+  if (packed) {
+    input.packed = relation.to_packed_joinable(key_index, rows, sorted);
+  } else {
+    input.wide = relation.to_joinable(key_index, rows, sorted);
+  }
+  if (rows != nullptr) {
+    release_filtered_rows(rows, &own_rows);
+  }
+  // The joinables made from a sorted index are already sorted, the others are in row order.
+  if (sorted && !relation.has_sorted_index(key_index)) {
+    sort_join_input(input);
+  }
+  if (use_cache) {
+    const JoinInput *cached = cache->insert(cache_key, input, input.byte_size());
+    if (cached != nullptr)
+      return borrow_join_input(cached);
+  }
+  return input;
+}
+
+void IntermediateResult::release_join_input(JoinInput &input) {
+  if (input.is_view)
+    return;
+  if (input.shared != nullptr) {
+    relation_storage.joinable_cache->release(input.shared);
+  } else {
+    input.free();
+  }
+}
+
+const FilteredRows *IntermediateResult::filter_relation(size_t global_relation_index, StretchyBuf<Predicate> &filters,
+                                                        FilteredRows *own_rows) {
+  FilterCache *cache = relation_storage.filter_cache;
+  FilterCacheKey cache_key = FilterCacheKey::create(global_relation_index, filters);
+  bool use_cache = cache != nullptr && cache_key.can_be_cached();
+  if (use_cache) {
+    const FilteredRows *cached = cache->acquire(cache_key);
+    if (cached != nullptr)
+      return cached;
+  }
+  *own_rows = relation_storage[global_relation_index].filter(filters);
+  if (use_cache) {
+    // If another query cached the same rows first, "own_rows" is freed and theirs are shared.
+    const FilteredRows *cached = cache->insert(cache_key, *own_rows, own_rows->byte_size());
+    if (cached != nullptr)
+      return cached;
+  }
+  return own_rows;
+}
+
+void IntermediateResult::release_filtered_rows(const FilteredRows *rows, FilteredRows *own_rows) {
+  if (rows == own_rows) {
+    own_rows->free();
+  } else {
+    relation_storage.filter_cache->release(rows);
+  }
+}
+
+template<typename J>
+static inline void perform_sort_if_necessary(J lhs, J rhs, bool lhs_sorted, bool rhs_sorted) {
+  void (*sort)(J) = sort_wrapper;
   if (!lhs_sorted && !rhs_sorted) {
-    Future<void> lhs_future = scheduler.add_task(sort_wrapper, lhs);
-    Future<void> rhs_future = scheduler.add_task(sort_wrapper, rhs);
+    Future<void> lhs_future = scheduler.add_task(sort, lhs);
+    Future<void> rhs_future = scheduler.add_task(sort, rhs);
     lhs_future.wait();
     rhs_future.wait();
     lhs_future.free();
     rhs_future.free();
   } else if (!lhs_sorted) {
     sort_wrapper(lhs);
-  } else {
+  } else if (!rhs_sorted) {
     sort_wrapper(rhs);
   }
 }
 
+static JoinResult perform_join(IntermediateResult::JoinAlgorithm algorithm,
+                               JoinInput lhs, JoinInput rhs,
+                               bool lhs_sorted, bool rhs_sorted) {
+  switch (algorithm) {
+    case IntermediateResult::JoinAlgorithm::NESTED_LOOP:
+      assert(!lhs.is_packed && !rhs.is_packed);
+      return NestedLoopJoin{}(lhs.wide, rhs.wide);
+    case IntermediateResult::JoinAlgorithm::DENSE_ARRAY:
+      assert(!lhs.is_packed && !rhs.is_packed);
+      return DenseArrayJoin{&scheduler}(lhs.wide, rhs.wide);
+    case IntermediateResult::JoinAlgorithm::HASH:
+      assert(!lhs.is_packed && !rhs.is_packed);
+      return HashJoin{&scheduler}(lhs.wide, rhs.wide);
+    case IntermediateResult::JoinAlgorithm::SORT_MERGE:
+      break;
+  }
+  assert(lhs.is_packed == rhs.is_packed);
+  Join join{&scheduler};
+  if (lhs.is_packed) {
+    perform_sort_if_necessary(lhs.packed, rhs.packed, lhs_sorted, rhs_sorted);
+    return join(lhs.packed, rhs.packed);
+  }
+  perform_sort_if_necessary(lhs.wide, rhs.wide, lhs_sorted, rhs_sorted);
+  return join(lhs.wide, rhs.wide);
+}
+
+template<typename J>
+static StretchyBuf<JoinGroup> perform_join_groups(J lhs, J rhs, bool lhs_sorted, bool rhs_sorted) {
+  perform_sort_if_necessary(lhs, rhs, lhs_sorted, rhs_sorted);
+  Join join{&scheduler};
+  return join.groups(lhs, rhs);
+}
+
+/**
+ * Builds a column of the left side of a join result.
+ * Every left row id is mapped through "column" and repeated once for each right row id matched to it.
+ * If "column" is null, the left row ids are used as they are.
+ */
+static StretchyBuf<u64> expand_left_column(const JoinResult &join_result, const u64 *column) {
+  StretchyBuf<u64> res(join_result.row_count());
+  const size_t *offsets = join_result.offsets.data;
+  for (size_t i = 0; i < join_result.left_count(); ++i) {
+    uint64_t rowid = join_result.left_row_ids.data[i].v;
+    u64 value = column != nullptr ? column[rowid] : u64(rowid);
+    for (size_t k = offsets[i]; k < offsets[i + 1]; ++k) {
+      res.data[k] = value;
+    }
+  }
+  res.len = join_result.row_count();
+  return res;
+}
+
+/**
+ * Takes the right row ids out of a join result, to be used as an ir column without copying them.
+ */
+static StretchyBuf<u64> take_right_row_ids(JoinResult &join_result) {
+  StretchyBuf<u64> res = join_result.right_row_ids;
+  join_result.right_row_ids = StretchyBuf<u64>();
+  return res;
+}
+
 void IntermediateResult::execute_initial_join(size_t left_relation_index,
                                               size_t left_key_index,
                                               size_t right_relation_index,
@@ -113,49 +414,51 @@ void IntermediateResult::execute_initial_join(size_t left_relation_index,
   // Because this is the initial join_with_ir, make sure the ir is empty.
   // Otherwise the state of the ir is not valid.
   assert(this->is_empty());
-  // Get the two relations to join_with_ir as joinables.
-  Joinable r_left = relation_storage[get_global_relation_index(left_relation_index)]
-      .to_joinable(left_key_index, get_relation_filters(left_relation_index));
-  Joinable r_right = relation_storage[get_global_relation_index(right_relation_index)]
-      .to_joinable(right_key_index,
-                   left_relation_index != right_relation_index ?
-                   get_relation_filters(right_relation_index) : StretchyBuf<Predicate>());
-  if (r_left.size == 0 || r_right.size == 0) {
+  StretchyBuf<Predicate> left_filters = get_relation_filters(left_relation_index);
+  StretchyBuf<Predicate> right_filters = left_relation_index != right_relation_index ?
+                                         get_relation_filters(right_relation_index) : StretchyBuf<Predicate>();
+  JoinSideStats lhs_stats = relation_join_stats(left_relation_index, left_key_index, left_filters);
+  JoinSideStats rhs_stats = relation_join_stats(right_relation_index, right_key_index, right_filters);
+  JoinAlgorithm algorithm = choose_join_algorithm(left_relation_index, left_key_index, lhs_stats,
+                                                  right_relation_index, right_key_index, rhs_stats);
+  size_t left_row_n = relation_storage[get_global_relation_index(left_relation_index)].row_count();
+  size_t right_row_n = relation_storage[get_global_relation_index(right_relation_index)].row_count();
+  bool packed = algorithm == JoinAlgorithm::SORT_MERGE &&
+      join_key_can_be_packed(left_relation_index, left_key_index, left_row_n) &&
+      join_key_can_be_packed(right_relation_index, right_key_index, right_row_n);
+  // Get the two relations to join_with_ir as joinables, sorted only for a merge join.
+  bool sort_inputs = algorithm == JoinAlgorithm::SORT_MERGE;
+  bool lhs_sorted = sort_inputs;
+  bool rhs_sorted = sort_inputs;
+  JoinInput r_left = relation_to_join_input(left_relation_index, left_key_index, left_filters, packed, sort_inputs);
+  JoinInput r_right = relation_to_join_input(right_relation_index, right_key_index, right_filters,
+                                             packed, sort_inputs);
+  left_filters.free();
+  right_filters.free();
+  if (r_left.size() == 0 || r_right.size() == 0) {
     // Exit the query execution...
+    release_join_input(r_left);
+    release_join_input(r_right);
     this->row_n = 0;
-    this->operator[](left_relation_index) = StretchyBuf<u64>(0);
-    this->operator[](right_relation_index) = StretchyBuf<u64>(0);
+    set_column(left_relation_index, StretchyBuf<u64>(0));
+    set_column(right_relation_index, StretchyBuf<u64>(0));
     return;
   }
 
-  bool lhs_sorted = relation_is_sorted(left_relation_index, left_key_index);
-  bool rhs_sorted = relation_is_sorted(right_relation_index, right_key_index);
-  perform_sort_if_necessary(r_left, r_right, lhs_sorted, rhs_sorted);
-
-  Join join;
-  auto join_result = join(r_left, r_right);
-  r_left.clear_and_free();
-  r_right.clear_and_free();
-  StretchyBuf<u64> column1;
-  StretchyBuf<u64> column2;
-  for (auto join_row: join_result) {
-    auto rowid_1 = join_row.first;
-    for (auto rowid_2: join_row.second) {
-      column1.push(rowid_1);
-      column2.push(rowid_2);
-    }
-  }
-  free_join_result(join_result);
-  this->operator[](left_relation_index) = column1;
-  this->operator[](right_relation_index) = column2;
+  auto join_result = perform_join(algorithm, r_left, r_right, lhs_sorted, rhs_sorted);
+  record_join(algorithm, r_left, r_right, join_result);
+  release_join_input(r_left);
+  release_join_input(r_right);
+  StretchyBuf<u64> column1 = expand_left_column(join_result, nullptr);
+  StretchyBuf<u64> column2 = take_right_row_ids(join_result);
+  join_result.free();
+  set_column(left_relation_index, column1);
+  set_column(right_relation_index, column2);
   this->column_n = 2;
-  this->row_n = column1.len;
+  this->row_n = column2.len;
 
   // Update information about the sorting state of the ir. Later used as optimization.
-  this->sorting.sorted_relation_index_1 = left_relation_index;
-  this->sorting.relation_1_sorting_key = left_key_index;
-  this->sorting.sorted_relation_index_2 = right_relation_index;
-  this->sorting.relation_2_sorting_key = right_key_index;
+  update_sorting(algorithm, lhs_sorted, left_relation_index, left_key_index, right_relation_index, right_key_index);
 }
 
 IntermediateResult IntermediateResult::join_with_ir(IntermediateResult &ir,
@@ -167,72 +470,52 @@ IntermediateResult IntermediateResult::join_with_ir(IntermediateResult &ir,
   if (this->row_n == 0 || ir.row_n == 0) {
     for (size_t i = 0; i < ir.column_n; i++) {
       if (ir.column_is_allocated(i))
-        this->operator[](i) = StretchyBuf<u64>(0);
+        set_column(i, StretchyBuf<u64>(0));
     }
     ir.clear_and_free();
     this->column_n += ir.column_n;
     return *this;
   }
-  Joinable r_this = this->to_joinable(this_relation_index, this_key_index);
-  Joinable r_right = ir.to_joinable(right_relation_index, right_key_index);
-  if (r_this.size == 0 || r_right.size == 0) {
+  bool lhs_sorted = relation_is_sorted(this_relation_index, this_key_index);
+  bool rhs_sorted = ir.relation_is_sorted(right_relation_index, right_key_index);
+  JoinAlgorithm algorithm = choose_join_algorithm(this_relation_index, this_key_index,
+                                                  ir_join_stats(this_relation_index, this_key_index),
+                                                  right_relation_index, right_key_index,
+                                                  ir.ir_join_stats(right_relation_index, right_key_index));
+  bool packed = algorithm == JoinAlgorithm::SORT_MERGE &&
+      join_key_can_be_packed(this_relation_index, this_key_index, this->row_n) &&
+      ir.join_key_can_be_packed(right_relation_index, right_key_index, ir.row_n);
+  JoinInput r_this = this->to_join_input(this_relation_index, this_key_index, packed);
+  JoinInput r_right = ir.to_join_input(right_relation_index, right_key_index, packed);
+  if (r_this.size() == 0 || r_right.size() == 0) {
     // Exit the query execution...
+    r_this.free();
+    r_right.free();
     this->row_n = 0;
     ir.clear_and_free();
     return *this;
   }
 
-  bool lhs_sorted = relation_is_sorted(this_relation_index, this_key_index);
-  bool rhs_sorted = relation_is_sorted(right_relation_index, right_key_index);
-  perform_sort_if_necessary(r_this, r_right, lhs_sorted, rhs_sorted);
-
-  Join join;
-  auto join_result = join(r_this, r_right);
-  r_this.clear_and_free();
-  r_right.clear_and_free();
-  // Loop for the allocated existing columns.
-  for (size_t j = 0; j < this->max_column_n; ++j) {
-    if (!column_is_allocated(j))
-      continue;
-    StretchyBuf<u64> aux_column(join_result.len);
-    auto current_column = this->operator[](j);
-    for (auto join_row: join_result) {
-      auto rowid_1 = join_row.first;
-      size_t len = join_row.second.len;
-      while (len--) { // For each item of the second list.
-        aux_column.push(current_column[rowid_1]);
-      }
-    }
-    current_column.free();
-    this->operator[](j) = aux_column;
-  }
+  auto join_result = perform_join(algorithm, r_this, r_right, lhs_sorted, rhs_sorted);
+  record_join(algorithm, r_this, r_right, join_result);
+  r_this.free();
+  r_right.free();
+  // The existing columns are not rewritten, the join only adds a selection for them.
+  push_selection(expand_left_column(join_result, nullptr));
   // Loop for the new columns that will be added from param ir.
   for (size_t j = 0; j < this->max_column_n; ++j) {
     if (!ir.column_is_allocated(j))
       continue;
-    StretchyBuf<u64> aux_column(join_result.len);
-    auto current_column = ir[j];
-    for (auto join_row: join_result) {
-      auto rowid_1 = join_row.first;
-      for (auto rowid_2: join_row.second) {
-        aux_column.push(current_column[rowid_2]);
-      }
-    }
-    this->operator[](j) = aux_column;
+    set_column(j, ir.gather_column(j, join_result.right_row_ids.data, join_result.row_count()));
   }
-
-  this->row_n = join_result.len;
-  free_join_result(join_result);
+  join_result.free();
   this->column_n += ir.column_n;
 
   // Dont forget to delete the param ir.
   ir.free();
 
   // Update information about the sorting state of the ir. Later used as optimization.
-  this->sorting.sorted_relation_index_1 = this_relation_index;
-  this->sorting.relation_1_sorting_key = this_key_index;
-  this->sorting.sorted_relation_index_2 = right_relation_index;
-  this->sorting.relation_2_sorting_key = right_key_index;
+  update_sorting(algorithm, lhs_sorted, this_relation_index, this_key_index, right_relation_index, right_key_index);
   return *this;
 }
 
@@ -244,65 +527,53 @@ void IntermediateResult::execute_common_join(size_t existing_relation_index,
   assert(!column_is_allocated(new_relation_index));
   if (this->row_n == 0) {
     column_n++;
-    this->operator[](existing_relation_index) = StretchyBuf<u64>(0);
-    this->operator[](new_relation_index) = StretchyBuf<u64>(0);
+    set_column(existing_relation_index, StretchyBuf<u64>(0));
+    set_column(new_relation_index, StretchyBuf<u64>(0));
     return;
   }
-  Joinable r_existing = this->to_joinable(existing_relation_index, existing_relation_key_index);
-  Joinable r_new = relation_storage[get_global_relation_index(new_relation_index)]
-      .to_joinable(new_relation_key_index, get_relation_filters(new_relation_index));
-  if (r_existing.size == 0 || r_new.size == 0) {
+  StretchyBuf<Predicate> new_filters = get_relation_filters(new_relation_index);
+  JoinSideStats existing_stats = ir_join_stats(existing_relation_index, existing_relation_key_index);
+  JoinSideStats new_stats = relation_join_stats(new_relation_index, new_relation_key_index, new_filters);
+  JoinAlgorithm algorithm = choose_join_algorithm(existing_relation_index, existing_relation_key_index, existing_stats,
+                                                  new_relation_index, new_relation_key_index, new_stats);
+  size_t new_row_n = relation_storage[get_global_relation_index(new_relation_index)].row_count();
+  bool packed = algorithm == JoinAlgorithm::SORT_MERGE &&
+      join_key_can_be_packed(existing_relation_index, existing_relation_key_index, this->row_n) &&
+      join_key_can_be_packed(new_relation_index, new_relation_key_index, new_row_n);
+  JoinInput r_existing = this->to_join_input(existing_relation_index, existing_relation_key_index, packed);
+  bool sort_new = algorithm == JoinAlgorithm::SORT_MERGE;
+  bool lhs_sorted = existing_stats.sorted;
+  // The order of the new relation only matters to a merge join.
+  bool rhs_sorted = sort_new;
+  JoinInput r_new = relation_to_join_input(new_relation_index, new_relation_key_index, new_filters, packed, sort_new);
+  new_filters.free();
+  if (r_existing.size() == 0 || r_new.size() == 0) {
     // Exit the query execution...
+    r_existing.free();
+    release_join_input(r_new);
     this->row_n = 0;
     column_n++;
-    this->operator[](existing_relation_index) = StretchyBuf<u64>(0);
-    this->operator[](new_relation_index) = StretchyBuf<u64>(0);
+    set_column(existing_relation_index, StretchyBuf<u64>(0));
+    set_column(new_relation_index, StretchyBuf<u64>(0));
     return;
   }
 
-  bool lhs_sorted = relation_is_sorted(existing_relation_index, existing_relation_key_index);
-  bool rhs_sorted = relation_is_sorted(new_relation_index, new_relation_key_index);
-  perform_sort_if_necessary(r_existing, r_new, lhs_sorted, rhs_sorted);
-
-  Join join;
-  auto join_result = join(r_existing, r_new);
-  r_existing.clear_and_free();
-  r_new.clear_and_free();
-  // Loop for the allocated existing columns.
-  for (size_t j = 0; j < this->max_column_n; ++j) {
-    if (!column_is_allocated(j))
-      continue;
-    StretchyBuf<u64> aux_column(join_result.len);
-    auto current_column = this->operator[](j);
-    for (auto join_row: join_result) {
-      auto rowid_1 = join_row.first;
-      size_t len = join_row.second.len;
-      while (len--) { // For each item of the second list.
-        aux_column.push(current_column[rowid_1]);
-      }
-    }
-    current_column.free();
-    this->operator[](j) = aux_column;
-  }
+  auto join_result = perform_join(algorithm, r_existing, r_new, lhs_sorted, rhs_sorted);
+  record_join(algorithm, r_existing, r_new, join_result);
+  r_existing.free();
+  release_join_input(r_new);
+  // The existing columns are not rewritten, the join only adds a selection for them.
+  push_selection(expand_left_column(join_result, nullptr));
   // Double check...
   assert(!column_is_allocated(new_relation_index));
 
-  StretchyBuf<u64> aux_column(join_result.len);
-  for (auto join_row: join_result) {
-    for (auto rowid_2: join_row.second) { // For each item of the second list.
-      aux_column.push(rowid_2);
-    }
-  }
-  free_join_result(join_result);
-  this->operator[](new_relation_index) = aux_column;
+  set_column(new_relation_index, take_right_row_ids(join_result));
+  join_result.free();
   this->column_n++;
-  this->row_n = aux_column.len;
 
   // Update information about the sorting state of the ir. Later used as optimization.
-  this->sorting.sorted_relation_index_1 = existing_relation_index;
-  this->sorting.relation_1_sorting_key = existing_relation_key_index;
-  this->sorting.sorted_relation_index_2 = new_relation_index;
-  this->sorting.relation_2_sorting_key = new_relation_key_index;
+  update_sorting(algorithm, lhs_sorted, existing_relation_index, existing_relation_key_index,
+                 new_relation_index, new_relation_key_index);
 }
 
 void IntermediateResult::execute_join_as_filter(size_t left_relation_index,
@@ -314,56 +585,331 @@ void IntermediateResult::execute_join_as_filter(size_t left_relation_index,
   if (this->row_n == 0)
     return;
   // Find the row_ids of the ir that match the filter.
-  StretchyBuf<size_t> ir_rowids;
-  for (size_t i = 0; i < this->row_n; i++) {
-    auto left_rowid = this->operator[](left_relation_index)[i];
-    auto left_value =
-        relation_storage[get_global_relation_index(left_relation_index)][left_key_index][left_rowid];
-    auto right_rowid = this->operator[](right_relation_index)[i];
-    auto right_value =
-        relation_storage[get_global_relation_index(right_relation_index)][right_key_index][right_rowid];
-    if (left_value == right_value) {
-      ir_rowids.push(i);
+  const u64 *left_rowids = materialize(left_relation_index).data;
+  const u64 *right_rowids = materialize(right_relation_index).data;
+  const u64 *left_keys = relation_storage[get_global_relation_index(left_relation_index)][left_key_index].data;
+  const u64 *right_keys = relation_storage[get_global_relation_index(right_relation_index)][right_key_index].data;
+  size_t nr_chunks = std::max((size_t) 1U, std::min(4U * (scheduler.thread_count() + 1U), row_n / min_gather_chunk));
+  size_t chunk_size = (row_n + nr_chunks - 1U) / nr_chunks;
+  // Every chunk compacts its matches to the start of its own range, then they are copied next to each other.
+  StretchyBuf<u64> matches(this->row_n);
+  StretchyBuf<size_t> match_counts(nr_chunks);
+  match_counts.len = nr_chunks;
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    auto *left_values = (u64 *) malloc(gather_batch * sizeof(u64));
+    auto *right_values = (u64 *) malloc(gather_batch * sizeof(u64));
+    assert(left_values && right_values);
+    size_t chunk_from = std::min(row_n, chunk * chunk_size);
+    size_t to = std::min(row_n, chunk_from + chunk_size);
+    u64 *out = matches.data + chunk_from;
+    size_t count = 0;
+    for (size_t from = chunk_from; from < to; from += gather_batch) {
+      size_t n = std::min(gather_batch, to - from);
+      gather(left_keys, left_rowids + from, n, left_values);
+      gather(right_keys, right_rowids + from, n, right_values);
+      // Without branches, so that the loop doesn't depend on guessing the matches.
+      for (size_t k = 0; k < n; ++k) {
+        out[count] = from + k;
+        count += left_values[k].v == right_values[k].v;
+      }
     }
+    match_counts[chunk] = count;
+    ::free(left_values);
+    ::free(right_values);
+  });
+  StretchyBuf<size_t> offsets(nr_chunks);
+  size_t total = 0;
+  for (size_t count : match_counts) {
+    offsets.push(total);
+    total += count;
   }
-  // Loop for the allocated existing columns.
-  for (size_t j = 0; j < this->max_column_n; ++j) {
-    if (!column_is_allocated(j))
+  StretchyBuf<u64> ir_rowids(std::max(total, (size_t) 1U));
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    memcpy(ir_rowids.data + offsets[chunk], matches.data + chunk * chunk_size, match_counts[chunk] * sizeof(u64));
+  });
+  ir_rowids.len = total;
+  matches.free();
+  match_counts.free();
+  offsets.free();
+  // The columns are not rewritten, the filter only adds a selection for them.
+  push_selection(ir_rowids);
+}
+
+// Below this many entries per chunk, summing is not worth splitting among threads.
+static constexpr size_t min_aggregate_chunk = 16U * 1024U;
+
+/**
+ * Splits the groups with more entries than "max_entries" (e.g. the group of a hot key) on their bigger side,
+ * so that they can be summed by several tasks. The sums stay the same: every piece keeps all the entries
+ * of the other side, so a row of the split side is still repeated once for every row of the other side,
+ * and a row of the other side is repeated once for every row of each piece.
+ */
+static StretchyBuf<JoinGroup> split_heavy_groups(StretchyBuf<JoinGroup> groups, size_t max_entries) {
+  StretchyBuf<JoinGroup> res(std::max(groups.len, (size_t) 1U));
+  for (JoinGroup group : groups) {
+    size_t lhs_n = group.lhs_to - group.lhs_from;
+    size_t rhs_n = group.rhs_to - group.rhs_from;
+    if (lhs_n + rhs_n <= max_entries) {
+      res.push(group);
       continue;
-    StretchyBuf<u64> aux_column(ir_rowids.len);
-    auto current_column = this->operator[](j);
-    for (auto ir_rowid: ir_rowids) {
-      aux_column.push(current_column[ir_rowid]);
     }
-    current_column.free();
-    this->operator[](j) = aux_column;
+    bool split_lhs = lhs_n >= rhs_n;
+    size_t split_n = split_lhs ? lhs_n : rhs_n;
+    size_t other_n = split_lhs ? rhs_n : lhs_n;
+    size_t piece_n = std::max(max_entries - std::min(other_n, max_entries / 2U), (size_t) 1U);
+    for (size_t from = 0U; from < split_n; from += piece_n) {
+      size_t to = std::min(split_n, from + piece_n);
+      JoinGroup piece = group;
+      if (split_lhs) {
+        piece.lhs_from = group.lhs_from + from;
+        piece.lhs_to = group.lhs_from + to;
+      } else {
+        piece.rhs_from = group.rhs_from + from;
+        piece.rhs_to = group.rhs_from + to;
+      }
+      res.push(piece);
+    }
   }
-  this->row_n = ir_rowids.len;
+  groups.free();
+  return res;
 }
 
-StretchyBuf<uint64_t> IntermediateResult::execute_select(Array<Pair<int, int>> relation_column_pairs) {
+static StretchyBuf<uint64_t> zero_sums(size_t nr_sums) {
   StretchyBuf<uint64_t> result;
-  for (auto pair: relation_column_pairs) {
-    size_t relation_index = pair.first;
-    size_t column_index = pair.second;
-    if (this->row_n == 0) {
-      result.push(0);
-      continue;
+  for (size_t i = 0; i < nr_sums; ++i) {
+    result.push(0);
+  }
+  return result;
+}
+
+StretchyBuf<uint64_t> IntermediateResult::aggregate_join(JoinInput lhs, AggregateSide lhs_side, bool lhs_sorted,
+                                                         JoinInput rhs, AggregateSide rhs_side, bool rhs_sorted,
+                                                         Array<Pair<int, int>> relation_column_pairs) {
+  if (lhs.size() == 0 || rhs.size() == 0) {
+    release_join_input(lhs);
+    release_join_input(rhs);
+    return zero_sums(relation_column_pairs.size);
+  }
+  assert(lhs.is_packed == rhs.is_packed);
+  StretchyBuf<JoinGroup> groups = lhs.is_packed ?
+                                  perform_join_groups(lhs.packed, rhs.packed, lhs_sorted, rhs_sorted) :
+                                  perform_join_groups(lhs.wide, rhs.wide, lhs_sorted, rhs_sorted);
+
+  /**
+   * What every sum of the select clause needs: the values of the column, the side of the join
+   * the relation is in and, if that side is an ir, the column of the ir that maps its rows to the relation.
+   */
+  struct SumColumn {
+    const u64 *values;
+    const u64 *ir_rowids;
+    bool is_left;
+  };
+  size_t nr_sums = relation_column_pairs.size;
+  SumColumn *columns = new SumColumn[nr_sums];
+  for (size_t s = 0; s < nr_sums; ++s) {
+    size_t relation_index = relation_column_pairs[s].first;
+    size_t column_index = relation_column_pairs[s].second;
+    bool is_left = lhs_side.contains(relation_index);
+    AggregateSide side = is_left ? lhs_side : rhs_side;
+    assert(side.contains(relation_index));
+    columns[s].values = relation_storage[get_global_relation_index(relation_index)][column_index].data;
+    columns[s].ir_rowids = side.ir != nullptr ? side.ir->materialize(relation_index).data : nullptr;
+    columns[s].is_left = is_left;
+  }
+
+  // The work of a group is the number of its entries, so the chunks are split on equal numbers of entries.
+  size_t nr_entries = 0U;
+  for (JoinGroup group : groups) {
+    nr_entries += (group.lhs_to - group.lhs_from) + (group.rhs_to - group.rhs_from);
+  }
+  size_t max_chunks = 4U * (scheduler.thread_count() + 1U);
+  size_t nr_chunks = std::max((size_t) 1U, std::min(max_chunks, nr_entries / min_aggregate_chunk));
+  size_t chunk_entries = (nr_entries + nr_chunks - 1U) / nr_chunks;
+  if (nr_chunks != 1U) {
+    groups = split_heavy_groups(groups, chunk_entries);
+  }
+  size_t *chunk_bounds = new size_t[nr_chunks + 1U];
+  chunk_bounds[0] = 0U;
+  size_t g = 0U;
+  size_t entries = 0U;
+  for (size_t chunk = 1U; chunk < nr_chunks; ++chunk) {
+    while (g != groups.len && entries < chunk * chunk_entries) {
+      entries += (groups.data[g].lhs_to - groups.data[g].lhs_from) + (groups.data[g].rhs_to - groups.data[g].rhs_from);
+      ++g;
+    }
+    chunk_bounds[chunk] = g;
+  }
+  chunk_bounds[nr_chunks] = groups.len;
+  uint64_t *partial_sums = (uint64_t *) calloc(nr_chunks * nr_sums, sizeof(uint64_t));
+  assert(partial_sums);
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    uint64_t *sums = partial_sums + chunk * nr_sums;
+    for (size_t g = chunk_bounds[chunk]; g < chunk_bounds[chunk + 1U]; ++g) {
+      JoinGroup group = groups.data[g];
+      for (size_t s = 0; s < nr_sums; ++s) {
+        SumColumn column = columns[s];
+        const JoinInput &input = column.is_left ? lhs : rhs;
+        size_t from = column.is_left ? group.lhs_from : group.rhs_from;
+        size_t end = column.is_left ? group.lhs_to : group.rhs_to;
+        uint64_t fanout = column.is_left ? group.rhs_to - group.rhs_from : group.lhs_to - group.lhs_from;
+        uint64_t group_sum = 0;
+        for (size_t k = from; k < end; ++k) {
+          uint64_t rowid = input.row_id(k);
+          if (column.ir_rowids != nullptr) {
+            rowid = column.ir_rowids[rowid].v;
+          }
+          group_sum += column.values[rowid].v;
+        }
+        // Every row of the group is repeated once for every matching row of the other side.
+        sums[s] += group_sum * fanout;
+      }
     }
-    // Assert that we are requesting columns that exist in the ir.
-    // assert(column_is_allocated(relation_index)); // Removed this due to empty ir's.
-    // Use these rowids to index into the relation data.
-    auto rowids = this->operator[](relation_index);
+  });
+
+  StretchyBuf<uint64_t> result;
+  for (size_t s = 0; s < nr_sums; ++s) {
     uint64_t sum = 0;
-    for (auto rowid: rowids) {
-      // Accumulate the specified column value into a sum.
-      sum = sum
-          + this->relation_storage[get_global_relation_index(relation_index)][column_index][rowid].v;
+    for (size_t chunk = 0; chunk < nr_chunks; ++chunk) {
+      sum += partial_sums[chunk * nr_sums + s];
     }
-    // Push the sum of each selected column into a collection.
-    // The order of the sums of each column is the same as the order in the parameter collection.
     result.push(sum);
   }
+  ::free(partial_sums);
+  delete[] chunk_bounds;
+  delete[] columns;
+  groups.free();
+  release_join_input(lhs);
+  release_join_input(rhs);
+  return result;
+}
+
+StretchyBuf<uint64_t> IntermediateResult::execute_join_and_select(const Predicate &predicate,
+                                                                  Array<Pair<int, int>> relation_column_pairs) {
+  if (previous_join != nullptr) {
+    previous_join->wait();
+  }
+  size_t left_relation_index = predicate.lhs.first;
+  size_t left_key_index = predicate.lhs.second;
+  size_t right_relation_index = predicate.rhs.first;
+  size_t right_key_index = predicate.rhs.second;
+  bool left_allocated = column_is_allocated(left_relation_index);
+  bool right_allocated = column_is_allocated(right_relation_index);
+  if ((left_allocated && right_allocated) || left_relation_index == right_relation_index) {
+    // Joins between relations of the ir are filters, they don't multiply the rows.
+    execute_join(left_relation_index, left_key_index, right_relation_index, right_key_index);
+    return execute_select(relation_column_pairs);
+  }
+  if (right_allocated) {
+    std::swap(left_relation_index, right_relation_index);
+    std::swap(left_key_index, right_key_index);
+    std::swap(left_allocated, right_allocated);
+  }
+  if (left_allocated && this->row_n == 0) {
+    return zero_sums(relation_column_pairs.size);
+  }
+
+  // The result is not materialized, so a hash join has nothing to gain over sorting its inputs.
+  bool lhs_sorted = relation_is_sorted(left_relation_index, left_key_index);
+  bool rhs_sorted = relation_is_sorted(right_relation_index, right_key_index);
+  size_t left_row_n = left_allocated ?
+                      this->row_n : relation_storage[get_global_relation_index(left_relation_index)].row_count();
+  size_t right_row_n = relation_storage[get_global_relation_index(right_relation_index)].row_count();
+  bool packed = join_key_can_be_packed(left_relation_index, left_key_index, left_row_n) &&
+      join_key_can_be_packed(right_relation_index, right_key_index, right_row_n);
+  StretchyBuf<Predicate> left_filters = left_allocated ?
+                                        StretchyBuf<Predicate>() : get_relation_filters(left_relation_index);
+  StretchyBuf<Predicate> right_filters = get_relation_filters(right_relation_index);
+  JoinInput lhs = left_allocated ?
+                  to_join_input(left_relation_index, left_key_index, packed) :
+                  relation_to_join_input(left_relation_index, left_key_index, left_filters, packed, true);
+  JoinInput rhs = relation_to_join_input(right_relation_index, right_key_index, right_filters, packed, true);
+  left_filters.free();
+  right_filters.free();
+  lhs_sorted = lhs_sorted || !left_allocated;
+  rhs_sorted = true;
+  AggregateSide lhs_side{left_allocated ? this : nullptr, left_relation_index};
+  AggregateSide rhs_side{nullptr, right_relation_index};
+  return aggregate_join(lhs, lhs_side, lhs_sorted, rhs, rhs_side, rhs_sorted, relation_column_pairs);
+}
+
+StretchyBuf<uint64_t> IntermediateResult::join_with_ir_and_select(IntermediateResult &ir,
+                                                                  size_t this_relation_index,
+                                                                  size_t this_key_index,
+                                                                  size_t right_relation_index,
+                                                                  size_t right_key_index,
+                                                                  Array<Pair<int, int>> relation_column_pairs) {
+  assert(column_is_allocated(this_relation_index));
+  if (this->row_n == 0 || ir.row_n == 0) {
+    ir.free();
+    return zero_sums(relation_column_pairs.size);
+  }
+  bool lhs_sorted = relation_is_sorted(this_relation_index, this_key_index);
+  bool rhs_sorted = ir.relation_is_sorted(right_relation_index, right_key_index);
+  bool packed = join_key_can_be_packed(this_relation_index, this_key_index, this->row_n) &&
+      ir.join_key_can_be_packed(right_relation_index, right_key_index, ir.row_n);
+  JoinInput lhs = to_join_input(this_relation_index, this_key_index, packed);
+  JoinInput rhs = ir.to_join_input(right_relation_index, right_key_index, packed);
+  auto result = aggregate_join(lhs, {this, this_relation_index}, lhs_sorted,
+                               rhs, {&ir, right_relation_index}, rhs_sorted, relation_column_pairs);
+  ir.free();
+  return result;
+}
+
+StretchyBuf<uint64_t> IntermediateResult::execute_select(Array<Pair<int, int>> relation_column_pairs) {
+  size_t nr_sums = relation_column_pairs.size;
+  if (this->row_n == 0 || nr_sums == 0)
+    return zero_sums(nr_sums);
+  // The relations of the select clause, in order of first appearance. Their columns are summed in one pass
+  // per relation, so that the row-ids of a relation are read once for all of its columns.
+  StretchyBuf<size_t> relations;
+  for (auto pair : relation_column_pairs) {
+    size_t relation_index = pair.first;
+    // A relation that isn't in the ir sums to 0.
+    if (column_is_allocated(relation_index) &&
+        std::find(relations.begin(), relations.end(), relation_index) == relations.end()) {
+      relations.push(relation_index);
+    }
+  }
+  size_t nr_chunks = std::max((size_t) 1U, std::min(4U * (scheduler.thread_count() + 1U), row_n / min_gather_chunk));
+  size_t chunk_size = (row_n + nr_chunks - 1U) / nr_chunks;
+  // The sums of every chunk, "nr_sums" per chunk.
+  StretchyBuf<uint64_t> partial_sums(nr_chunks * nr_sums);
+  partial_sums.len = nr_chunks * nr_sums;
+  scheduler.parallel_for(nr_chunks, [&](size_t chunk) {
+    uint64_t *sums = partial_sums.data + chunk * nr_sums;
+    for (size_t i = 0; i < nr_sums; ++i) {
+      sums[i] = 0U;
+    }
+    auto *positions = (u64 *) malloc(gather_batch * sizeof(u64));
+    auto *rowids = (u64 *) malloc(gather_batch * sizeof(u64));
+    assert(positions && rowids);
+    size_t to = std::min(row_n, (chunk + 1U) * chunk_size);
+    for (size_t relation_index : relations) {
+      const RelationData &relation = this->relation_storage[get_global_relation_index(relation_index)];
+      const u64 *column = this->operator[](relation_index).data;
+      for (size_t from = std::min(row_n, chunk * chunk_size); from < to; from += gather_batch) {
+        size_t n = std::min(gather_batch, to - from);
+        gather(column, column_positions(relation_index, nullptr, from, n, positions), n, rowids);
+        // The row-ids of the batch stay in the cache for the sums of all the columns of the relation.
+        for (size_t i = 0; i < nr_sums; ++i) {
+          if ((size_t) relation_column_pairs[i].first == relation_index) {
+            sums[i] += gather_sum(relation[relation_column_pairs[i].second].data, rowids, n);
+          }
+        }
+      }
+    }
+    ::free(positions);
+    ::free(rowids);
+  });
+  // The order of the sums is the order of the select clause.
+  StretchyBuf<uint64_t> result = zero_sums(nr_sums);
+  for (size_t chunk = 0; chunk < nr_chunks; ++chunk) {
+    for (size_t i = 0; i < nr_sums; ++i) {
+      result[i] += partial_sums[chunk * nr_sums + i];
+    }
+  }
+  partial_sums.free();
+  relations.free();
   return result;
 }
 
@@ -394,12 +940,6 @@ size_t IntermediateResult::get_global_relation_index(size_t local_relation_index
   return parse_query_result.actual_relations[local_relation_index];
 }
 
-void IntermediateResult::free_join_result(StretchyBuf<Join::JoinRow> &join_result) {
-  for (auto item: join_result)
-    item.second.free();
-  join_result.free();
-}
-
 bool IntermediateResult::relation_is_sorted(size_t relation_index, size_t key_index) {
   return (relation_index == sorting.sorted_relation_index_1 &&
       key_index == sorting.relation_1_sorting_key) ||
@@ -407,11 +947,79 @@ bool IntermediateResult::relation_is_sorted(size_t relation_index, size_t key_in
           key_index == sorting.relation_2_sorting_key);
 }
 
+JoinSideStats IntermediateResult::relation_join_stats(size_t relation_index, size_t key_index,
+                                                      const StretchyBuf<Predicate> &filters) {
+  const RelationData &relation = relation_storage[get_global_relation_index(relation_index)];
+  // The join input of a relation with a sorted index is made from the index, so it comes out sorted.
+  return JoinSideStats::for_relation(relation, key_index, filters, relation.has_sorted_index(key_index));
+}
+
+JoinSideStats IntermediateResult::ir_join_stats(size_t relation_index, size_t key_index) {
+  const RelationData &relation = relation_storage[get_global_relation_index(relation_index)];
+  return JoinSideStats::for_ir(relation, key_index, this->row_n, relation_is_sorted(relation_index, key_index));
+}
+
+IntermediateResult::JoinAlgorithm IntermediateResult::choose_join_algorithm(size_t left_relation_index,
+                                                                          size_t left_key_index,
+                                                                          const JoinSideStats &lhs,
+                                                                          size_t right_relation_index,
+                                                                          size_t right_key_index,
+                                                                          const JoinSideStats &rhs) {
+  bool reused = join_columns_are_reused(left_relation_index, left_key_index, right_relation_index, right_key_index);
+  return ::choose_join_algorithm(lhs, rhs, reused);
+}
+
+void IntermediateResult::record_join(JoinAlgorithm algorithm, const JoinInput &lhs, const JoinInput &rhs,
+                                     const JoinResult &result) {
+  if (profile != nullptr) {
+    profile->record(algorithm, lhs.size(), rhs.size(), result.row_count());
+  }
+}
+
+bool IntermediateResult::join_columns_are_reused(size_t left_relation_index, size_t left_key_index,
+                                                 size_t right_relation_index, size_t right_key_index) {
+  Pair<int, int> left{(int) left_relation_index, (int) left_key_index};
+  Pair<int, int> right{(int) right_relation_index, (int) right_key_index};
+  bool after_current = false;
+  for (auto predicate: this->parse_query_result.predicates) {
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    if (!after_current) {
+      after_current = (predicate.lhs == left && predicate.rhs == right) ||
+          (predicate.lhs == right && predicate.rhs == left);
+      continue;
+    }
+    if (predicate.lhs == left || predicate.lhs == right ||
+        predicate.rhs == left || predicate.rhs == right)
+      return true;
+  }
+  return false;
+}
+
+void IntermediateResult::update_sorting(JoinAlgorithm algorithm, bool lhs_sorted,
+                                        size_t left_relation_index, size_t left_key_index,
+                                        size_t right_relation_index, size_t right_key_index) {
+  if (algorithm == JoinAlgorithm::HASH || (algorithm != JoinAlgorithm::SORT_MERGE && !lhs_sorted)) {
+    // The output of a hash join is in no particular order, the others follow the order of the left hand side.
+    this->sorting.set_none();
+    return;
+  }
+  this->sorting.sorted_relation_index_1 = left_relation_index;
+  this->sorting.relation_1_sorting_key = left_key_index;
+  this->sorting.sorted_relation_index_2 = right_relation_index;
+  this->sorting.relation_2_sorting_key = right_key_index;
+}
+
 void IntermediateResult::free() {
   for (auto col: *this) {
     col.free();
   }
   this->clear_and_free();
+  for (auto selection: this->selections) {
+    selection.free();
+  }
+  this->selections.free();
+  this->column_generations.clear_and_free();
 }
 
 void IntermediateResult::execute_join(const Predicate &predicate) {
@@ -10,6 +10,7 @@
 #include "relation_storage.h"
 #include "parse.h"
 #include "task_scheduler.h"
+#include "join_planner.h"
 
 /**
  * Represents the intermediate result of a query predicate execution.
@@ -23,6 +24,8 @@
  */
 class IntermediateResult : public Array<StretchyBuf<u64>> {
  public:
+  using JoinAlgorithm = ::JoinAlgorithm;
+
   /**
    * Constructs an empty intermediate result that can hold up to
    * <max_column_n> columns corresponding to relations in the from clause
@@ -56,6 +59,20 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
                                   size_t this_relation_index, size_t this_key_index,
                                   size_t right_relation_index, size_t right_key_index);
 
+  /**
+   * Same as join_with_ir followed by execute_select, but the join result is never materialized.
+   * The sums are computed per group of matching keys: a group of l left and r right rows
+   * adds (sum of the left rows) * r for a column of the left side and (sum of the right rows) * l
+   * for a column of the right side. So it should be used for the last join of a query.
+   * The memory for the parameter ir is deallocated and it is no longer used.
+   * The rows of this ir are left as they were before the join.
+   * @return The sums, as returned by execute_select.
+   */
+  StretchyBuf<uint64_t> join_with_ir_and_select(IntermediateResult &ir,
+                                                size_t this_relation_index, size_t this_key_index,
+                                                size_t right_relation_index, size_t right_key_index,
+                                                Array<Pair<int, int>> relation_column_pairs);
+
   bool is_empty();
   size_t column_count();
   size_t row_count();
@@ -97,6 +114,14 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
 
   void execute_join(const Predicate &predicate);
 
+  /**
+   * Same as execute_join followed by execute_select, but the join result is never materialized
+   * (see join_with_ir_and_select). The ir can't be used for more joins after this call.
+   * @return The sums, as returned by execute_select.
+   */
+  StretchyBuf<uint64_t> execute_join_and_select(const Predicate &predicate,
+                                                Array<Pair<int, int>> relation_column_pairs);
+
   static void execute_join_static(IntermediateResult *ir, const Predicate &predicate);
 
   /**
@@ -104,6 +129,12 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
    */
   Future<void> *previous_join;
 
+  /**
+   * The profile that records the algorithm chosen for every join of the query, or null if they are not recorded.
+   * It's shared by all the intermediate results of the query.
+   */
+  JoinProfile *profile;
+
  private:
   /**
    * Creates a joinable object that contains <key, rowid> pairs.
@@ -117,6 +148,68 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
    */
   Joinable to_joinable(size_t relation_index, size_t key_index);
 
+  /**
+   * Same as to_joinable, but creates a packed joinable.
+   */
+  PackedJoinable to_packed_joinable(size_t relation_index, size_t key_index);
+
+  /**
+   * Creates the join input of a relation of the ir, packed or not.
+   */
+  JoinInput to_join_input(size_t relation_index, size_t key_index, bool packed);
+
+  /**
+   * Creates the join input of a relation that isn't in the ir yet, filtered by "filters".
+   * If "sorted" is set the input is sorted, and it is borrowed from the joinable cache of the relation storage
+   * when there is one. Otherwise it may come in any order. An unfiltered input is a view of the sorted index of the column, if it was built.
+   * Either way it must be given back with release_join_input.
+   */
+  JoinInput relation_to_join_input(size_t relation_index, size_t key_index,
+                                   StretchyBuf<Predicate> filters, bool packed, bool sorted);
+
+  /**
+   * Frees a join input, or unpins it if it is borrowed from the joinable cache. Views are left alone.
+   */
+  void release_join_input(JoinInput &input);
+
+  /**
+   * Filters a base relation. The rows are borrowed from the filter cache of the relation storage if it has them,
+   * otherwise they are filtered into "own_rows", and cached when there is a cache.
+   * Either way they must be given back with release_filtered_rows.
+   */
+  const FilteredRows *filter_relation(size_t global_relation_index, StretchyBuf<Predicate> &filters,
+                                      FilteredRows *own_rows);
+
+  void release_filtered_rows(const FilteredRows *rows, FilteredRows *own_rows);
+
+  /**
+   * Get's a boolean value specifying if the join column of a relation can be packed with row-ids
+   * in [0, row_count). The biggest value of the column is known from loading the relation.
+   */
+  bool join_key_can_be_packed(size_t relation_index, size_t key_index, size_t row_count);
+
+  /**
+   * A side of an aggregated join.
+   * If "ir" is null, the side is the relation at "relation_index" and the row-ids of its join input
+   * are row-ids of the relation. Otherwise they are rows of "ir".
+   */
+  struct AggregateSide {
+    IntermediateResult *ir;
+    size_t relation_index;
+
+    bool contains(size_t relation) {
+      return ir != nullptr ? ir->column_is_allocated(relation) : relation == relation_index;
+    }
+  };
+
+  /**
+   * Joins two join inputs with a merge join and computes the sums of the select clause over the join,
+   * per group of matching keys. The join inputs are freed.
+   */
+  StretchyBuf<uint64_t> aggregate_join(JoinInput lhs, AggregateSide lhs_side, bool lhs_sorted,
+                                       JoinInput rhs, AggregateSide rhs_side, bool rhs_sorted,
+                                       Array<Pair<int, int>> relation_column_pairs);
+
   void execute_join_as_filter(
       size_t left_relation_index, size_t left_key_index,
       size_t right_relation_index, size_t right_key_index);
@@ -137,10 +230,47 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
 
   size_t get_global_relation_index(size_t local_relation_index);
 
-  static void free_join_result(StretchyBuf<Join::JoinRow> &join_result);
-
   bool relation_is_sorted(size_t relation_index, size_t key_index);
 
+  /**
+   * Gets the stats of the join input of a relation that isn't in the ir yet, filtered by "filters".
+   */
+  JoinSideStats relation_join_stats(size_t relation_index, size_t key_index, const StretchyBuf<Predicate> &filters);
+
+  /**
+   * Gets the stats of the join input of a relation of the ir.
+   */
+  JoinSideStats ir_join_stats(size_t relation_index, size_t key_index);
+
+  /**
+   * Chooses the cheapest join algorithm for the join predicate on the specified relation-column pairs
+   * (see ::choose_join_algorithm). Sorting is worth more when a later join predicate
+   * can take advantage of the sorting of this one.
+   */
+  JoinAlgorithm choose_join_algorithm(size_t left_relation_index, size_t left_key_index, const JoinSideStats &lhs,
+                                      size_t right_relation_index, size_t right_key_index, const JoinSideStats &rhs);
+
+  /**
+   * Records a join in the profile of the query, if there is one.
+   */
+  void record_join(JoinAlgorithm algorithm, const JoinInput &lhs, const JoinInput &rhs, const JoinResult &result);
+
+  /**
+   * Get's a boolean value specifying if a join predicate that follows the one on the specified
+   * relation-column pairs joins on any of these pairs.
+   */
+  bool join_columns_are_reused(size_t left_relation_index, size_t left_key_index,
+                               size_t right_relation_index, size_t right_key_index);
+
+  /**
+   * Updates the sorting state of the ir after a join on the specified relation-column pairs.
+   * The algorithms other than sort-merge and hash keep the order of the left hand side,
+   * so the result is sorted if "lhs_sorted" is set.
+   */
+  void update_sorting(JoinAlgorithm algorithm, bool lhs_sorted,
+                      size_t left_relation_index, size_t left_key_index,
+                      size_t right_relation_index, size_t right_key_index);
+
   struct Sorting {
     void set_none();
     int sorted_relation_index_1;
@@ -154,6 +284,51 @@ class IntermediateResult : public Array<StretchyBuf<u64>> {
   size_t max_column_n;
   size_t column_n;
   size_t row_n;
+
+  /**
+   * The columns are materialized late.
+   * A join doesn't rewrite the columns of the relations that are already in the ir. It pushes a selection
+   * that maps its output rows to the rows of the ir before the join, and the columns are only brought
+   * up to date (see materialize) when they are read by a join or by the select clause.
+   * selections[g] maps the rows of generation g + 1 to the rows of generation g, so the current generation
+   * is selections.len, and column_generations[r] is the generation that the column of relation r is valid for.
+   */
+  StretchyBuf<StretchyBuf<u64>> selections;
+  Array<size_t> column_generations;
+
+  /**
+   * Sets the column of a relation, valid for the current generation.
+   */
+  void set_column(size_t relation_index, StretchyBuf<u64> column);
+
+  /**
+   * Starts a new generation whose rows are given by "selection" (row-ids of the current generation).
+   */
+  void push_selection(StretchyBuf<u64> selection);
+
+  /**
+   * Gets the row-ids of a relation for the rows "rows" of the current generation (or for all the rows
+   * if "rows" is null), by walking the selections back to the generation of the relation's column.
+   */
+  StretchyBuf<u64> gather_column(size_t relation_index, const u64 *rows, size_t row_count);
+
+  /**
+   * Maps the rows [from, from + n) of "rows" (or of the current generation, if "rows" is null) through
+   * the selections, to the positions in the column of a relation that they read.
+   * @param buffer Space for "n" positions. The result is "buffer", or "rows" if there is nothing to map.
+   */
+  const u64 *column_positions(size_t relation_index, const u64 *rows, size_t from, size_t n, u64 *buffer);
+
+  /**
+   * Brings the column of a relation up to the current generation.
+   * @return The column of the relation
+   */
+  const StretchyBuf<u64> &materialize(size_t relation_index);
+
+  /**
+   * Frees the selections that no column needs anymore.
+   */
+  void release_selections();
 };
 
 #endif //SORT_MERGE_JOIN__INTERMEDIATE_RESULT_H_
@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "join_order.h"
+#include "stretchy_buf.h"
+
+/**
+ * @return The fraction of the rows of a column that are in the range of its filters.
+ */
+static double filter_selectivity(ColumnStat stat, ColumnRange range) {
+  if (stat.histogram != nullptr)
+    return stat.histogram->selectivity(range);
+  return range.selectivity((uint64_t) stat.l, (uint64_t) stat.u, (size_t) stat.d);
+}
+
+/**
+ * The relations of a query, with their filters applied, and the join predicates between them.
+ */
+struct JoinGraph {
+  struct Edge {
+    int lhs;
+    int rhs;
+    // The fraction of the pairs of rows that pass the predicate.
+    double selectivity;
+  };
+
+  int relation_n;
+  double rows[max_relations];
+  // The fraction of the rows of a relation that pass its filters.
+  double row_fraction[max_relations];
+  // The filters of every relation, merged per column.
+  StretchyBuf<ColumnFilter> filters[max_relations];
+  uint32_t neighbors[max_relations];
+  StretchyBuf<Edge> edges;
+
+  JoinGraph(const ParseQueryResult &pqr, const Stats &stats);
+
+  /**
+   * @return The statistics of a column of a relation of the query, after its filters.
+   */
+  ColumnStat column_stat(int relation, int column) const;
+
+  /**
+   * @return The fraction of the pairs of rows that pass a join predicate.
+   */
+  double join_selectivity(const Predicate &join) const;
+
+  /**
+   * Turns every group of relations into a single node of the graph, with "group_rows" rows, and keeps only the
+   * join predicates from the "from"-th on. The predicates within a group of many relations filter its rows.
+   * The filters and the row fractions stay per relation.
+   */
+  void contract(const uint32_t *groups, const double *group_rows, int group_n, size_t from);
+
+  /**
+   * @return The estimated rows of the join of the relations of "relations".
+   */
+  double join_rows(uint32_t relations) const;
+
+  void free();
+
+ private:
+  const ParseQueryResult &pqr;
+  const Stats &stats;
+};
+
+JoinGraph::JoinGraph(const ParseQueryResult &pqr, const Stats &stats)
+    : relation_n{pqr.num_relations}, edges{}, pqr{pqr}, stats{stats} {
+  for (int r = 0; r < relation_n; ++r) {
+    const Array<ColumnStat> &columns = stats.relations[pqr.actual_relations[r]];
+    rows[r] = columns.size != 0 ? columns[0].f : 0.0;
+    row_fraction[r] = 1.0;
+    neighbors[r] = 0U;
+    StretchyBuf<Predicate> relation_filters{};
+    for (const Predicate &predicate : pqr.predicates) {
+      if (predicate.kind == PRED::FILTER && predicate.lhs.first == r)
+        relation_filters.push(predicate);
+    }
+    // The filters of a column are estimated together, so "> a" and "< b" is the range (a, b)
+    // rather than two independent filters.
+    filters[r] = merge_column_filters(relation_filters);
+    relation_filters.free();
+    for (ColumnFilter &filter : filters[r]) {
+      filter.selectivity = filter_selectivity(columns[filter.column], filter.range);
+      row_fraction[r] *= filter.selectivity;
+    }
+    rows[r] *= row_fraction[r];
+  }
+  for (const Predicate &predicate : pqr.predicates) {
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    double selectivity = join_selectivity(predicate);
+    if (predicate.lhs.first == predicate.rhs.first) {
+      // It filters the rows of a single relation.
+      rows[predicate.lhs.first] *= selectivity;
+      continue;
+    }
+    edges.push({predicate.lhs.first, predicate.rhs.first, selectivity});
+    neighbors[predicate.lhs.first] |= 1U << predicate.rhs.first;
+    neighbors[predicate.rhs.first] |= 1U << predicate.lhs.first;
+  }
+}
+
+ColumnStat JoinGraph::column_stat(int relation, int column) const {
+  ColumnStat stat = stats.relations[pqr.actual_relations[relation]][column];
+  for (const ColumnFilter &filter : filters[relation]) {
+    if (filter.column != (size_t) column)
+      continue;
+    stat.l = std::max(stat.l, (double) filter.range.min);
+    stat.u = std::min(stat.u, (double) filter.range.max);
+  }
+  // Filtering out a fraction of the rows leaves this fraction of the distinct values, if the rows of every value
+  // are spread uniformly.
+  double fraction = row_fraction[relation];
+  if (stat.d > 0.0 && stat.f > 0.0) {
+    stat.d *= 1.0 - std::pow(1.0 - fraction, stat.f / stat.d);
+  }
+  stat.d = std::min(stat.d, std::max(stat.u - stat.l + 1.0, 1.0));
+  stat.f *= fraction;
+  return stat;
+}
+
+void JoinGraph::free() {
+  for (int r = 0; r < pqr.num_relations; ++r) {
+    filters[r].free();
+  }
+  edges.free();
+}
+
+double JoinGraph::join_selectivity(const Predicate &join) const {
+  ColumnStat lhs = column_stat(join.lhs.first, join.lhs.second);
+  ColumnStat rhs = column_stat(join.rhs.first, join.rhs.second);
+  return std::max(lhs.l, rhs.l) > std::min(lhs.u, rhs.u) ? 0.0 : 1.0 / std::max({lhs.d, rhs.d, 1.0});
+}
+
+void JoinGraph::contract(const uint32_t *groups, const double *group_rows, int group_n, size_t from) {
+  int group_of[max_relations];
+  for (int g = 0; g < group_n; ++g) {
+    for (int r = 0; r < pqr.num_relations; ++r) {
+      if (groups[g] & (1U << r))
+        group_of[r] = g;
+    }
+    rows[g] = group_rows[g];
+    neighbors[g] = 0U;
+  }
+  edges.reset();
+  for (size_t i = from; i < pqr.predicates.size; ++i) {
+    const Predicate &predicate = pqr.predicates[i];
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    int lhs = group_of[predicate.lhs.first];
+    int rhs = group_of[predicate.rhs.first];
+    if (lhs == rhs) {
+      // The rows of a single relation are estimated with its own predicates already.
+      if ((groups[lhs] & (groups[lhs] - 1U)) != 0U)
+        rows[lhs] *= join_selectivity(predicate);
+      continue;
+    }
+    edges.push({lhs, rhs, join_selectivity(predicate)});
+    neighbors[lhs] |= 1U << rhs;
+    neighbors[rhs] |= 1U << lhs;
+  }
+  relation_n = group_n;
+}
+
+double JoinGraph::join_rows(uint32_t relations) const {
+  double res = 1.0;
+  for (int r = 0; r < relation_n; ++r) {
+    if (relations & (1U << r))
+      res *= rows[r];
+  }
+  for (const Edge &edge : edges) {
+    if ((relations & (1U << edge.lhs)) && (relations & (1U << edge.rhs)))
+      res *= edge.selectivity;
+  }
+  return res;
+}
+
+static int add_leaf(JoinTree &tree, const JoinGraph &graph, int relation) {
+  tree.nodes[tree.node_n] = {1U << relation, -1, -1, graph.rows[relation]};
+  return tree.node_n++;
+}
+
+static int add_join(JoinTree &tree, int left, int right, double rows) {
+  tree.nodes[tree.node_n] = {tree.nodes[left].relations | tree.nodes[right].relations, left, right, rows};
+  tree.cost += rows;
+  return tree.node_n++;
+}
+
+/**
+ * Adds the subtree of the best plan of "relations" to the tree.
+ * @return The node of the subtree.
+ */
+static int add_best_subtree(JoinTree &tree, const JoinGraph &graph, const uint32_t *best_split,
+                            const double *rows, uint32_t relations) {
+  if ((relations & (relations - 1U)) == 0U)
+    return add_leaf(tree, graph, __builtin_ctz(relations));
+  uint32_t left_relations = best_split[relations];
+  int left = add_best_subtree(tree, graph, best_split, rows, left_relations);
+  int right = add_best_subtree(tree, graph, best_split, rows, relations ^ left_relations);
+  return add_join(tree, left, right, rows[relations]);
+}
+
+/**
+ * Plans every connected subset of relations from the best plans of its parts, smallest subsets first.
+ * Splitting a subset into two connected parts always leaves a join predicate between them.
+ */
+static bool plan_exhaustively(const JoinGraph &graph, JoinTree &tree) {
+  uint32_t subset_n = 1U << graph.relation_n;
+  auto *rows = (double *) malloc(subset_n * sizeof(double));
+  auto *costs = (double *) malloc(subset_n * sizeof(double));
+  auto *best_split = (uint32_t *) malloc(subset_n * sizeof(uint32_t));
+  auto *connected = (bool *) malloc(subset_n * sizeof(bool));
+  assert(rows && costs && best_split && connected);
+  connected[0] = false;
+  rows[0] = 1.0;
+  for (uint32_t relations = 1U; relations < subset_n; ++relations) {
+    int lowest = __builtin_ctz(relations);
+    uint32_t rest = relations & (relations - 1U);
+    rows[relations] = rows[rest] * graph.rows[lowest];
+    for (const JoinGraph::Edge &edge : graph.edges) {
+      if ((edge.lhs == lowest && (rest & (1U << edge.rhs))) || (edge.rhs == lowest && (rest & (1U << edge.lhs))))
+        rows[relations] *= edge.selectivity;
+    }
+    costs[relations] = 0.0;
+    if (rest == 0U) {
+      connected[relations] = true;
+      continue;
+    }
+    // A connected subset has a relation that leaves the others connected without it, like a leaf of a spanning tree.
+    connected[relations] = false;
+    for (uint32_t left = relations; left != 0U && !connected[relations]; left &= left - 1U) {
+      int r = __builtin_ctz(left);
+      uint32_t others = relations ^ (1U << r);
+      connected[relations] = connected[others] && (graph.neighbors[r] & others) != 0U;
+    }
+    if (!connected[relations])
+      continue;
+    // Every split is tried once, with the lowest relation on the left.
+    double best_cost = HUGE_VAL;
+    for (uint32_t left = (relations - 1U) & relations; left != 0U; left = (left - 1U) & relations) {
+      uint32_t right = relations ^ left;
+      if ((left & (1U << lowest)) == 0U || !connected[left] || !connected[right])
+        continue;
+      double cost = costs[left] + costs[right];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_split[relations] = left;
+      }
+    }
+    costs[relations] = best_cost + rows[relations];
+  }
+  uint32_t all = subset_n - 1U;
+  bool is_connected = connected[all];
+  if (is_connected) {
+    tree.root = add_best_subtree(tree, graph, best_split, rows, all);
+  }
+  ::free(rows);
+  ::free(costs);
+  ::free(best_split);
+  ::free(connected);
+  return is_connected;
+}
+
+/**
+ * Joins the pair of connected subtrees with the smallest join, until a single tree is left.
+ */
+static bool plan_greedily(const JoinGraph &graph, JoinTree &tree) {
+  int subtrees[max_relations];
+  int subtree_n = graph.relation_n;
+  for (int r = 0; r < graph.relation_n; ++r) {
+    subtrees[r] = add_leaf(tree, graph, r);
+  }
+  while (subtree_n > 1) {
+    int best_i = -1;
+    int best_j = -1;
+    double best_rows = HUGE_VAL;
+    for (int i = 0; i < subtree_n; ++i) {
+      uint32_t lhs = tree.nodes[subtrees[i]].relations;
+      uint32_t lhs_neighbors = 0U;
+      for (int r = 0; r < graph.relation_n; ++r) {
+        if (lhs & (1U << r))
+          lhs_neighbors |= graph.neighbors[r];
+      }
+      for (int j = i + 1; j < subtree_n; ++j) {
+        uint32_t rhs = tree.nodes[subtrees[j]].relations;
+        if ((lhs_neighbors & rhs) == 0U)
+          continue;
+        double rows = graph.join_rows(lhs | rhs);
+        if (rows < best_rows) {
+          best_rows = rows;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    if (best_i == -1)
+      return false;
+    subtrees[best_i] = add_join(tree, subtrees[best_i], subtrees[best_j], best_rows);
+    subtrees[best_j] = subtrees[--subtree_n];
+  }
+  tree.root = subtrees[0];
+  return true;
+}
+
+static bool plan(const JoinGraph &graph, JoinTree &tree) {
+  tree.node_n = 0;
+  tree.root = -1;
+  tree.cost = 0.0;
+  return graph.relation_n <= max_exhaustive_relations ? plan_exhaustively(graph, tree) : plan_greedily(graph, tree);
+}
+
+bool plan_join_tree(const ParseQueryResult &pqr, const Stats &stats, JoinTree &tree) {
+  assert(pqr.num_relations > 0 && pqr.num_relations <= max_relations);
+  JoinGraph graph(pqr, stats);
+  bool planned = plan(graph, tree);
+  graph.free();
+  return planned;
+}
+
+/**
+ * Appends the join predicates of a subtree to "order", in the order that they are executed.
+ */
+static void append_joins(const ParseQueryResult &pqr, const JoinTree &tree, int node,
+                         bool *is_appended, StretchyBuf<Predicate> &order) {
+  const JoinTree::Node &n = tree.nodes[node];
+  if (n.left == -1)
+    return;
+  append_joins(pqr, tree, n.left, is_appended, order);
+  append_joins(pqr, tree, n.right, is_appended, order);
+  uint32_t left = tree.nodes[n.left].relations;
+  uint32_t right = tree.nodes[n.right].relations;
+  // The first predicate between the subtrees joins them, and only then the rest filter their join, with the
+  // predicates within a relation, which is in an intermediate result only once it is joined.
+  // The predicates within a subtree were appended with its joins, so the filters of the intermediate results
+  // run before the join that connects them.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < pqr.predicates.size; ++i) {
+      const Predicate &predicate = pqr.predicates[i];
+      if (predicate.kind != PRED::JOIN || is_appended[i])
+        continue;
+      uint32_t lhs = 1U << predicate.lhs.first;
+      uint32_t rhs = 1U << predicate.rhs.first;
+      bool is_between = ((lhs & left) && (rhs & right)) || ((lhs & right) && (rhs & left));
+      bool is_within = lhs == rhs && (lhs & n.relations);
+      if (pass == 0 ? is_between : is_between || is_within) {
+        order.push(predicate);
+        is_appended[i] = true;
+        if (pass == 0)
+          break;
+      }
+    }
+  }
+}
+
+/**
+ * Writes the joins of "order" back to the places of the join predicates, from the "from"-th on.
+ */
+static void write_joins(ParseQueryResult &pqr, size_t from, const StretchyBuf<Predicate> &order) {
+  size_t k = 0;
+  for (size_t i = from; i < pqr.predicates.size; ++i) {
+    if (pqr.predicates[i].kind == PRED::JOIN) {
+      assert(k < order.len);
+      pqr.predicates[i] = order[k++];
+    }
+  }
+  assert(k == order.len);
+}
+
+bool reorder_joins(ParseQueryResult &pqr, const Stats &stats) {
+  if (pqr.num_relations < 2 || pqr.num_relations > max_relations)
+    return false;
+  JoinTree tree;
+  if (!plan_join_tree(pqr, stats, tree))
+    return false;
+  auto *is_appended = (bool *) calloc(pqr.predicates.size, sizeof(bool));
+  assert(is_appended);
+  StretchyBuf<Predicate> order(pqr.predicates.size);
+  append_joins(pqr, tree, tree.root, is_appended, order);
+  write_joins(pqr, 0, order);
+  order.free();
+  ::free(is_appended);
+  return true;
+}
+
+/**
+ * Contracts the graph of a running query: every intermediate result is a group with its actual rows,
+ * and every relation that isn't in one is a group of its own.
+ * @return The number of groups.
+ */
+static int contract_joined(JoinGraph &graph, size_t from, const JoinedRelations *joined, int joined_n,
+                           uint32_t *groups) {
+  double group_rows[max_relations] = {};
+  int group_n = 0;
+  uint32_t all_joined = 0U;
+  for (int j = 0; j < joined_n; ++j) {
+    groups[group_n] = joined[j].relations;
+    group_rows[group_n++] = joined[j].rows;
+    all_joined |= joined[j].relations;
+  }
+  for (int r = 0; r < graph.relation_n; ++r) {
+    if ((all_joined & (1U << r)) == 0U) {
+      groups[group_n] = 1U << r;
+      group_rows[group_n++] = graph.rows[r];
+    }
+  }
+  graph.contract(groups, group_rows, group_n, from);
+  return group_n;
+}
+
+double estimate_join_rows(const ParseQueryResult &pqr, size_t from, const Stats &stats,
+                          const JoinedRelations *joined, int joined_n, uint32_t relations) {
+  JoinGraph graph(pqr, stats);
+  uint32_t groups[max_relations] = {};
+  int group_n = contract_joined(graph, from, joined, joined_n, groups);
+  uint32_t group_mask = 0U;
+  for (int g = 0; g < group_n; ++g) {
+    if (groups[g] & relations)
+      group_mask |= 1U << g;
+  }
+  double rows = graph.join_rows(group_mask);
+  graph.free();
+  return rows;
+}
+
+bool reorder_remaining_joins(ParseQueryResult &pqr, size_t from, const Stats &stats,
+                             const JoinedRelations *joined, int joined_n) {
+  if (pqr.num_relations < 2 || pqr.num_relations > max_relations)
+    return false;
+  JoinGraph graph(pqr, stats);
+  uint32_t groups[max_relations] = {};
+  int group_n = contract_joined(graph, from, joined, joined_n, groups);
+  JoinTree tree;
+  bool planned = group_n > 1 && plan(graph, tree);
+  graph.free();
+  if (!planned)
+    return false;
+  // The nodes of the tree are groups, the predicates are placed by the relations of the groups.
+  for (int n = 0; n < tree.node_n; ++n) {
+    uint32_t relations = 0U;
+    for (int g = 0; g < group_n; ++g) {
+      if (tree.nodes[n].relations & (1U << g))
+        relations |= groups[g];
+    }
+    tree.nodes[n].relations = relations;
+  }
+  auto *is_appended = (bool *) calloc(pqr.predicates.size, sizeof(bool));
+  assert(is_appended);
+  StretchyBuf<Predicate> order(pqr.predicates.size);
+  for (size_t i = 0; i < pqr.predicates.size; ++i) {
+    const Predicate &predicate = pqr.predicates[i];
+    is_appended[i] = i < from || predicate.kind != PRED::JOIN;
+    if (is_appended[i])
+      continue;
+    // The predicates within an intermediate result filter it before it is joined again.
+    for (int j = 0; j < joined_n; ++j) {
+      uint32_t relations = joined[j].relations;
+      if ((relations & (1U << predicate.lhs.first)) && (relations & (1U << predicate.rhs.first))) {
+        order.push(predicate);
+        is_appended[i] = true;
+      }
+    }
+  }
+  append_joins(pqr, tree, tree.root, is_appended, order);
+  write_joins(pqr, from, order);
+  order.free();
+  ::free(is_appended);
+  return true;
+}
@@ -0,0 +1,107 @@
+#ifndef QUERY_JOINER__JOIN_ORDER_H_
+#define QUERY_JOINER__JOIN_ORDER_H_
+
+#include <cstdint>
+#include "array.h"
+#include "column_filter.h"
+#include "pair.h"
+#include "parse.h"
+
+/**
+ * The statistics of a column of a base relation: the smallest value l, the biggest value u,
+ * the number of values f and the number of distinct values d.
+ * The filters of the column are estimated with its histogram if it has one, or else as if its values were uniform.
+ */
+struct ColumnStat {
+  double l, u, f, d;
+  const Histogram *histogram;
+
+  bool operator==(ColumnStat rhs) const {
+    return (rhs.l == l && rhs.u == u && rhs.f == f && rhs.d == d);
+  }
+};
+
+/**
+ * The statistics of every column of every base relation, by global relation index.
+ */
+struct Stats {
+  Array<Array<ColumnStat>> relations;
+
+  ColumnStat get_column_stat(Pair<int, int> p) const {
+    return relations[p.first][p.second];
+  }
+};
+
+/**
+ * The join tree of a query. Every node joins the relations of its two children, and the leaves are relations.
+ */
+struct JoinTree {
+  static constexpr int max_nodes = 2 * max_relations;
+
+  struct Node {
+    // The local indexes of the relations of the node, one bit per relation.
+    uint32_t relations;
+    // The children, or -1 for a leaf.
+    int left;
+    int right;
+    // The estimated number of rows of the join of the relations.
+    double rows;
+  };
+
+  int node_n;
+  int root;
+  Node nodes[max_nodes];
+  // The sum of the rows of all the joins of the tree.
+  double cost;
+};
+
+/**
+ * Finds the join tree of a query, left-deep or bushy, with the smallest intermediate results (C_out).
+ * The rows of a join are estimated from the column statistics: the filters of every column are merged into
+ * a range, the ranges are applied to the relations, and every join predicate keeps 1 / max(d) of the pairs of rows, where d are the distinct values of its columns.
+ * Queries of up to "max_exhaustive_relations" relations are planned exactly, with dynamic programming over
+ * the connected subsets of relations. Bigger queries join greedily the pair of subtrees with the smallest join.
+ * @param stats The statistics of the base relations.
+ * @return False if the relations are not connected by join predicates, then "tree" is not set.
+ */
+bool plan_join_tree(const ParseQueryResult &pqr, const Stats &stats, JoinTree &tree);
+
+constexpr int max_exhaustive_relations = 12;
+
+/**
+ * Reorders the join predicates of a query in the order that the query executor runs its join tree:
+ * the joins of every subtree run before the join that connects them. The predicates between relations that
+ * are joined already come right after that join, so they are executed as filters of the intermediate result.
+ * The filter predicates stay where they are.
+ * @return False if the query is left as it is, because it has a single relation or it isn't connected.
+ */
+bool reorder_joins(ParseQueryResult &pqr, const Stats &stats);
+
+/**
+ * An intermediate result of a running query: the local indexes of its relations, one bit per relation,
+ * and its actual number of rows.
+ */
+struct JoinedRelations {
+  uint32_t relations;
+  double rows;
+};
+
+/**
+ * Estimates the rows of a join in the middle of a query, once the predicates before the "from"-th are executed.
+ * The intermediate results have their actual rows, and the relations that aren't in one are estimated as usual.
+ * @param relations The relations of the join, every intermediate result is either all in it or all out of it.
+ */
+double estimate_join_rows(const ParseQueryResult &pqr, size_t from, const Stats &stats,
+                          const JoinedRelations *joined, int joined_n, uint32_t relations);
+
+/**
+ * Re-plans the join predicates from the "from"-th on, once the predicates before it are executed.
+ * Every intermediate result is a leaf of the new join tree with its actual rows, so the joins that are left
+ * are ordered by what the query has produced so far rather than by the estimates it started with.
+ * The predicates within an intermediate result come first, to filter it.
+ * @return False if the predicates are left as they are.
+ */
+bool reorder_remaining_joins(ParseQueryResult &pqr, size_t from, const Stats &stats,
+                             const JoinedRelations *joined, int joined_n);
+
+#endif //QUERY_JOINER__JOIN_ORDER_H_
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include "join_planner.h"
+#include "report_utils.h"
+
+const char *join_algorithm_name(JoinAlgorithm algorithm) {
+  switch (algorithm) {
+    case JoinAlgorithm::NESTED_LOOP:
+      return "nested loop";
+    case JoinAlgorithm::DENSE_ARRAY:
+      return "dense array";
+    case JoinAlgorithm::HASH:
+      return "hash";
+    case JoinAlgorithm::SORT_MERGE:
+      return "sort-merge";
+  }
+  return "unknown";
+}
+
+JoinSideStats JoinSideStats::for_relation(const RelationData &relation, size_t key_index,
+                                          const StretchyBuf<Predicate> &filters, bool sorted) {
+  JoinSideStats stats = for_ir(relation, key_index, relation.row_count(), sorted);
+  // The filters of a column are a single range, estimated the same way as when the relation is filtered.
+  StretchyBuf<ColumnFilter> column_filters = merge_column_filters(filters);
+  double selectivity = 1.0;
+  for (const ColumnFilter &filter : column_filters) {
+    selectivity *= relation.range_selectivity(filter.column, filter.range);
+    if (filter.column != key_index)
+      continue;
+    // A filter on the key column narrows the range of the keys as well.
+    if (filter.range.is_empty) {
+      selectivity = 0.0;
+    } else {
+      stats.min_key = std::max(stats.min_key, filter.range.min);
+      stats.max_key = std::min(stats.max_key, filter.range.max);
+    }
+  }
+  column_filters.free();
+  if (stats.min_key > stats.max_key) {
+    stats.min_key = stats.max_key;
+    selectivity = 0.0;
+  }
+  stats.row_count = (size_t) ((double) stats.row_count * selectivity + 0.5);
+  stats.distinct_count = std::min(stats.distinct_count, std::max(stats.row_count, (size_t) 1U));
+  return stats;
+}
+
+JoinSideStats JoinSideStats::for_ir(const RelationData &relation, size_t key_index, size_t row_count, bool sorted) {
+  JoinSideStats stats{};
+  stats.row_count = row_count;
+  stats.sorted = sorted;
+  stats.min_key = relation.column_min(key_index);
+  stats.max_key = relation.column_max(key_index);
+  if (stats.max_key == UINT64_MAX) {
+    // The range isn't known, so assume the widest one.
+    stats.min_key = 0U;
+  }
+  stats.distinct_count = relation.column_distinct(key_index);
+  if (stats.distinct_count != 0U) {
+    stats.distinct_count = std::min(stats.distinct_count, std::max(row_count, (size_t) 1U));
+  }
+  return stats;
+}
+
+// The costs of the algorithms, in units of one entry that is read or written once.
+static constexpr double nested_loop_pair_cost = 0.1;
+static constexpr double hash_entry_cost = 3.0;
+static constexpr double hash_setup_cost = 4096.0;
+static constexpr double merge_entry_cost = 1.0;
+static constexpr double radix_pass_cost = 1.5;
+static constexpr double dense_slot_cost = 0.25;
+static constexpr double dense_build_cost = 2.0;
+static constexpr double dense_probe_cost = 1.0;
+// The probes miss the cache once the array doesn't fit in it.
+static constexpr double dense_random_probe_cost = 3.0;
+static constexpr size_t dense_cached_domain = 128U * 1024U;
+// The dense array is only used if it has at most this many slots per key of the right hand side.
+static constexpr size_t dense_max_slots_per_key = 16U;
+
+static double sort_cost(const JoinSideStats &side) {
+  if (side.sorted || side.row_count < 2U)
+    return 0.0;
+  Joinable::KeyRange range{side.min_key, side.max_key};
+  Joinable::RadixDigits digits{range, side.row_count};
+  return (double) side.row_count * radix_pass_cost * (double) std::max(digits.nr_passes, (size_t) 1U);
+}
+
+JoinAlgorithm choose_join_algorithm(const JoinSideStats &lhs, const JoinSideStats &rhs, bool sorting_is_reused) {
+  double l = lhs.row_count;
+  double r = rhs.row_count;
+  // What the algorithms that don't leave the result sorted lose, when a later join reads a join column.
+  double unsorted_penalty = sorting_is_reused ? std::min(sort_cost(lhs), sort_cost(rhs)) : 0.0;
+
+  JoinAlgorithm best = JoinAlgorithm::SORT_MERGE;
+  double best_cost = sort_cost(lhs) + sort_cost(rhs) + (l + r) * merge_entry_cost;
+
+  double hash_cost = hash_setup_cost + (l + r) * hash_entry_cost + unsorted_penalty;
+  if (hash_cost < best_cost) {
+    best = JoinAlgorithm::HASH;
+    best_cost = hash_cost;
+  }
+
+  // The nested loop and the dense array keep the order of the left hand side.
+  double order_penalty = lhs.sorted ? 0.0 : unsorted_penalty;
+  uint64_t domain = rhs.max_key - rhs.min_key;
+  size_t rhs_keys = std::max(rhs.distinct_count != 0U ? rhs.distinct_count : rhs.row_count, (size_t) 1U);
+  if (domain < DenseArrayJoin::max_key_domain && domain / dense_max_slots_per_key < rhs_keys) {
+    double probe_cost = domain < dense_cached_domain ? dense_probe_cost : dense_random_probe_cost;
+    double dense_cost = (double) (domain + 1U) * dense_slot_cost + r * dense_build_cost + l * probe_cost +
+        order_penalty;
+    if (dense_cost < best_cost) {
+      best = JoinAlgorithm::DENSE_ARRAY;
+      best_cost = dense_cost;
+    }
+  }
+
+  double nested_loop_cost = l * r * nested_loop_pair_cost + order_penalty;
+  if (nested_loop_cost < best_cost) {
+    best = JoinAlgorithm::NESTED_LOOP;
+  }
+  return best;
+}
+
+JoinProfile::JoinProfile() : joins{} {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+void JoinProfile::record(JoinAlgorithm algorithm, size_t left_row_count, size_t right_row_count,
+                         size_t result_row_count) {
+  pthread_mutex_lock(&mutex);
+  joins.push({algorithm, left_row_count, right_row_count, result_row_count});
+  pthread_mutex_unlock(&mutex);
+}
+
+size_t JoinProfile::count(JoinAlgorithm algorithm) const {
+  size_t count = 0U;
+  for (size_t i = 0; i < joins.len; ++i) {
+    count += joins.data[i].algorithm == algorithm;
+  }
+  return count;
+}
+
+void JoinProfile::print(int fd) {
+  pthread_mutex_lock(&mutex);
+  for (Entry entry : joins) {
+    freport(fd, "%s join: %zu x %zu -> %zu rows", join_algorithm_name(entry.algorithm),
+            entry.left_row_count, entry.right_row_count, entry.result_row_count);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void JoinProfile::reset() {
+  pthread_mutex_lock(&mutex);
+  joins.reset();
+  pthread_mutex_unlock(&mutex);
+}
+
+void JoinProfile::free() {
+  joins.free();
+  pthread_mutex_destroy(&mutex);
+}
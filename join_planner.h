@@ -0,0 +1,103 @@
+#ifndef QUERY_JOINER__JOIN_PLANNER_H_
+#define QUERY_JOINER__JOIN_PLANNER_H_
+
+#include <cstdint>
+#include <pthread.h>
+#include "stretchy_buf.h"
+#include "relation_data.h"
+
+/**
+ * The algorithms that can be used to execute a join predicate.
+ */
+enum class JoinAlgorithm {
+  NESTED_LOOP,
+  DENSE_ARRAY,
+  HASH,
+  SORT_MERGE,
+};
+
+const char *join_algorithm_name(JoinAlgorithm algorithm);
+
+/**
+ * What is known about a side of a join before its join input is built.
+ */
+struct JoinSideStats {
+  /**
+   * The (estimated) number of entries of the join input.
+   */
+  size_t row_count;
+  /**
+   * True if the join input comes out sorted on the key, so a merge join doesn't have to sort it.
+   */
+  bool sorted;
+  /**
+   * A range that contains all the keys of the join input.
+   */
+  uint64_t min_key;
+  uint64_t max_key;
+  /**
+   * The (estimated) number of distinct keys of the join input, or 0 if it isn't known.
+   */
+  size_t distinct_count;
+
+  /**
+   * @return The stats of a base relation column, with the row count estimated after "filters".
+   */
+  static JoinSideStats for_relation(const RelationData &relation, size_t key_index,
+                                    const StretchyBuf<Predicate> &filters, bool sorted);
+
+  /**
+   * @return The stats of a column of an intermediate result of "row_count" rows, whose row-ids point to "relation".
+   */
+  static JoinSideStats for_ir(const RelationData &relation, size_t key_index, size_t row_count, bool sorted);
+
+  uint64_t key_domain() const { return max_key - min_key + 1U; }
+};
+
+/**
+ * Picks the cheapest join algorithm for two join inputs, based on a simple cost model
+ * in units of one touched entry.
+ * - A nested loop costs a compare per pair of entries, but nothing else, so it wins for tiny inputs.
+ * - A dense array join (its right hand side is the build side) costs a word per key of the domain of the
+ *   right hand side, so it's only considered when the domain is small and densely populated.
+ * - A hash join costs a partitioning, build and probe pass per entry.
+ * - A sort-merge join costs a radix sort per entry of an unsorted side and a merge pass per entry.
+ *   If "sorting_is_reused" is set, a later join reads one of the join columns and it can skip sorting
+ *   after a sort-merge join, so the other algorithms are charged that sort.
+ */
+JoinAlgorithm choose_join_algorithm(const JoinSideStats &lhs, const JoinSideStats &rhs, bool sorting_is_reused);
+
+/**
+ * The joins of a query, with the algorithm that was chosen for each of them.
+ * The joins of different intermediate results of a query may run concurrently, so recording is synchronized.
+ */
+struct JoinProfile {
+  struct Entry {
+    JoinAlgorithm algorithm;
+    size_t left_row_count;
+    size_t right_row_count;
+    size_t result_row_count;
+  };
+
+  JoinProfile();
+
+  void record(JoinAlgorithm algorithm, size_t left_row_count, size_t right_row_count, size_t result_row_count);
+
+  /**
+   * @return The number of joins executed with "algorithm".
+   */
+  size_t count(JoinAlgorithm algorithm) const;
+
+  void print(int fd);
+
+  void reset();
+
+  void free();
+
+  StretchyBuf<Entry> joins;
+
+ private:
+  pthread_mutex_t mutex;
+};
+
+#endif //QUERY_JOINER__JOIN_PLANNER_H_
@@ -1,5 +1,9 @@
 #include <cstring>
 #include <random>
+#include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include "joinable.h"
 #include "report_utils.h"
 
@@ -9,21 +13,89 @@ Joinable::Joinable(size_t size) : Array(size) {}
 
 Joinable::Joinable(Array<JoinableEntry> entries) : Array(entries) {}
 
-Joinable::MinMaxPair Joinable::construct_histogram(size_t *out_hist, size_t byte_pos) {
-  size_t min = 255;
+PackedJoinable::PackedJoinable() : Array() {}
+
+PackedJoinable::PackedJoinable(size_t size) : Array(size) {}
+
+static __always_inline uint64_t entry_key(const JoinableEntry &entry) {
+  return entry.first.v;
+}
+
+static __always_inline uint64_t entry_key(const PackedJoinableEntry &entry) {
+  return PackedJoinable::key(entry);
+}
+
+static __always_inline uint64_t entry_row_id(const JoinableEntry &entry) {
+  return entry.second.v;
+}
+
+static __always_inline uint64_t entry_row_id(const PackedJoinableEntry &entry) {
+  return PackedJoinable::row_id(entry);
+}
+
+// A wider digit is only used when it saves a pass and the input has this many entries per bucket of it.
+static constexpr size_t min_entries_per_bucket = 16U;
+
+static size_t count_passes(size_t key_bits, size_t bits) {
+  return (key_bits + bits - 1U) / bits;
+}
+
+Joinable::RadixDigits::RadixDigits(Joinable::KeyRange range, size_t size) : min{range.min} {
+  assert(range.min <= range.max);
+  uint64_t span = range.max - range.min;
+  key_bits = span == 0U ? 0U : 64U - __builtin_clzll(span);
+  bits = 8U;
+  for (size_t wider_bits : {11U, 16U}) {
+    if ((size_t{1} << wider_bits) * min_entries_per_bucket <= size &&
+        count_passes(key_bits, wider_bits) < count_passes(key_bits, bits)) {
+      bits = wider_bits;
+    }
+  }
+  nr_passes = count_passes(key_bits, bits);
+}
+
+using SortContext = Joinable::SortContext;
+using KeyRange = Joinable::KeyRange;
+using RadixDigits = Joinable::RadixDigits;
+
+/**
+ * A pair which holds two numbers
+ * First: Minimum value
+ * Second: Maximum value
+ */
+using MinMaxPair = Pair<size_t, size_t>;
+
+/**
+ * Constructs a histogram from an array of entries
+ * @param out_hist: The constructed histogram, with digits.nr_buckets(pass) entries. It's an output argument
+ * @param digits: The digits of the sort
+ * @param pass: The pass whose digit to create the histogram for
+ * @return A pair which indicates the minimum and maximum digit for the pass given
+ * That enables us to start our process from the minimum digit up to the maximum and not the
+ * whole possible range of digits
+ */
+template<typename Entry>
+static MinMaxPair construct_histogram(Array<Entry> entries, size_t *out_hist, const RadixDigits &digits, size_t pass) {
+  size_t min = digits.nr_buckets(pass) - 1U;
   size_t max = 0;
-  for (JoinableEntry entry : *this) {
-    size_t b = entry.first.byte(byte_pos);
-    min = std::min(min, b);
-    max = std::max(max, b);
-    ++out_hist[b];
+  for (const Entry &entry : entries) {
+    size_t d = digits.digit(entry_key(entry), pass);
+    min = std::min(min, d);
+    max = std::max(max, d);
+    ++out_hist[d];
   }
   return make_pair(min, max);
 }
 
-void Joinable::construct_prefix_sum(JoinableEntry *base_addr, const size_t *hist,
-                                    JoinableEntry **out_prefix_sum,
-                                    Joinable::MinMaxPair min_max) {
+/**
+ * Creates the prefix sum of a histogram
+ * @param base_addr: The base address of the data we are goind to write to
+ * @param hist: The histogram of the entries which are going to be written
+ * @param out_prefix_sum: The output prefix_sum. It's an output argument
+ * @param min_max: The min and max digit pair which has meaning to compute the prefix sum for.
+ */
+template<typename Entry>
+static void construct_prefix_sum(Entry *base_addr, const size_t *hist, Entry **out_prefix_sum, MinMaxPair min_max) {
   for (size_t i = min_max.first; i <= min_max.second; ++i) {
     out_prefix_sum[i] = base_addr;
   }
@@ -36,20 +108,28 @@ void Joinable::construct_prefix_sum(JoinableEntry *base_addr, const size_t *hist
   }
 }
 
-void Joinable::copy_data(Joinable &dest, JoinableEntry **prefix_sum, const size_t byte_pos) {
-  for (const JoinableEntry entry : *this) {
-    size_t b = entry.first.byte(byte_pos);
-    JoinableEntry *to_insert = prefix_sum[b];
+/**
+ * Copies the entries to their positions in the destination based on the prefix sum and the digit of the pass
+ * @param prefix_sum: The prefix sum to use in order to copy to the correct positions
+ * @param digits: The digits of the sort
+ * @param pass: The pass whose digit we are using
+ */
+template<typename Entry>
+static void copy_data(Array<Entry> entries, Entry **prefix_sum, const RadixDigits &digits, size_t pass) {
+  for (const Entry entry : entries) {
+    size_t d = digits.digit(entry_key(entry), pass);
+    Entry *to_insert = prefix_sum[d];
     *to_insert = entry;
-    ++prefix_sum[b];
+    ++prefix_sum[d];
   }
 }
 
 static std::default_random_engine generator;
 
-static void insertion_sort(JoinableEntry *data, size_t length) {
+template<typename Entry>
+static void insertion_sort(Entry *data, size_t length) {
   for (size_t i = 1U; i < length; ++i) {
-    JoinableEntry key = data[i];
+    Entry key = data[i];
     ssize_t j = i - 1U;
     while (j >= 0 && data[j] > key) {
       data[j + 1U] = data[j];
@@ -61,15 +141,16 @@ static void insertion_sort(JoinableEntry *data, size_t length) {
 
 using PartitionIndexes = Pair<ssize_t, ssize_t>;
 
-static PartitionIndexes partition(JoinableEntry *data, ssize_t left_index, ssize_t right_index) {
+template<typename Entry>
+static PartitionIndexes partition(Entry *data, ssize_t left_index, ssize_t right_index) {
   if (data[left_index] > data[right_index]) {
     std::swap(data[left_index], data[right_index]);
   }
   ssize_t i = left_index + 1;
   ssize_t j = right_index - 1;
   ssize_t k = left_index + 1;
-  JoinableEntry left_pivot = data[left_index];
-  JoinableEntry right_pivot = data[right_index];
+  Entry left_pivot = data[left_index];
+  Entry right_pivot = data[right_index];
   while (k <= j) {
     if (data[k] < left_pivot) {
       std::swap(data[k], data[i]);
@@ -107,7 +188,8 @@ static PartitionIndexes partition(JoinableEntry *data, ssize_t left_index, ssize
 //  std::swap(data[i + 1], data[right_index]);
 //  return i + 1;
 
-static void quicksort(JoinableEntry *data, ssize_t left_index, ssize_t right_index) {
+template<typename Entry>
+static void quicksort(Entry *data, ssize_t left_index, ssize_t right_index) {
   if (left_index < right_index) {
     ssize_t length = right_index - left_index + 1;
     if (length < 20) {
@@ -139,64 +221,262 @@ static void quicksort(JoinableEntry *data, ssize_t left_index, ssize_t right_ind
   }
 }
 
-void Joinable::sort(Joinable::MemoryContext mem_context, size_t sort_threshold) {
-  Joinable copy = *this;
-  Joinable aux_copy = mem_context.aux;
 
-  auto stack = mem_context.stack;
-  stack.push({0, this->size, 0});
+/**
+ * Runs the radix sort for the sort contexts found in the stack
+ * Even passes read from "data" and write to "aux", odd passes the other way around.
+ */
+template<typename Entry>
+static void radix_sort(Array<Entry> data, Array<Entry> aux, StretchyBuf<SortContext> stack,
+                       const RadixDigits &digits, size_t sort_threshold) {
+  Array<Entry> copy = data;
+  Array<Entry> aux_copy = aux;
+
+  // Sized for the widest digit, only the buckets of the current pass are used.
+  size_t max_buckets = digits.nr_buckets(0);
+  size_t *hist = (size_t *) malloc(max_buckets * sizeof(size_t));
+  Entry **prefix_sum = (Entry **) malloc(2U * max_buckets * sizeof(Entry *));
+  assert(hist && prefix_sum);
+  Entry **prefix_sum_copy = prefix_sum + max_buckets;
 
   while (!stack.empty()) {
-    size_t hist[256] = {0};
     SortContext context = stack.pop();
-    size_t byte_pos = context.byte_pos;
-
-    if (byte_pos == 8) continue;
+    size_t pass = context.pass;
 
-    if ((byte_pos & 1) != 0) {
-      copy = mem_context.aux;
-      aux_copy = *this;
+    if ((pass & 1) != 0) {
+      copy = aux;
+      aux_copy = data;
     } else {
-      copy = *this;
-      aux_copy = mem_context.aux;
+      copy = data;
+      aux_copy = aux;
     }
 
-    Joinable curr = (Joinable) copy.subarray(context.from, context.to);
-    Joinable curr_aux = (Joinable) aux_copy.subarray(context.from, context.to);
+    Array<Entry> curr = copy.subarray(context.from, context.to);
+    Array<Entry> curr_aux = aux_copy.subarray(context.from, context.to);
 
-    MinMaxPair min_max = curr.construct_histogram(hist, byte_pos);
-    JoinableEntry *prefix_sum[256] = {nullptr};
-    JoinableEntry *prefix_sum_copy[256] = {nullptr};
-    Joinable::construct_prefix_sum(curr_aux.data, hist, prefix_sum, min_max);
+    memset(hist, 0, digits.nr_buckets(pass) * sizeof(size_t));
+    MinMaxPair min_max = construct_histogram(curr, hist, digits, pass);
+    construct_prefix_sum(curr_aux.data, hist, prefix_sum, min_max);
 
     for (size_t i = min_max.first; i <= min_max.second; ++i) {
       prefix_sum_copy[i] = prefix_sum[i];
     }
 
-    curr.copy_data(curr_aux, prefix_sum, byte_pos);
-    JoinableEntry *curr_aux_base = curr_aux.data;
+    copy_data(curr, prefix_sum, digits, pass);
+    Entry *curr_aux_base = curr_aux.data;
+    bool last_pass = pass + 1U == digits.nr_passes;
     for (size_t i = min_max.first; i <= min_max.second; ++i) {
       size_t nr_elements = hist[i];
-      JoinableEntry *psum_base = prefix_sum_copy[i];
+      if (nr_elements == 0U) continue;
+      Entry *psum_base = prefix_sum_copy[i];
       ptrdiff_t from_index = context.from + (psum_base - curr_aux_base);
-      if (nr_elements > 1) {
-        if ((nr_elements * sizeof(JoinableEntry)) <= sort_threshold) {
+      if (nr_elements > 1 && !last_pass) {
+        if ((nr_elements * sizeof(Entry)) <= sort_threshold) {
           quicksort(psum_base, 0, nr_elements - 1);
-          if ((byte_pos & 1) == 0) {
-            memcpy(this->data + from_index, psum_base, nr_elements * sizeof(JoinableEntry));
+          if ((pass & 1) == 0) {
+            memcpy(data.data + from_index, psum_base, nr_elements * sizeof(Entry));
           }
         } else {
           ptrdiff_t to_index = from_index + nr_elements;
-          stack.push(SortContext{(size_t) (from_index), (size_t) (to_index), byte_pos + 1});
+          stack.push(SortContext{(size_t) (from_index), (size_t) (to_index), pass + 1});
         }
-      } else if (nr_elements == 1 && (byte_pos & 1) == 0) {
-        (*this)[from_index] = mem_context.aux[from_index];
+      } else if ((pass & 1) == 0) {
+        // A single entry, or entries with equal keys after the last pass. They only have to be copied back.
+        memcpy(data.data + from_index, psum_base, nr_elements * sizeof(Entry));
       }
     }
   }
+  ::free(hist);
+  ::free(prefix_sum);
   stack.free();
 }
 
+template<typename Entry>
+static KeyRange key_range(Array<Entry> entries) {
+  assert(entries.size != 0U);
+  KeyRange range{entry_key(entries.data[0]), entry_key(entries.data[0])};
+  for (const Entry &entry : entries) {
+    range.min = std::min(range.min, entry_key(entry));
+    range.max = std::max(range.max, entry_key(entry));
+  }
+  return range;
+}
+
+template<typename Entry>
+static void sort(Array<Entry> data, Array<Entry> aux, StretchyBuf<SortContext> stack,
+                 size_t sort_threshold, KeyRange key_range) {
+  if (data.size < 2U) return;
+  assert(aux.capacity >= data.size);
+  RadixDigits digits{key_range, data.size};
+  if (digits.nr_passes == 0U) return;
+  stack.push({0, data.size, 0});
+  radix_sort(data, aux, stack, digits, sort_threshold);
+}
+
+// Below this many entries per chunk, a partitioning pass is not worth splitting among threads.
+static constexpr size_t min_sort_chunk = 64U * 1024U;
+
+/**
+ * Partitions a range of the entries on the digit of "context.pass" using the threads of a task scheduler
+ * Every chunk builds its own histogram, and a global prefix sum gives every chunk its write positions.
+ * @param out_hist: The number of entries that ended up in every bucket. It's an output argument
+ */
+template<typename Entry>
+static void parallel_partition(TaskScheduler *scheduler, Array<Entry> data, Array<Entry> aux,
+                               const RadixDigits &digits, SortContext context, size_t *out_hist) {
+  size_t pass = context.pass;
+  // Same as in radix_sort, even passes read from data and write to aux.
+  Array<Entry> src = (pass & 1) != 0 ? aux : data;
+  Array<Entry> dest = (pass & 1) != 0 ? data : aux;
+  size_t size = context.to - context.from;
+  size_t nr_buckets = digits.nr_buckets(pass);
+  size_t nr_chunks = std::min(scheduler->thread_count() + 1U, size / min_sort_chunk);
+  nr_chunks = std::max(nr_chunks, (size_t) 1U);
+  size_t chunk_size = (size + nr_chunks - 1U) / nr_chunks;
+  size_t *hist = (size_t *) calloc(nr_chunks * nr_buckets, sizeof(size_t));
+  assert(hist);
+
+  scheduler->parallel_for(nr_chunks, [&](size_t chunk) {
+    size_t from = context.from + chunk * chunk_size;
+    size_t to = std::min(context.to, from + chunk_size);
+    size_t *chunk_hist = hist + chunk * nr_buckets;
+    for (size_t i = from; i < to; ++i) {
+      ++chunk_hist[digits.digit(entry_key(src.data[i]), pass)];
+    }
+  });
+
+  size_t offset = context.from;
+  for (size_t b = 0U; b != nr_buckets; ++b) {
+    out_hist[b] = 0U;
+    for (size_t chunk = 0U; chunk != nr_chunks; ++chunk) {
+      size_t count = hist[chunk * nr_buckets + b];
+      hist[chunk * nr_buckets + b] = offset;
+      offset += count;
+      out_hist[b] += count;
+    }
+  }
+
+  scheduler->parallel_for(nr_chunks, [&](size_t chunk) {
+    size_t from = context.from + chunk * chunk_size;
+    size_t to = std::min(context.to, from + chunk_size);
+    size_t *chunk_hist = hist + chunk * nr_buckets;
+    for (size_t i = from; i < to; ++i) {
+      Entry entry = src.data[i];
+      dest.data[chunk_hist[digits.digit(entry_key(entry), pass)]++] = entry;
+    }
+  });
+  ::free(hist);
+}
+
+/**
+ * Sorts a bucket produced by a partitioning pass and leaves it in "data"
+ */
+template<typename Entry>
+static void sort_bucket(Array<Entry> data, Array<Entry> aux, const RadixDigits &digits,
+                        SortContext context, size_t sort_threshold) {
+  size_t nr_elements = context.to - context.from;
+  // The bucket was written by the previous pass, so it is in aux when this pass is odd.
+  bool in_aux = (context.pass & 1) != 0;
+  bool sorted_by_key = context.pass == digits.nr_passes;
+  Entry *base = (in_aux ? aux.data : data.data) + context.from;
+  if (sorted_by_key || nr_elements == 1 || (nr_elements * sizeof(Entry)) <= sort_threshold) {
+    if (nr_elements > 1 && !sorted_by_key) {
+      quicksort(base, 0, nr_elements - 1);
+    }
+    if (in_aux) {
+      memcpy(data.data + context.from, base, nr_elements * sizeof(Entry));
+    }
+    return;
+  }
+  StretchyBuf<SortContext> stack{};
+  stack.push(context);
+  radix_sort(data, aux, stack, digits, sort_threshold);
+}
+
+template<typename Entry>
+static void parallel_sort(TaskScheduler *scheduler, Array<Entry> data, Array<Entry> aux, size_t sort_threshold) {
+  assert(aux.capacity >= data.size);
+  if (data.size < 2U) return;
+
+  size_t nr_chunks = std::max(std::min(scheduler->thread_count() + 1U, data.size / min_sort_chunk), (size_t) 1U);
+  size_t chunk_size = (data.size + nr_chunks - 1U) / nr_chunks;
+  KeyRange *ranges = (KeyRange *) malloc(nr_chunks * sizeof(KeyRange));
+  assert(ranges);
+  scheduler->parallel_for(nr_chunks, [&](size_t chunk) {
+    size_t from = chunk * chunk_size;
+    size_t to = std::min(data.size, from + chunk_size);
+    ranges[chunk] = key_range(data.subarray(from, to));
+  });
+  KeyRange range = ranges[0];
+  for (size_t chunk = 1U; chunk != nr_chunks; ++chunk) {
+    range.min = std::min(range.min, ranges[chunk].min);
+    range.max = std::max(range.max, ranges[chunk].max);
+  }
+  ::free(ranges);
+
+  RadixDigits digits{range, data.size};
+  if (digits.nr_passes == 0U) return;
+
+  // Ranges bigger than this are partitioned with all the threads, smaller ones become a single task.
+  size_t max_task_size = std::max(min_sort_chunk, data.size / (2U * (scheduler->thread_count() + 1U)));
+  size_t *hist = (size_t *) malloc(digits.nr_buckets(0) * sizeof(size_t));
+  assert(hist);
+  StretchyBuf<SortContext> large{};
+  StretchyBuf<SortContext> buckets{};
+  large.push({0, data.size, 0});
+  while (!large.empty()) {
+    SortContext context = large.pop();
+    parallel_partition(scheduler, data, aux, digits, context, hist);
+    size_t from = context.from;
+    for (size_t b = 0U; b != digits.nr_buckets(context.pass); ++b) {
+      if (hist[b] == 0U) continue;
+      SortContext bucket{from, from + hist[b], context.pass + 1};
+      if (hist[b] > max_task_size && bucket.pass != digits.nr_passes) {
+        large.push(bucket);
+      } else {
+        buckets.push(bucket);
+      }
+      from += hist[b];
+    }
+  }
+  scheduler->parallel_for(buckets.len, [&](size_t i) {
+    sort_bucket(data, aux, digits, buckets[i], sort_threshold);
+  });
+  ::free(hist);
+  large.free();
+  buckets.free();
+}
+
+Joinable::KeyRange Joinable::key_range() const {
+  return ::key_range<JoinableEntry>(*this);
+}
+
+void Joinable::sort(Joinable::MemoryContext mem_context, size_t sort_threshold) {
+  if (this->size < 2U) return;
+  sort(mem_context, sort_threshold, key_range());
+}
+
+void Joinable::sort(Joinable::MemoryContext mem_context, size_t sort_threshold, KeyRange key_range) {
+  ::sort<JoinableEntry>(*this, mem_context.aux, mem_context.stack, sort_threshold, key_range);
+}
+
+void Joinable::parallel_sort(TaskScheduler *scheduler, Joinable aux, size_t sort_threshold) {
+  ::parallel_sort<JoinableEntry>(scheduler, *this, aux, sort_threshold);
+}
+
+Joinable::KeyRange PackedJoinable::key_range() const {
+  return ::key_range<PackedJoinableEntry>(*this);
+}
+
+void PackedJoinable::sort(PackedJoinable aux, size_t sort_threshold) {
+  if (this->size < 2U) return;
+  ::sort<PackedJoinableEntry>(*this, aux, StretchyBuf<SortContext>(), sort_threshold, key_range());
+}
+
+void PackedJoinable::parallel_sort(TaskScheduler *scheduler, PackedJoinable aux, size_t sort_threshold) {
+  ::parallel_sort<PackedJoinableEntry>(scheduler, *this, aux, sort_threshold);
+}
+
 void Joinable::print(int fd) {
   for (JoinableEntry e : *this) {
     freport(fd, "Key = %lu, RowId = %lu", e.first.v, e.second.v);
@@ -214,123 +494,756 @@ Joinable Joinable::empty() {
   return empty;
 }
 
-using GroupIndex = Pair<size_t, size_t>;
-using GroupIndexes = Pair<GroupIndex, GroupIndex>;
+JoinResult::JoinResult(size_t left_count, size_t row_count)
+    : left_row_ids{left_count}, offsets{left_count + 1U}, right_row_ids{row_count} {
+  offsets.push(0U);
+}
 
-struct JoinThreadArgs {
-  StretchyBuf<GroupIndexes> *group_indexes;
-  StretchyBuf<Join::JoinRow> *result;
-  volatile size_t *next_index;
-  Joinable *lhs;
-  Joinable *rhs;
-};
+void JoinResult::free() {
+  left_row_ids.free();
+  offsets.free();
+  right_row_ids.free();
+}
+
+template<bool Inclusive, typename Entry>
+static __always_inline bool key_is_skipped(const Entry &entry, uint64_t key) {
+  return Inclusive ? entry_key(entry) <= key : entry_key(entry) < key;
+}
+
+#if defined(__AVX512F__)
+static constexpr size_t simd_block = 8U;
+#elif defined(__AVX2__)
+static constexpr size_t simd_block = 4U;
+#else
+static constexpr size_t simd_block = 1U;
+#endif
+
+/**
+ * Counts how many of the "simd_block" entries starting at "data" have to be skipped.
+ * Entries are 16 bytes, so the keys of 4 (AVX2) or 8 (AVX-512) entries are de-interleaved first.
+ * Because the keys are sorted, the skipped entries are always a prefix of the block.
+ */
+template<bool Inclusive>
+static __always_inline size_t skipped_in_block(const JoinableEntry *data, uint64_t key) {
+#if defined(__AVX512F__)
+  const __m512i target = _mm512_set1_epi64((long long) key);
+  // The keys are the even 64-bit words of the two vectors.
+  const __m512i key_words = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+  __m512i lo = _mm512_loadu_si512((const void *) data);
+  __m512i hi = _mm512_loadu_si512((const void *) (data + 4U));
+  __m512i keys = _mm512_permutex2var_epi64(lo, key_words, hi);
+  __mmask8 skip = Inclusive ? _mm512_cmple_epu64_mask(keys, target) : _mm512_cmplt_epu64_mask(keys, target);
+  return __builtin_popcount(skip);
+#elif defined(__AVX2__)
+  // AVX2 has only signed 64-bit comparisons, so flip the sign bits to compare unsigned keys.
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((long long) key), sign);
+  __m256i lo = _mm256_loadu_si256((const __m256i *) data);
+  __m256i hi = _mm256_loadu_si256((const __m256i *) (data + 2U));
+  __m256i keys = _mm256_xor_si256(_mm256_unpacklo_epi64(lo, hi), sign);
+  int skip;
+  if (Inclusive) {
+    skip = 0xF & ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, target)));
+  } else {
+    skip = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, keys)));
+  }
+  return __builtin_popcount(skip);
+#else
+  return key_is_skipped<Inclusive>(*data, key);
+#endif
+}
 
-static StretchyBuf<GroupIndexes> calculate_group_indexes(Joinable lhs, Joinable rhs) {
-  StretchyBuf<GroupIndexes> res{};
-  size_t prev_i = 0U;
-  size_t prev_j = 0U;
+/**
+ * Same as above for packed entries. The keys are in the high half of the entries,
+ * so the entries are compared as they are with the smallest (or biggest, when "Inclusive" is set)
+ * entry that has the key.
+ */
+template<bool Inclusive>
+static __always_inline size_t skipped_in_block(const PackedJoinableEntry *data, uint64_t key) {
+#if defined(__AVX512F__)
+  uint64_t bound = Inclusive ? PackedJoinable::pack(key, UINT32_MAX).v : PackedJoinable::pack(key, 0U).v;
+  const __m512i target = _mm512_set1_epi64((long long) bound);
+  __m512i entries = _mm512_loadu_si512((const void *) data);
+  __mmask8 skip = Inclusive ? _mm512_cmple_epu64_mask(entries, target) : _mm512_cmplt_epu64_mask(entries, target);
+  return __builtin_popcount(skip);
+#elif defined(__AVX2__)
+  uint64_t bound = Inclusive ? PackedJoinable::pack(key, UINT32_MAX).v : PackedJoinable::pack(key, 0U).v;
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((long long) bound), sign);
+  __m256i entries = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) data), sign);
+  int skip;
+  if (Inclusive) {
+    skip = 0xF & ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(entries, target)));
+  } else {
+    skip = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, entries)));
+  }
+  return __builtin_popcount(skip);
+#else
+  return key_is_skipped<Inclusive>(*data, key);
+#endif
+}
 
+/**
+ * Finds the first entry in [from, to) of a sorted Joinable whose key is not below "key"
+ * (or not above it, when "Inclusive" is set).
+ * The vectorized version checks a few entries one by one, since most runs are short,
+ * then whole SIMD blocks, and gallops over the runs that are longer than that,
+ * so that long runs of non-matching keys are skipped without reading all of them.
+ */
+template<bool Vectorized, bool Inclusive, typename Entry>
+static __always_inline size_t skip_keys(const Entry *data, size_t from, size_t to, uint64_t key) {
+  if (!Vectorized) {
+    while (from < to && key_is_skipped<Inclusive>(data[from], key)) ++from;
+    return from;
+  }
+  for (size_t k = 0U; k != 4U; ++k, ++from) {
+    if (from == to || !key_is_skipped<Inclusive>(data[from], key)) return from;
+  }
+  for (size_t k = 0U; k != 4U && from + simd_block <= to; ++k) {
+    size_t skipped = skipped_in_block<Inclusive>(data + from, key);
+    from += skipped;
+    if (skipped != simd_block) return from;
+  }
+  size_t step = simd_block;
+  while (from + step <= to && key_is_skipped<Inclusive>(data[from + step - 1U], key)) {
+    from += step;
+    step *= 2U;
+  }
+  size_t last = std::min(from + step, to);
+  while (from < last) {
+    size_t mid = from + (last - from) / 2U;
+    if (key_is_skipped<Inclusive>(data[mid], key)) {
+      from = mid + 1U;
+    } else {
+      last = mid;
+    }
+  }
+  return from;
+}
+
+/**
+ * Calls "callback(i_from, i_to, j_from, j_to)" for every key that exists in both sorted Joinables,
+ * where [i_from, i_to) and [j_from, j_to) are the ranges of the key in lhs and rhs respectively.
+ */
+template<bool Vectorized, typename Entry, typename F>
+static void for_each_matching_group(Array<Entry> lhs, Array<Entry> rhs, F callback) {
   size_t i = 0U;
-  while (i < lhs.size + 1) {
-    u64 prev_lhs_key = lhs[prev_i].first;
-    while (i < lhs.size && prev_lhs_key == lhs[i].first) ++i;
+  size_t j = 0U;
+  while (i < lhs.size && j < rhs.size) {
+    uint64_t lhs_key = entry_key(lhs.data[i]);
+    uint64_t rhs_key = entry_key(rhs.data[j]);
+    if (lhs_key < rhs_key) {
+      i = skip_keys<Vectorized, false>(lhs.data, i + 1U, lhs.size, rhs_key);
+    } else if (rhs_key < lhs_key) {
+      j = skip_keys<Vectorized, false>(rhs.data, j + 1U, rhs.size, lhs_key);
+    } else {
+      size_t i_to = skip_keys<Vectorized, true>(lhs.data, i + 1U, lhs.size, lhs_key);
+      size_t j_to = skip_keys<Vectorized, true>(rhs.data, j + 1U, rhs.size, rhs_key);
+      callback(i, i_to, j, j_to);
+      i = i_to;
+      j = j_to;
+    }
+  }
+}
 
-    size_t j = prev_j;
-    while (j < rhs.size && prev_lhs_key > rhs[j].first) ++j;
-    if (j == rhs.size) {
-      ++i;
-      continue;
+template<typename Entry, typename F>
+static void for_each_matching_group(Join::MergeKernel kernel, Array<Entry> lhs, Array<Entry> rhs, F callback) {
+  if (kernel == Join::MergeKernel::SIMD) {
+    for_each_matching_group<true>(lhs, rhs, callback);
+  } else {
+    for_each_matching_group<false>(lhs, rhs, callback);
+  }
+}
+
+static long l2_cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+static constexpr size_t max_radix_bits = 14U;
+
+// Below this many entries per chunk, partitioning is not worth splitting among threads.
+static constexpr size_t min_partition_chunk = 64U * 1024U;
+
+static void run_chunks(TaskScheduler *scheduler, size_t nr_chunks,
+                       const std::function<void(size_t)> &callable) {
+  if (scheduler != nullptr) {
+    scheduler->parallel_for(nr_chunks, callable);
+  } else {
+    for (size_t i = 0U; i != nr_chunks; ++i) callable(i);
+  }
+}
+
+// Picks the number of partitioning bits so that a partition of the build side, together
+// with its hash table, takes up at most half of the L2 cache.
+static size_t hash_join_radix_bits(size_t build_size) {
+  size_t cache_size = l2_cache_size > 0 ? (size_t) l2_cache_size : 256U * 1024U;
+  size_t build_bytes = build_size * (sizeof(JoinableEntry) + 2U * sizeof(u32));
+  size_t bits = 0U;
+  while (bits < max_radix_bits && (build_bytes >> bits) > cache_size / 2U) ++bits;
+  return bits;
+}
+
+static __always_inline size_t hash_partition(uint64_t key, size_t radix_bits) {
+  return radix_bits ? (key * 0x9E3779B97F4A7C15ULL) >> (64U - radix_bits) : 0U;
+}
+
+static __always_inline size_t hash_bucket(uint64_t key, size_t bucket_bits) {
+  return (key * 0xC2B2AE3D27D4EB4FULL) >> (64U - bucket_bits);
+}
+
+/**
+ * Scatters the entries of a Joinable to 2^radix_bits partitions based on the hash of their keys.
+ * Every chunk of the input builds its own histogram so that the scatter can be done in parallel.
+ * @param in: The Joinable to partition
+ * @param out: The output Joinable. It must have the same size as the input
+ * @param out_bounds: The start index of every partition in the output, followed by the output size
+ */
+static void partition_by_hash(TaskScheduler *scheduler, Joinable in, Joinable out,
+                              size_t radix_bits, size_t *out_bounds) {
+  size_t nr_partitions = 1U << radix_bits;
+  size_t nr_chunks = (in.size + min_partition_chunk - 1U) / min_partition_chunk;
+  size_t max_chunks = scheduler != nullptr ? scheduler->thread_count() + 1U : 1U;
+  nr_chunks = std::max((size_t) 1U, std::min(nr_chunks, max_chunks));
+  size_t chunk_size = (in.size + nr_chunks - 1U) / nr_chunks;
+  size_t *hist = (size_t *) calloc(nr_chunks * nr_partitions, sizeof(size_t));
+  assert(hist);
+
+  run_chunks(scheduler, nr_chunks, [&](size_t chunk) {
+    size_t *chunk_hist = hist + chunk * nr_partitions;
+    size_t to = std::min(in.size, (chunk + 1U) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < to; ++i) {
+      ++chunk_hist[hash_partition(in.data[i].first.v, radix_bits)];
     }
+  });
+
+  // Turn the histograms into the write offset of every chunk in every partition.
+  size_t offset = 0U;
+  for (size_t p = 0U; p != nr_partitions; ++p) {
+    out_bounds[p] = offset;
+    for (size_t chunk = 0U; chunk != nr_chunks; ++chunk) {
+      size_t count = hist[chunk * nr_partitions + p];
+      hist[chunk * nr_partitions + p] = offset;
+      offset += count;
+    }
+  }
+  out_bounds[nr_partitions] = offset;
+
+  run_chunks(scheduler, nr_chunks, [&](size_t chunk) {
+    size_t *chunk_offsets = hist + chunk * nr_partitions;
+    size_t to = std::min(in.size, (chunk + 1U) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < to; ++i) {
+      JoinableEntry entry = in.data[i];
+      out.data[chunk_offsets[hash_partition(entry.first.v, radix_bits)]++] = entry;
+    }
+  });
+  ::free(hist);
+}
 
-    prev_j = j;
+static void hash_join_partition(const JoinableEntry *lhs, size_t lhs_size,
+                                const JoinableEntry *rhs, size_t rhs_size,
+                                JoinResult &out) {
+  if (lhs_size == 0U || rhs_size == 0U) return;
+  assert(rhs_size < UINT32_MAX);
+  size_t bucket_bits = 1U;
+  while (((size_t) 1U << bucket_bits) < rhs_size) ++bucket_bits;
+  // Chain indexes are stored off by one, so that 0 marks the end of a chain.
+  u32 *heads = (u32 *) calloc((size_t) 1U << bucket_bits, sizeof(u32));
+  u32 *next = (u32 *) malloc(rhs_size * sizeof(u32));
+  assert(heads && next);
+
+  // Insert in reverse, so that every chain lists the right row ids in their input order.
+  for (size_t j = rhs_size; j-- != 0U;) {
+    size_t bucket = hash_bucket(rhs[j].first.v, bucket_bits);
+    next[j] = heads[bucket];
+    heads[bucket] = j + 1U;
+  }
+
+  // The offsets of a partition's result hold the end offset of every left row.
+  // They are rebased when the partition results are gathered.
+  for (size_t i = 0U; i != lhs_size; ++i) {
+    u64 lhs_key = lhs[i].first;
+    size_t prev_len = out.right_row_ids.len;
+    for (u32 j = heads[hash_bucket(lhs_key.v, bucket_bits)]; j != 0U; j = next[j - 1U]) {
+      if (rhs[j - 1U].first == lhs_key) {
+        out.right_row_ids.push(rhs[j - 1U].second);
+      }
+    }
+    if (out.right_row_ids.len != prev_len) {
+      out.left_row_ids.push(lhs[i].second);
+      out.offsets.push(out.right_row_ids.len);
+    }
+  }
+  ::free(heads);
+  ::free(next);
+}
+
+HashJoin::HashJoin(TaskScheduler *scheduler) : scheduler{scheduler} {}
+
+JoinResult HashJoin::operator()(Joinable lhs, Joinable rhs) {
+  size_t radix_bits = hash_join_radix_bits(rhs.size);
+  size_t nr_partitions = 1U << radix_bits;
+  Joinable lhs_parts = lhs;
+  Joinable rhs_parts = rhs;
+  size_t *lhs_bounds = new size_t[nr_partitions + 1U];
+  size_t *rhs_bounds = new size_t[nr_partitions + 1U];
+  if (radix_bits != 0U) {
+    lhs_parts = Joinable(lhs.size);
+    rhs_parts = Joinable(rhs.size);
+    lhs_parts.size = lhs.size;
+    rhs_parts.size = rhs.size;
+    partition_by_hash(scheduler, lhs, lhs_parts, radix_bits, lhs_bounds);
+    partition_by_hash(scheduler, rhs, rhs_parts, radix_bits, rhs_bounds);
+  } else {
+    lhs_bounds[0] = rhs_bounds[0] = 0U;
+    lhs_bounds[1] = lhs.size;
+    rhs_bounds[1] = rhs.size;
+  }
 
-    while (j < rhs.size && prev_lhs_key == rhs[j].first) ++j;
+  JoinResult *results = new JoinResult[nr_partitions];
+  run_chunks(scheduler, nr_partitions, [&](size_t p) {
+    hash_join_partition(lhs_parts.data + lhs_bounds[p], lhs_bounds[p + 1U] - lhs_bounds[p],
+                        rhs_parts.data + rhs_bounds[p], rhs_bounds[p + 1U] - rhs_bounds[p],
+                        results[p]);
+  });
 
-    res.push({{prev_i, i}, {prev_j, j}});
-    prev_i = i;
-    prev_j = j;
-    ++i;
+  size_t left_count = 0U;
+  size_t row_count = 0U;
+  for (size_t p = 0U; p != nr_partitions; ++p) {
+    left_count += results[p].left_count();
+    row_count += results[p].row_count();
+  }
+  JoinResult res{left_count, row_count};
+  for (size_t p = 0U; p != nr_partitions; ++p) {
+    JoinResult &part = results[p];
+    size_t base = res.right_row_ids.len;
+    if (part.left_count() != 0U) {
+      memcpy(res.left_row_ids.data + res.left_row_ids.len, part.left_row_ids.data,
+             part.left_count() * sizeof(u64));
+      memcpy(res.right_row_ids.data + base, part.right_row_ids.data, part.row_count() * sizeof(u64));
+      for (size_t i = 0U; i != part.left_count(); ++i) {
+        res.offsets.data[res.offsets.len + i] = base + part.offsets.data[i];
+      }
+      res.left_row_ids.len += part.left_count();
+      res.right_row_ids.len += part.row_count();
+      res.offsets.len += part.left_count();
+    }
+    part.free();
   }
 
+  if (radix_bits != 0U) {
+    lhs_parts.clear_and_free();
+    rhs_parts.clear_and_free();
+  }
+  delete[] results;
+  delete[] lhs_bounds;
+  delete[] rhs_bounds;
   return res;
 }
 
-void *run_merge(void *args) {
-  JoinThreadArgs *info = (JoinThreadArgs *) args;
-  size_t next_index;
-  while ((next_index = __sync_fetch_and_add(info->next_index, 1)) < info->group_indexes->len) {
-    GroupIndexes group_indexes = (*info->group_indexes)[next_index];
-    GroupIndex lhs_gindex = group_indexes.first;
-    GroupIndex rhs_gindex = group_indexes.second;
+// Below this many entries per chunk, merging is not worth splitting among threads.
+static constexpr size_t min_merge_chunk = 16U * 1024U;
+
+/**
+ * Writes groups of matching rows to a preallocated join result, starting from the given positions.
+ */
+struct JoinResultWriter {
+  JoinResult &res;
+  size_t left_pos;
+  size_t row_pos;
+
+  template<typename Entry>
+  void write_group(const Entry *lhs, size_t lhs_n, const Entry *rhs, size_t rhs_n) {
+    for (size_t i = 0U; i != lhs_n; ++i) {
+      res.left_row_ids.data[left_pos] = entry_row_id(lhs[i]);
+      for (size_t j = 0U; j != rhs_n; ++j) {
+        res.right_row_ids.data[row_pos++] = entry_row_id(rhs[j]);
+      }
+      res.offsets.data[++left_pos] = row_pos;
+    }
+  }
+};
+
+/**
+ * A chunk of the merge phase.
+ * First: The range of the chunk in the left hand side Joinable
+ * Second: The range of the chunk in the right hand side Joinable
+ */
+using MergeChunk = Pair<Pair<size_t, size_t>, Pair<size_t, size_t>>;
+
+template<typename Entry>
+static size_t lower_bound(Array<Entry> joinable, uint64_t key) {
+  size_t from = 0U;
+  size_t to = joinable.size;
+  while (from < to) {
+    size_t mid = from + (to - from) / 2U;
+    if (entry_key(joinable.data[mid]) < key) {
+      from = mid + 1U;
+    } else {
+      to = mid;
+    }
+  }
+  return from;
+}
+
+/**
+ * Splits two sorted Joinables into chunks that can be merged independently.
+ * The left hand side is split into (roughly) equal parts whose boundaries are moved
+ * so that no key spans two chunks. The right hand side is split on the same keys.
+ */
+template<typename Entry>
+static MergeChunk *calculate_merge_chunks(Array<Entry> lhs, Array<Entry> rhs, size_t nr_chunks) {
+  MergeChunk *chunks = new MergeChunk[nr_chunks];
+  size_t lhs_from = 0U;
+  size_t rhs_from = 0U;
+  for (size_t k = 0U; k != nr_chunks; ++k) {
+    size_t lhs_to = lhs.size;
+    size_t rhs_to = rhs.size;
+    if (k != nr_chunks - 1U) {
+      lhs_to = std::max(lhs_from, (k + 1U) * (lhs.size / nr_chunks));
+      while (lhs_to != 0U && lhs_to < lhs.size && entry_key(lhs.data[lhs_to - 1U]) == entry_key(lhs.data[lhs_to]))
+        ++lhs_to;
+      rhs_to = lhs_to < lhs.size ? std::max(rhs_from, lower_bound(rhs, entry_key(lhs.data[lhs_to]))) : rhs.size;
+    }
+    chunks[k] = {{lhs_from, lhs_to}, {rhs_from, rhs_to}};
+    lhs_from = lhs_to;
+    rhs_from = rhs_to;
+  }
+  return chunks;
+}
+
+template<typename Entry>
+static Array<Entry> chunk_part(Array<Entry> joinable, Pair<size_t, size_t> range) {
+  Array<Entry> part{};
+  part.data = joinable.data + range.first;
+  part.size = part.capacity = range.second - range.first;
+  return part;
+}
+
+Join::Join(TaskScheduler *scheduler, MergeKernel kernel) : scheduler{scheduler}, kernel{kernel} {}
+
+static size_t merge_chunk_count(TaskScheduler *scheduler, size_t lhs_size) {
+  if (scheduler == nullptr) return 1U;
+  // Use more chunks than threads, so that the threads can balance uneven chunks.
+  size_t max_chunks = 4U * (scheduler->thread_count() + 1U);
+  return std::max((size_t) 1U, std::min(max_chunks, lhs_size / min_merge_chunk));
+}
+
+// Groups with fewer output rows than this are never split among tasks.
+static constexpr size_t min_heavy_group_rows = 64U * 1024U;
+
+/**
+ * A group of matching entries of a merge chunk, whose output is big enough to be split among several tasks.
+ * The entries are relative to the chunk, "left_pos" and "row_pos" are the positions of its output in the chunk.
+ */
+struct HeavyGroup {
+  size_t lhs_from;
+  size_t lhs_to;
+  size_t rhs_from;
+  size_t rhs_to;
+  size_t left_pos;
+  size_t row_pos;
+
+  size_t row_count() const { return (lhs_to - lhs_from) * (rhs_to - rhs_from); }
+};
 
-    size_t rhs_gsize = rhs_gindex.second - rhs_gindex.first;
-    StretchyBuf<u64> rhs_row_ids{rhs_gsize};
-    for (size_t j = rhs_gindex.first; j < rhs_gindex.second; ++j) {
-      rhs_row_ids.push((*info->rhs)[j].second);
+/**
+ * A slice of the output rows [row_from, row_to) of a heavy group.
+ * The rows of a group are ordered like the pairs of its left and right entries,
+ * so row p is made of left entry p / rhs_n and right entry p % rhs_n.
+ */
+struct HeavyGroupSlice {
+  size_t chunk;
+  size_t group;
+  size_t row_from;
+  size_t row_to;
+};
+
+template<typename Entry>
+static void write_heavy_group_slice(JoinResult &res, const Entry *lhs, const Entry *rhs, const HeavyGroup &group,
+                                    size_t left_base, size_t row_base, HeavyGroupSlice slice) {
+  size_t rhs_n = group.rhs_to - group.rhs_from;
+  size_t left_pos = left_base + group.left_pos;
+  size_t row_pos = row_base + group.row_pos;
+  size_t p = slice.row_from;
+  while (p != slice.row_to) {
+    size_t i = p / rhs_n;
+    size_t j = p % rhs_n;
+    size_t n = std::min(rhs_n - j, slice.row_to - p);
+    // Every left row id is written by the slice that has its first output row, every offset by the one that has its last.
+    if (j == 0U) {
+      res.left_row_ids.data[left_pos + i] = entry_row_id(lhs[group.lhs_from + i]);
+    }
+    for (size_t k = 0U; k != n; ++k) {
+      res.right_row_ids.data[row_pos + p + k] = entry_row_id(rhs[group.rhs_from + j + k]);
     }
+    p += n;
+    if (j + n == rhs_n) {
+      res.offsets.data[left_pos + i + 1U] = row_pos + p;
+    }
+  }
+}
+
+template<typename Entry>
+static JoinResult merge_join(TaskScheduler *scheduler, Join::MergeKernel kernel, Array<Entry> lhs, Array<Entry> rhs) {
+  size_t nr_chunks = merge_chunk_count(scheduler, lhs.size);
+  MergeChunk *chunks = calculate_merge_chunks(lhs, rhs, nr_chunks);
+
+  // Count the output of every chunk first, so that the result is allocated only once
+  // and every chunk knows where to write its output.
+  // The groups with big outputs are kept, in case they make their chunk a straggler (e.g. a hot key).
+  size_t *left_counts = new size_t[nr_chunks + 1U];
+  size_t *row_counts = new size_t[nr_chunks + 1U];
+  StretchyBuf<HeavyGroup> *heavy_groups = new StretchyBuf<HeavyGroup>[nr_chunks];
+  bool split_groups = scheduler != nullptr;
+  run_chunks(scheduler, nr_chunks, [&](size_t k) {
+    size_t left_count = 0U;
+    size_t row_count = 0U;
+    for_each_matching_group(kernel, chunk_part(lhs, chunks[k].first), chunk_part(rhs, chunks[k].second),
+                            [&](size_t i_from, size_t i_to, size_t j_from, size_t j_to) {
+                              size_t group_rows = (i_to - i_from) * (j_to - j_from);
+                              if (split_groups && group_rows >= min_heavy_group_rows) {
+                                heavy_groups[k].push({i_from, i_to, j_from, j_to, left_count, row_count});
+                              }
+                              left_count += i_to - i_from;
+                              row_count += group_rows;
+                            });
+    left_counts[k] = left_count;
+    row_counts[k] = row_count;
+  });
+  size_t left_offset = 0U;
+  size_t row_offset = 0U;
+  for (size_t k = 0U; k != nr_chunks; ++k) {
+    size_t left_count = left_counts[k];
+    size_t row_count = row_counts[k];
+    left_counts[k] = left_offset;
+    row_counts[k] = row_offset;
+    left_offset += left_count;
+    row_offset += row_count;
+  }
 
-    for (size_t i = lhs_gindex.first; i < lhs_gindex.second; ++i) {
-      StretchyBuf<u64> _rhs_row_ids{rhs_gsize};
-      for (u64 v : rhs_row_ids) {
-        _rhs_row_ids.push(v);
+  // A group is split when it has more rows than a task should write, so that the slowest task takes
+  // about as long as the others, instead of as long as the biggest key.
+  StretchyBuf<HeavyGroupSlice> slices{};
+  if (split_groups) {
+    size_t rows_per_task = std::max(min_heavy_group_rows, row_offset / (4U * (scheduler->thread_count() + 1U)));
+    for (size_t k = 0U; k != nr_chunks; ++k) {
+      size_t kept = 0U;
+      for (size_t g = 0U; g != heavy_groups[k].len; ++g) {
+        HeavyGroup group = heavy_groups[k].data[g];
+        size_t group_rows = group.row_count();
+        if (group_rows <= rows_per_task)
+          continue;
+        heavy_groups[k].data[kept] = group;
+        size_t nr_slices = (group_rows + rows_per_task - 1U) / rows_per_task;
+        size_t slice_rows = (group_rows + nr_slices - 1U) / nr_slices;
+        for (size_t from = 0U; from < group_rows; from += slice_rows) {
+          slices.push({k, kept, from, std::min(group_rows, from + slice_rows)});
+        }
+        ++kept;
       }
-      (*info->result)[i] = make_pair((*info->lhs)[i].second, _rhs_row_ids);
+      heavy_groups[k].len = kept;
+    }
+  }
+
+  JoinResult res{left_offset, row_offset};
+  res.left_row_ids.len = left_offset;
+  res.offsets.len = left_offset + 1U;
+  res.right_row_ids.len = row_offset;
+  // The chunks skip their heavy groups, which are written by the slice tasks that follow them.
+  run_chunks(scheduler, nr_chunks + slices.len, [&](size_t task) {
+    if (task >= nr_chunks) {
+      HeavyGroupSlice slice = slices.data[task - nr_chunks];
+      write_heavy_group_slice(res, lhs.data + chunks[slice.chunk].first.first,
+                              rhs.data + chunks[slice.chunk].second.first,
+                              heavy_groups[slice.chunk].data[slice.group],
+                              left_counts[slice.chunk], row_counts[slice.chunk], slice);
+      return;
     }
+    size_t k = task;
+    Array<Entry> lhs_part = chunk_part(lhs, chunks[k].first);
+    Array<Entry> rhs_part = chunk_part(rhs, chunks[k].second);
+    JoinResultWriter writer{res, left_counts[k], row_counts[k]};
+    const HeavyGroup *next_heavy = heavy_groups[k].data;
+    const HeavyGroup *heavy_end = heavy_groups[k].data + heavy_groups[k].len;
+    for_each_matching_group(kernel, lhs_part, rhs_part, [&](size_t i_from, size_t i_to, size_t j_from, size_t j_to) {
+      if (next_heavy != heavy_end && next_heavy->lhs_from == i_from) {
+        writer.left_pos += i_to - i_from;
+        writer.row_pos += (i_to - i_from) * (j_to - j_from);
+        ++next_heavy;
+        return;
+      }
+      writer.write_group(lhs_part.data + i_from, i_to - i_from, rhs_part.data + j_from, j_to - j_from);
+    });
+  });
+
+  for (size_t k = 0U; k != nr_chunks; ++k) {
+    heavy_groups[k].free();
   }
-  pthread_exit(NULL);
+  delete[] heavy_groups;
+  slices.free();
+  delete[] chunks;
+  delete[] left_counts;
+  delete[] row_counts;
+  return res;
+}
+
+JoinResult Join::operator()(Joinable lhs, Joinable rhs) {
+  return merge_join<JoinableEntry>(scheduler, kernel, lhs, rhs);
+}
+
+JoinResult Join::operator()(PackedJoinable lhs, PackedJoinable rhs) {
+  return merge_join<PackedJoinableEntry>(scheduler, kernel, lhs, rhs);
 }
-/*
-StretchyBuf<Join::JoinRow> Join::operator()(Joinable lhs, Joinable rhs) {
-  StretchyBuf<GroupIndexes> group_indexes = calculate_group_indexes(lhs, rhs);
-  StretchyBuf<Join::JoinRow> *result = new StretchyBuf<Join::JoinRow>{lhs.size};
-  result->len = group_indexes[group_indexes.len - 1].first.second;
-  memset(result->data, '\0', lhs.size * sizeof(Join::JoinRow));
-  volatile size_t next_index = 0U;
-  JoinThreadArgs *args = new JoinThreadArgs{};
-  args->group_indexes = &group_indexes;
-  args->next_index = &next_index;
-  args->lhs = &lhs;
-  args->rhs = &rhs;
-  args->result = result;
-  size_t nr_threads = 1;
-  pthread_t *threads = new pthread_t[nr_threads];
 
-  for (size_t i = 0U; i != nr_threads; ++i) {
-    pthread_create(&threads[i], NULL, run_merge, args);
+template<typename Entry>
+static StretchyBuf<JoinGroup> merge_groups(TaskScheduler *scheduler, Join::MergeKernel kernel,
+                                           Array<Entry> lhs, Array<Entry> rhs) {
+  size_t nr_chunks = merge_chunk_count(scheduler, lhs.size);
+  MergeChunk *chunks = calculate_merge_chunks(lhs, rhs, nr_chunks);
+  StretchyBuf<JoinGroup> *chunk_groups = new StretchyBuf<JoinGroup>[nr_chunks];
+  run_chunks(scheduler, nr_chunks, [&](size_t k) {
+    size_t lhs_base = chunks[k].first.first;
+    size_t rhs_base = chunks[k].second.first;
+    for_each_matching_group(kernel, chunk_part(lhs, chunks[k].first), chunk_part(rhs, chunks[k].second),
+                            [&](size_t i_from, size_t i_to, size_t j_from, size_t j_to) {
+                              chunk_groups[k].push({lhs_base + i_from, lhs_base + i_to,
+                                                    rhs_base + j_from, rhs_base + j_to});
+                            });
+  });
+
+  size_t nr_groups = 0U;
+  for (size_t k = 0U; k != nr_chunks; ++k) {
+    nr_groups += chunk_groups[k].len;
   }
-  for (size_t i = 0U; i != nr_threads; ++i) {
-    pthread_join(threads[i], NULL);
+  StretchyBuf<JoinGroup> res(std::max(nr_groups, (size_t) 1U));
+  for (size_t k = 0U; k != nr_chunks; ++k) {
+    if (chunk_groups[k].len != 0U) {
+      memcpy(res.data + res.len, chunk_groups[k].data, chunk_groups[k].len * sizeof(JoinGroup));
+      res.len += chunk_groups[k].len;
+    }
+    chunk_groups[k].free();
   }
+  delete[] chunk_groups;
+  delete[] chunks;
+  return res;
+}
 
-  group_indexes.free();
-  delete args;
-  delete[] threads;
+StretchyBuf<JoinGroup> Join::groups(Joinable lhs, Joinable rhs) {
+  return merge_groups<JoinableEntry>(scheduler, kernel, lhs, rhs);
+}
 
-  return *result;
+StretchyBuf<JoinGroup> Join::groups(PackedJoinable lhs, PackedJoinable rhs) {
+  return merge_groups<PackedJoinableEntry>(scheduler, kernel, lhs, rhs);
 }
-*/
-StretchyBuf<Join::JoinRow> Join::operator()(Joinable lhs, Joinable rhs) {
-  StretchyBuf<Join::JoinRow> res{};
-  size_t prev_j = 0U;
+
+JoinResult NestedLoopJoin::operator()(Joinable lhs, Joinable rhs) {
+  size_t left_count = 0U;
+  size_t row_count = 0U;
   for (size_t i = 0U; i != lhs.size; ++i) {
-    StretchyBuf<u64> right_row_ids{};
-    size_t j = prev_j;
-    u64 lhs_key = lhs[i].first;
-    while (j < rhs.size && lhs_key > rhs[j].first) ++j;
-    if (j == rhs.size) continue;
-    prev_j = j;
-    while (j < rhs.size && lhs_key == rhs[j].first) {
-      right_row_ids.push(rhs[j].second);
-      ++j;
+    size_t matches = 0U;
+    for (size_t j = 0U; j != rhs.size; ++j) {
+      matches += rhs.data[j].first == lhs.data[i].first;
     }
+    left_count += matches != 0U;
+    row_count += matches;
+  }
+  JoinResult res{left_count, row_count};
+  for (size_t i = 0U; i != lhs.size && res.right_row_ids.len != row_count; ++i) {
+    size_t prev_len = res.right_row_ids.len;
+    for (size_t j = 0U; j != rhs.size; ++j) {
+      if (rhs.data[j].first == lhs.data[i].first) {
+        res.right_row_ids.push(rhs.data[j].second);
+      }
+    }
+    if (res.right_row_ids.len != prev_len) {
+      res.left_row_ids.push(lhs.data[i].second);
+      res.offsets.push(res.right_row_ids.len);
+    }
+  }
+  return res;
+}
+
+// Below this many left entries per chunk, probing is not worth splitting among threads.
+static constexpr size_t min_dense_probe_chunk = 64U * 1024U;
+
+DenseArrayJoin::DenseArrayJoin(TaskScheduler *scheduler) : scheduler{scheduler} {}
+
+JoinResult DenseArrayJoin::operator()(Joinable lhs, Joinable rhs) {
+  if (lhs.size == 0U || rhs.size == 0U) {
+    return JoinResult{0U, 0U};
+  }
+  KeyRange range = rhs.key_range();
+  size_t domain = range.max - range.min + 1U;
+  assert(range.max - range.min < max_key_domain);
+  // After the counting sort, the right row ids of key k are in rows[ends[k - min - 1], ends[k - min]).
+  size_t *ends = (size_t *) calloc(domain, sizeof(size_t));
+  u64 *rows = (u64 *) malloc(rhs.size * sizeof(u64));
+  assert(ends && rows);
+  for (size_t j = 0U; j != rhs.size; ++j) {
+    ++ends[rhs.data[j].first.v - range.min];
+  }
+  size_t offset = 0U;
+  for (size_t k = 0U; k != domain; ++k) {
+    size_t count = ends[k];
+    ends[k] = offset;
+    offset += count;
+  }
+  for (size_t j = 0U; j != rhs.size; ++j) {
+    rows[ends[rhs.data[j].first.v - range.min]++] = rhs.data[j].second;
+  }
+  auto group = [&](uint64_t key, size_t *from, size_t *to) {
+    if (key < range.min || key > range.max) {
+      *from = *to = 0U;
+      return;
+    }
+    size_t k = key - range.min;
+    *from = k != 0U ? ends[k - 1U] : 0U;
+    *to = ends[k];
+  };
 
-    if (right_row_ids.len) {
-      right_row_ids.shrink_to_fit();
-      res.push(make_pair(lhs[i].second, right_row_ids));
-      right_row_ids = StretchyBuf<u64>{};
+  // Count the output of every chunk of the left hand side, then write the chunks at their offsets.
+  size_t nr_chunks = 1U;
+  if (scheduler != nullptr) {
+    nr_chunks = std::max((size_t) 1U, std::min(scheduler->thread_count() + 1U, lhs.size / min_dense_probe_chunk));
+  }
+  size_t chunk_size = (lhs.size + nr_chunks - 1U) / nr_chunks;
+  auto *counts = (size_t *) calloc(2U * (nr_chunks + 1U), sizeof(size_t));
+  assert(counts);
+  size_t *left_counts = counts;
+  size_t *row_counts = counts + nr_chunks + 1U;
+  run_chunks(scheduler, nr_chunks, [&](size_t chunk) {
+    size_t to = std::min(lhs.size, (chunk + 1U) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < to; ++i) {
+      size_t from_row, to_row;
+      group(lhs.data[i].first.v, &from_row, &to_row);
+      left_counts[chunk + 1U] += from_row != to_row;
+      row_counts[chunk + 1U] += to_row - from_row;
     }
+  });
+  for (size_t chunk = 0U; chunk != nr_chunks; ++chunk) {
+    left_counts[chunk + 1U] += left_counts[chunk];
+    row_counts[chunk + 1U] += row_counts[chunk];
   }
-  if (res.len != 0)
-    res.shrink_to_fit();
+  JoinResult res{left_counts[nr_chunks], row_counts[nr_chunks]};
+  run_chunks(scheduler, nr_chunks, [&](size_t chunk) {
+    size_t left = left_counts[chunk];
+    size_t out = row_counts[chunk];
+    size_t to = std::min(lhs.size, (chunk + 1U) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < to; ++i) {
+      size_t from_row, to_row;
+      group(lhs.data[i].first.v, &from_row, &to_row);
+      if (from_row == to_row)
+        continue;
+      memcpy(res.right_row_ids.data + out, rows + from_row, (to_row - from_row) * sizeof(u64));
+      out += to_row - from_row;
+      res.left_row_ids.data[left] = lhs.data[i].second;
+      res.offsets.data[left + 1U] = out;
+      ++left;
+    }
+  });
+  res.left_row_ids.len = left_counts[nr_chunks];
+  res.offsets.len = left_counts[nr_chunks] + 1U;
+  res.right_row_ids.len = row_counts[nr_chunks];
+  ::free(counts);
+  ::free(ends);
+  ::free(rows);
   return res;
 }
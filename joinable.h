@@ -7,6 +7,7 @@
 #include "array.h"
 #include "pair.h"
 #include "stretchy_buf.h"
+#include "task_scheduler.h"
 
 /**
  * It represents an entry in a joinable object
@@ -32,7 +33,41 @@ struct Joinable : public Array<JoinableEntry> {
   struct SortContext {
     size_t from;
     size_t to;
-    size_t byte_pos;
+    size_t pass;
+  };
+
+  /**
+   * The smallest and the biggest key of a Joinable
+   */
+  struct KeyRange {
+    uint64_t min;
+    uint64_t max;
+  };
+
+  /**
+   * The digits the radix sort partitions on, derived from the key range.
+   * The keys are sorted on (key - min), so the high order bits that are the same for all keys are skipped.
+   * Pass 0 uses the most significant "bits" bits of the remaining "key_bits", the last pass may use fewer.
+   */
+  struct RadixDigits {
+    explicit RadixDigits(KeyRange range, size_t size);
+
+    uint64_t min;
+    size_t key_bits;
+    size_t bits;
+    size_t nr_passes;
+
+    size_t shift(size_t pass) const {
+      return key_bits > (pass + 1U) * bits ? key_bits - (pass + 1U) * bits : 0U;
+    }
+
+    size_t nr_buckets(size_t pass) const {
+      return size_t{1} << (key_bits - pass * bits - shift(pass));
+    }
+
+    size_t digit(u64 key, size_t pass) const {
+      return ((key.v - min) >> shift(pass)) & (nr_buckets(pass) - 1U);
+    }
   };
 
   struct MemoryContext {
@@ -47,66 +82,275 @@ struct Joinable : public Array<JoinableEntry> {
    */
   void sort(MemoryContext mem_context, size_t sort_threshold);
 
+  /**
+   * Same as above, for a caller that already knows the range of the keys (e.g. from column statistics).
+   * The range must contain all the keys of the joinable.
+   */
+  void sort(MemoryContext mem_context, size_t sort_threshold, KeyRange key_range);
+
+  /**
+   * @return The smallest and the biggest key of the joinable. It must not be empty.
+   */
+  KeyRange key_range() const;
+
+  /**
+   * Sorts the joinable like sort(), but using the threads of a task scheduler.
+   * Big ranges are partitioned on their next digit by all the threads (per-chunk histograms
+   * plus a global prefix sum), until every bucket is small enough to be sorted by a single task.
+   * Then every bucket is sorted as an independent task.
+   * @param scheduler: The scheduler to run the partitioning and the bucket sorts on
+   * @param aux: An auxiliary Joinable with at least as much capacity as this one
+   * @param sort_threshold: A threshold that determines when to use quicksort for element groups
+   */
+  void parallel_sort(TaskScheduler *scheduler, Joinable aux, size_t sort_threshold);
+
   void print(int fd = STDERR_FILENO);
 
   static int compare_entry(const void *v1, const void *v2);
+};
+
+/**
+ * An entry of a packed joinable.
+ * The key is stored in the high 32 bits and the row_id in the low 32 bits,
+ * so ordering the entries as numbers orders them by key.
+ */
+using PackedJoinableEntry = u64;
+
+/**
+ * A Joinable with 8-byte entries, for the keys and row_ids that fit in 32 bits.
+ * It moves half the bytes of a Joinable when it is created, sorted and merged.
+ */
+struct PackedJoinable : public Array<PackedJoinableEntry> {
+  explicit PackedJoinable();
+  explicit PackedJoinable(size_t size);
 
- private:
   /**
-   * A pair which holds two numbers
-   * First: Minimum value
-   * Second: Maximum value
+   * @return True if the entries with keys up to "max_key" and row_ids up to "max_row_id" can be packed
    */
-  using MinMaxPair = Pair<size_t, size_t>;
+  static bool can_pack(uint64_t max_key, uint64_t max_row_id) {
+    return max_key <= UINT32_MAX && max_row_id <= UINT32_MAX;
+  }
+
+  static PackedJoinableEntry pack(uint64_t key, uint64_t row_id) {
+    return (key << 32U) | row_id;
+  }
+
+  static uint64_t key(PackedJoinableEntry entry) { return entry.v >> 32U; }
+  static uint64_t row_id(PackedJoinableEntry entry) { return entry.v & UINT32_MAX; }
 
   /**
-   * Constructs a histogram from a Joinable
-   * @param out_hist: The constructed histogram. It's an output argument
-   * @param byte_pos: The byte position to create the histogram for
-   * @return A pair which indicates the minimum and maximum byte for the byte_position given
-   * That enables us to start our process from the minimum byte up to the maximum and not the
-   * whone possible range of bytes (255)
+   * Sorts the joinable on its keys, like Joinable::sort
+   * @param aux: An auxiliary PackedJoinable with at least as much capacity as this one
+   * @param sort_threshold: A threshold that determines when to use quicksort for element groups
    */
-  MinMaxPair construct_histogram(size_t out_hist[256], size_t byte_pos);
+  void sort(PackedJoinable aux, size_t sort_threshold);
 
   /**
-   * Creates the prefix sum of a histogram produced by a Joinable
-   * @param base_addr: The base address of the Joinable's data we are goind to write to
-   * @param hist: The histogram produced by the Joinable which is going to write
-   * @param out_prefix_sum: The output prefix_sum. It's an output argument
-   * @param min_max: The min and max byte pair which has meaning to compute the prefix sum for.
+   * Sorts the joinable on its keys using the threads of a task scheduler, like Joinable::parallel_sort
    */
-  static void construct_prefix_sum(JoinableEntry *base_addr, const size_t hist[256],
-                                   JoinableEntry *out_prefix_sum[256], MinMaxPair min_max);
+  void parallel_sort(TaskScheduler *scheduler, PackedJoinable aux, size_t sort_threshold);
 
   /**
-   * Copies the JoinableEntries to the Joinable destination based on the prefix sum and the byte_pos
-   * @param dest: The destination Joinable we are going to copy the entries to
-   * @param prefix_sum: The prefix sum to use in order to copy to the correct positions
-   * @param byte_pos: The byte position we are using
+   * @return The smallest and the biggest key of the joinable. It must not be empty.
    */
-  void copy_data(Joinable &dest, JoinableEntry *prefix_sum[256], const size_t byte_pos);
+  Joinable::KeyRange key_range() const;
 };
 
 /**
- * An object which represents the Join clause
+ * One side of a join. The entries are packed when the sort-merge join is used
+ * and the keys and row-ids of both sides fit in 32 bits, so both sides always have the same layout.
+ */
+struct JoinInput {
+  Joinable wide;
+  PackedJoinable packed;
+  bool is_packed;
+  // The cached input this one borrows its entries from, or null if it owns them (see JoinableCache).
+  const JoinInput *shared = nullptr;
+  // True if the entries are the sorted index of a relation column, that nobody frees.
+  bool is_view = false;
+
+  size_t size() const { return is_packed ? packed.size : wide.size; }
+
+  size_t byte_size() const {
+    return is_packed ? packed.size * sizeof(PackedJoinableEntry) : wide.size * sizeof(JoinableEntry);
+  }
+
+  uint64_t key(size_t i) const {
+    return is_packed ? PackedJoinable::key(packed.data[i]) : wide.data[i].first.v;
+  }
+
+  uint64_t row_id(size_t i) const {
+    return is_packed ? PackedJoinable::row_id(packed.data[i]) : wide.data[i].second.v;
+  }
+
+  void free() {
+    if (is_packed) {
+      packed.clear_and_free();
+    } else {
+      wide.clear_and_free();
+    }
+  }
+};
+
+/**
+ * The result of a join in a compact (CSR) form.
+ * The left row ids that found a match are stored in "left_row_ids".
+ * The right row ids matched to left_row_ids[i] are stored contiguously in "right_row_ids",
+ * from index offsets[i] up to (but not including) offsets[i + 1].
+ * So each output row of the join corresponds to one entry of "right_row_ids"
+ * and the whole result takes a constant number of allocations, regardless of the fanout.
+ */
+struct JoinResult {
+  JoinResult() = default;
+
+  /**
+   * Allocates a join result with the exact capacity it needs
+   * @param left_count: The number of left row ids that found a match
+   * @param row_count: The number of output rows of the join
+   */
+  JoinResult(size_t left_count, size_t row_count);
+
+  size_t left_count() const { return left_row_ids.len; }
+  size_t row_count() const { return right_row_ids.len; }
+
+  void free();
+
+  StretchyBuf<u64> left_row_ids;
+  StretchyBuf<size_t> offsets;
+  StretchyBuf<u64> right_row_ids;
+};
+
+/**
+ * A group of entries with the same key that matched in a merge join.
+ * The entries [lhs_from, lhs_to) of the left hand side matched the entries [rhs_from, rhs_to)
+ * of the right hand side, so the group stands for (lhs_to - lhs_from) * (rhs_to - rhs_from) output rows.
+ */
+struct JoinGroup {
+  size_t lhs_from;
+  size_t lhs_to;
+  size_t rhs_from;
+  size_t rhs_to;
+};
+
+/**
+ * An object which represents the Join clause, executed as a merge of two sorted Joinables.
+ * The Joinables are split into chunks on key boundaries, which are merged concurrently
+ * and written to precomputed offsets of the result.
  */
 struct Join {
   /**
-   * A row of a join result.
-   * First: The row_id of the left Joinable
-   * Second: An array of row_ids belonging to the right Joinable matched to the row_id of the left Joinable
+   * The kernel used to skip over the keys that don't match while merging.
+   * SIMD compares 4 (AVX2) or 8 (AVX-512) keys at a time when the build targets these
+   * instruction sets, and falls back to SCALAR otherwise. Both produce the same output.
    */
-  using JoinRow = Pair<u64, StretchyBuf<u64>>;
+  enum class MergeKernel {
+    SCALAR,
+    SIMD,
+  };
+
+  /**
+   * @param scheduler: The scheduler used to merge the chunks concurrently.
+   * If it's null, the join runs on the calling thread.
+   * @param kernel: The merge kernel to use
+   */
+  explicit Join(TaskScheduler *scheduler = nullptr, MergeKernel kernel = MergeKernel::SIMD);
 
   /**
    * The () (call) operator which does the actual join.
    * @param lhs: The left hand side Joinable
    * @param rhs: The right hand side Joinable
-   * @return An array of Join Rows to be used in order to fill the intermediate result
+   * @return The join result to be used in order to fill the intermediate result
+   */
+  JoinResult operator()(Joinable lhs, Joinable rhs);
+
+  /**
+   * Same as above, for sorted packed Joinables.
+   */
+  JoinResult operator()(PackedJoinable lhs, PackedJoinable rhs);
+
+  /**
+   * Finds the groups of matching entries of two sorted Joinables, without producing the pairs of row ids.
+   * It's used when only aggregates of the join are needed, since they can be computed per group.
+   * @return The groups in key order
+   */
+  StretchyBuf<JoinGroup> groups(Joinable lhs, Joinable rhs);
+
+  /**
+   * Same as above, for sorted packed Joinables.
+   */
+  StretchyBuf<JoinGroup> groups(PackedJoinable lhs, PackedJoinable rhs);
+
+ private:
+  TaskScheduler *scheduler;
+  MergeKernel kernel;
+};
+
+/**
+ * An object which represents the Join clause, executed as a radix partitioned hash join.
+ * Both sides are partitioned on the hash of their keys so that every partition of the right hand side
+ * fits in the L2 cache. Then a hash table is built on each right hand side partition and it is probed
+ * with the respective left hand side partition.
+ * The inputs don't have to be sorted, but the output isn't sorted on the join key either.
+ */
+struct HashJoin {
+  /**
+   * @param scheduler: The scheduler used to parallelise partitioning, building and probing.
+   * If it's null, the join runs on the calling thread.
+   */
+  explicit HashJoin(TaskScheduler *scheduler = nullptr);
+
+  /**
+   * The () (call) operator which does the actual join.
+   * @param lhs: The left hand side Joinable (probe side)
+   * @param rhs: The right hand side Joinable (build side)
+   * @return The join result, in the same format as the one produced by Join
    */
-  StretchyBuf<JoinRow> operator()(Joinable lhs, Joinable rhs);
-  StretchyBuf<Join::JoinRow> normal_join(Joinable lhs, Joinable rhs);
+  JoinResult operator()(Joinable lhs, Joinable rhs);
+
+ private:
+  TaskScheduler *scheduler;
+};
+
+/**
+ * An object which represents the Join clause, executed by comparing every pair of entries.
+ * It's the cheapest join for inputs of a few entries, since it needs no sorting, hashing or allocations besides its result.
+ */
+struct NestedLoopJoin {
+  /**
+   * The () (call) operator which does the actual join.
+   * @param lhs: The left hand side Joinable
+   * @param rhs: The right hand side Joinable
+   * @return The join result, in the same format as the one produced by Join
+   */
+  JoinResult operator()(Joinable lhs, Joinable rhs);
+};
+
+/**
+ * An object which represents the Join clause, executed with a direct-addressed array over the keys of the right
+ * hand side: the right row ids are grouped by key with a counting sort, and every left key looks its group up.
+ * It's meant for small, dense key domains, the array takes a word per key in [min_key, max_key].
+ */
+struct DenseArrayJoin {
+  /**
+   * The widest key domain the join is used for.
+   */
+  static constexpr size_t max_key_domain = 1U << 22U;
+
+  /**
+   * @param scheduler: The scheduler used to parallelise probing. If it's null, the join runs on the calling thread.
+   */
+  explicit DenseArrayJoin(TaskScheduler *scheduler = nullptr);
+
+  /**
+   * The () (call) operator which does the actual join.
+   * @param lhs: The left hand side Joinable (probe side)
+   * @param rhs: The right hand side Joinable (build side). Its keys must span at most max_key_domain values.
+   * @return The join result, in the same format as the one produced by Join
+   */
+  JoinResult operator()(Joinable lhs, Joinable rhs);
+
+ private:
+  TaskScheduler *scheduler;
 };
 
 #endif //SORT_MERGE_JOIN__JOINABLE_H_
@@ -0,0 +1,10 @@
+#include "joinable_cache.h"
+
+JoinableCacheKey JoinableCacheKey::create(size_t relation_index, size_t key_index, bool packed,
+                                          const StretchyBuf<Predicate> &filters) {
+  JoinableCacheKey key{};
+  key.rows = FilterCacheKey::create(relation_index, filters);
+  key.key_index = key_index;
+  key.packed = packed;
+  return key;
+}
@@ -0,0 +1,42 @@
+#ifndef QUERY_JOINER__JOINABLE_CACHE_H_
+#define QUERY_JOINER__JOINABLE_CACHE_H_
+
+#include "filter_cache.h"
+#include "joinable.h"
+#include "lru_cache.h"
+#include "parse.h"
+
+/**
+ * Identifies the sorted join input of a base relation: the relation and its filters, its key column and the
+ * layout of the entries. The filters are normalized like the keys of the filter cache, one range per column,
+ * so the same rows make the same key whatever the form and the order of their filters in the query.
+ */
+struct JoinableCacheKey {
+  FilterCacheKey rows;
+  size_t key_index;
+  bool packed;
+
+  /**
+   * @param relation_index Global index of the relation.
+   * @param filters The filter predicates of the relation.
+   */
+  static JoinableCacheKey create(size_t relation_index, size_t key_index, bool packed,
+                                 const StretchyBuf<Predicate> &filters);
+
+  /**
+   * @return False if the relation has filters on too many columns for the key to hold.
+   */
+  bool can_be_cached() const { return rows.can_be_cached(); }
+
+  bool operator==(const JoinableCacheKey &rhs) const {
+    return key_index == rhs.key_index && packed == rhs.packed && rows == rhs.rows;
+  }
+};
+
+/**
+ * The sorted, filtered join inputs of the base relations, shared by all the queries.
+ * The cost of an input is its size in bytes.
+ */
+using JoinableCache = LruCache<JoinableCacheKey, JoinInput>;
+
+#endif //QUERY_JOINER__JOINABLE_CACHE_H_
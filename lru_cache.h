@@ -0,0 +1,179 @@
+#ifndef QUERY_JOINER__LRU_CACHE_H_
+#define QUERY_JOINER__LRU_CACHE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include "stretchy_buf.h"
+
+/**
+ * A thread safe cache of at most "capacity" units of cost, evicting the least recently used values first.
+ *
+ * Values are read-only once cached, and are pinned while they are used: acquire() and insert() pin
+ * the value they return, and release() unpins it. Pinned values are never evicted.
+ * K must be comparable with ==, V must have a free() method that is called when a value is evicted.
+ * The cache is meant for a few hundred values, so it keeps them in a list.
+ */
+template<typename K, typename V>
+class LruCache {
+ public:
+  explicit LruCache(size_t capacity);
+
+  /**
+   * @return The pinned value of the key, or null if the key is not cached.
+   */
+  const V *acquire(const K &key);
+
+  /**
+   * Caches a value and pins it. If another thread cached the key first, "value" is freed
+   * and the cached one is returned instead.
+   * @return The pinned value, or null if it doesn't fit. Then the caller keeps owning "value".
+   */
+  const V *insert(const K &key, V value, size_t cost);
+
+  /**
+   * Unpins a value returned by acquire() or insert().
+   */
+  void release(const V *value);
+
+  size_t used() const { return used_cost; }
+
+  /**
+   * @return The number of acquire() calls that found their key.
+   */
+  size_t hits() const { return hit_count; }
+
+  /**
+   * @return The number of acquire() calls that didn't find their key.
+   */
+  size_t misses() const { return miss_count; }
+
+  void free();
+
+ private:
+  struct Entry {
+    K key;
+    V value;
+    size_t cost;
+    size_t pins;
+    uint64_t last_use;
+  };
+
+  StretchyBuf<Entry *> entries;
+  size_t capacity;
+  size_t used_cost;
+  uint64_t clock;
+  size_t hit_count;
+  size_t miss_count;
+  pthread_mutex_t mutex;
+
+  Entry *find(const K &key);
+
+  /**
+   * Evicts unpinned values, least recently used first, until "cost" more fits.
+   * @return False if it doesn't fit even then.
+   */
+  bool make_room(size_t cost);
+};
+
+template<typename K, typename V>
+LruCache<K, V>::LruCache(size_t capacity)
+    : entries{}, capacity{capacity}, used_cost{0U}, clock{0U}, hit_count{0U}, miss_count{0U} {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+template<typename K, typename V>
+typename LruCache<K, V>::Entry *LruCache<K, V>::find(const K &key) {
+  for (Entry *entry : entries) {
+    if (entry->key == key)
+      return entry;
+  }
+  return nullptr;
+}
+
+template<typename K, typename V>
+const V *LruCache<K, V>::acquire(const K &key) {
+  pthread_mutex_lock(&mutex);
+  Entry *entry = find(key);
+  if (entry != nullptr) {
+    ++entry->pins;
+    entry->last_use = ++clock;
+    ++hit_count;
+  } else {
+    ++miss_count;
+  }
+  pthread_mutex_unlock(&mutex);
+  return entry != nullptr ? &entry->value : nullptr;
+}
+
+template<typename K, typename V>
+const V *LruCache<K, V>::insert(const K &key, V value, size_t cost) {
+  pthread_mutex_lock(&mutex);
+  Entry *entry = find(key);
+  if (entry != nullptr) {
+    value.free();
+  } else if (make_room(cost)) {
+    entry = new Entry{key, value, cost, 0U, 0U};
+    entries.push(entry);
+    used_cost += cost;
+  }
+  if (entry != nullptr) {
+    ++entry->pins;
+    entry->last_use = ++clock;
+  }
+  pthread_mutex_unlock(&mutex);
+  return entry != nullptr ? &entry->value : nullptr;
+}
+
+template<typename K, typename V>
+void LruCache<K, V>::release(const V *value) {
+  pthread_mutex_lock(&mutex);
+  bool found = false;
+  for (Entry *entry : entries) {
+    if (&entry->value == value) {
+      assert(entry->pins > 0);
+      --entry->pins;
+      found = true;
+      break;
+    }
+  }
+  assert(found);
+  pthread_mutex_unlock(&mutex);
+}
+
+template<typename K, typename V>
+bool LruCache<K, V>::make_room(size_t cost) {
+  if (cost > capacity)
+    return false;
+  while (used_cost + cost > capacity) {
+    size_t victim = entries.len;
+    for (size_t i = 0; i < entries.len; ++i) {
+      if (entries[i]->pins == 0 && (victim == entries.len || entries[i]->last_use < entries[victim]->last_use))
+        victim = i;
+    }
+    if (victim == entries.len)
+      return false;
+    Entry *entry = entries[victim];
+    used_cost -= entry->cost;
+    entry->value.free();
+    delete entry;
+    entries[victim] = entries[entries.len - 1];
+    --entries.len;
+  }
+  return true;
+}
+
+template<typename K, typename V>
+void LruCache<K, V>::free() {
+  for (Entry *entry : entries) {
+    assert(entry->pins == 0);
+    entry->value.free();
+    delete entry;
+  }
+  entries.free();
+  used_cost = 0U;
+  pthread_mutex_destroy(&mutex);
+}
+
+#endif //QUERY_JOINER__LRU_CACHE_H_
@@ -35,7 +35,6 @@ struct Predicate {
 
 constexpr int max_relations = 20;
 constexpr int max_columns = 20;
-constexpr int max_joins = 4;
 struct ParseQueryResult {
   int num_relations;
   int actual_relations[max_relations + 1];
@@ -2,14 +2,16 @@
 // Created by aris on 7/1/20.
 //
 
+#include <algorithm>
 #include <mutex>
 #include "query_executor.h"
 #include "report_utils.h"
+#include "generic_join.h"
 
 extern TaskScheduler scheduler;
 
-QueryExecutor::QueryExecutor(RelationStorage &rs)
-    : intermediate_results(), relation_storage(rs) {
+QueryExecutor::QueryExecutor(RelationStorage &rs, const Stats *stats)
+    : intermediate_results(), relation_storage(rs), stats{stats}, estimates{}, replans{0U} {
   pthread_mutex_init(&ir_mutex, NULL);
 }
 
@@ -17,11 +19,32 @@ StretchyBuf<uint64_t> QueryExecutor::execute_query(ParseQueryResult pqr) {
   // Clean up the ir's.
   intermediate_results.clear();
   intermediate_results.free();
+  join_profile.reset();
+  estimates.reset();
+  replans = 0U;
   assert(pqr.predicates.size > 0);
+  // A chain of binary joins builds the whole result of a cycle before its last predicate filters it.
+  GenericJoin generic_join{relation_storage, pqr};
+  if (generic_join.is_cyclic() && generic_join.can_execute()) {
+    return generic_join.execute();
+  }
   int is_chain = 0;
-  for (auto predicate: pqr.predicates) {
-    if (predicate.kind != PRED::JOIN)
+  // The last join only feeds the select clause, so it computes the sums without materializing its result.
+  size_t last_join = pqr.predicates.size;
+  for (size_t i = 0; i < pqr.predicates.size; ++i) {
+    if (pqr.predicates[i].kind == PRED::JOIN)
+      last_join = i;
+  }
+  StretchyBuf<uint64_t> sums;
+  bool sums_computed = false;
+  for (size_t i = 0; i < pqr.predicates.size; ++i) {
+    if (pqr.predicates[i].kind != PRED::JOIN)
       continue;
+    if (stats != nullptr && i != last_join) {
+      adapt_plan(pqr, i);
+    }
+    auto predicate = pqr.predicates[i];
+    bool is_last_join = i == last_join;
     auto r1 = predicate.lhs.first; // Left relation to join.
     auto r2 = predicate.rhs.first; // Right relation to join.
     int target_ir_index_1 = get_target_ir_index(r1);
@@ -38,19 +61,32 @@ StretchyBuf<uint64_t> QueryExecutor::execute_query(ParseQueryResult pqr) {
       // Don't forget to wait for the ir's to finish their joins.
       target_ir_1.previous_join->wait();
       target_ir_2.previous_join->wait();
-      target_ir_1.join_with_ir(
-          target_ir_2, predicate.lhs.first, predicate.lhs.second,
-          predicate.rhs.first, predicate.rhs.second);
+      if (is_last_join) {
+        sums = target_ir_1.join_with_ir_and_select(
+            target_ir_2, predicate.lhs.first, predicate.lhs.second,
+            predicate.rhs.first, predicate.rhs.second, pqr.sums);
+        sums_computed = true;
+      } else {
+        target_ir_1.join_with_ir(
+            target_ir_2, predicate.lhs.first, predicate.lhs.second,
+            predicate.rhs.first, predicate.rhs.second);
+      }
       pthread_mutex_lock(&ir_mutex);
       intermediate_results_remove_at(target_ir_index_2);
       pthread_mutex_unlock(&ir_mutex);
     } else if (target_ir_index_1 == -1 && target_ir_index_2 == -1) {
       // If both relations are new add a new ir to the list.
       IntermediateResult new_ir(relation_storage, pqr);
+      new_ir.profile = &join_profile;
       pthread_mutex_lock(&ir_mutex);
       intermediate_results.push(new_ir); // first push and then start to execute...
       pthread_mutex_unlock(&ir_mutex);
-      intermediate_results[intermediate_results.len-1].execute_join(predicate);
+      if (is_last_join) {
+        sums = intermediate_results[intermediate_results.len-1].execute_join_and_select(predicate, pqr.sums);
+        sums_computed = true;
+      } else {
+        intermediate_results[intermediate_results.len-1].execute_join(predicate);
+      }
     } else {
       // This is the common case. What we did in previous versions.
       pthread_mutex_lock(&ir_mutex);
@@ -58,12 +94,20 @@ StretchyBuf<uint64_t> QueryExecutor::execute_query(ParseQueryResult pqr) {
                         intermediate_results[target_ir_index_2] :
                         intermediate_results[target_ir_index_1];
       pthread_mutex_unlock(&ir_mutex);
-      target_ir.execute_join(predicate);
+      if (is_last_join) {
+        sums = target_ir.execute_join_and_select(predicate, pqr.sums);
+        sums_computed = true;
+      } else {
+        target_ir.execute_join(predicate);
+      }
     }
   }
   // Make sure that when there are no more join operations,
   // all join operations collapsed to a single ir.
   assert(intermediate_results.len == 1);
+  if (sums_computed) {
+    return sums;
+  }
   // Don't forget to wait for the last join predicate
   // to finish before executing select clause.
   if (intermediate_results[0].previous_join != nullptr) {
@@ -72,6 +116,60 @@ StretchyBuf<uint64_t> QueryExecutor::execute_query(ParseQueryResult pqr) {
   return intermediate_results[0].execute_select(pqr.sums);
 }
 
+void QueryExecutor::adapt_plan(ParseQueryResult &pqr, size_t i) {
+  const Predicate &predicate = pqr.predicates[i];
+  int target_ir_index_1 = get_target_ir_index(predicate.lhs.first);
+  int target_ir_index_2 = get_target_ir_index(predicate.rhs.first);
+  // A predicate within an intermediate result filters it, its estimate counted it already.
+  if (target_ir_index_1 != -1 && target_ir_index_1 == target_ir_index_2)
+    return;
+  // get_target_ir_index stops at the intermediate result of the relation, the ones after it may still be joining.
+  for (IntermediateResult &ir : intermediate_results) {
+    if (ir.previous_join != nullptr) {
+      ir.previous_join->wait();
+    }
+  }
+  JoinedRelations joined[max_relations];
+  int joined_n = 0;
+  bool is_off = false;
+  for (IntermediateResult &ir : intermediate_results) {
+    uint32_t relations = 0U;
+    for (int r = 0; r < pqr.num_relations; ++r) {
+      if (ir.column_is_allocated(r))
+        relations |= 1U << r;
+    }
+    double rows = (double) ir.row_count();
+    joined[joined_n++] = {relations, rows};
+    for (size_t e = 0; e < estimates.len; ++e) {
+      if (estimates[e].relations != relations)
+        continue;
+      double estimate = std::max(estimates[e].rows, 1.0);
+      double q_error = std::max(rows, 1.0) / estimate;
+      is_off = is_off || q_error > max_q_error || q_error < 1.0 / max_q_error;
+      JoinedRelations last = estimates.pop();
+      if (e != estimates.len) {
+        estimates[e] = last;
+      }
+      break;
+    }
+  }
+  if (is_off && reorder_remaining_joins(pqr, i, *stats, joined, joined_n)) {
+    ++replans;
+  }
+  const Predicate &next = pqr.predicates[i];
+  uint32_t relations = 1U << next.lhs.first | 1U << next.rhs.first;
+  for (int j = 0; j < joined_n; ++j) {
+    if (joined[j].relations & relations)
+      relations |= joined[j].relations;
+  }
+  for (int j = 0; j < joined_n; ++j) {
+    // The re-planned predicate may filter an intermediate result instead.
+    if (joined[j].relations == relations)
+      return;
+  }
+  estimates.push({relations, estimate_join_rows(pqr, i, *stats, joined, joined_n, relations)});
+}
+
 int QueryExecutor::get_target_ir_index(size_t relation_index) {
   for (int i = 0; i < intermediate_results.len; ++i) {
     auto &ir = intermediate_results[i];
@@ -101,6 +199,8 @@ void QueryExecutor::free() {
     v.free();
   }
   intermediate_results.free();
+  estimates.free();
+  join_profile.free();
 }
 
 Future<StretchyBuf<uint64_t>> QueryExecutor::execute_query_async(ParseQueryResult pqr, TaskState *state) {
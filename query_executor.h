@@ -8,6 +8,7 @@
 #include "stretchy_buf.h"
 #include "array.h"
 #include "intermediate_result.h"
+#include "join_order.h"
 
 struct TaskState {
   TaskState() : query_index{0U} {
@@ -22,11 +23,15 @@ struct TaskState {
 /**
  * This class is used to perform query executions,
  * with the predicates being executed at any order.
- * TODO maybe later we keep statistics in here too.
+ * With the statistics of the relations, it re-plans the joins that are left when an intermediate result
+ * turns out much bigger or smaller than estimated.
  */
 class QueryExecutor {
  public:
-  explicit QueryExecutor(RelationStorage &rs);
+  // The factor between the actual and the estimated rows of an intermediate result that re-plans the query.
+  static constexpr double max_q_error = 10.0;
+
+  explicit QueryExecutor(RelationStorage &rs, const Stats *stats = nullptr);
 
   /**
    * Executes a query based on it's parse result.
@@ -45,10 +50,25 @@ class QueryExecutor {
 
   void free();
 
+  /**
+   * The joins of the last query executed, with the algorithm chosen for each of them.
+   */
+  const JoinProfile &profile() const { return join_profile; }
+
+  /**
+   * The number of times the last query executed was re-planned.
+   */
+  size_t replan_count() const { return replans; }
+
  private:
   StretchyBuf<IntermediateResult> intermediate_results;
   RelationStorage relation_storage;
   pthread_mutex_t ir_mutex;
+  JoinProfile join_profile;
+  const Stats *stats;
+  // The estimated rows of the intermediate results that are not checked yet, by their relations.
+  StretchyBuf<JoinedRelations> estimates;
+  size_t replans;
 
   /**
    * Get's the index of the ir that contains relation 'r'
@@ -64,6 +84,14 @@ class QueryExecutor {
    */
   void intermediate_results_remove_at(size_t i);
 
+  /**
+   * Runs before the i-th predicate, if it joins relations of different intermediate results. The intermediate
+   * results are compared with their estimates, and if one is more than "max_q_error" off, the predicates from
+   * the i-th on are re-planned with their actual rows. Then the result of the i-th predicate is estimated,
+   * to be checked in turn.
+   */
+  void adapt_plan(ParseQueryResult &pqr, size_t i);
+
   static StretchyBuf<uint64_t> execute_query_static(QueryExecutor *this_qe,
                                                     ParseQueryResult pqr, TaskState *state);
 };
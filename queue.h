@@ -66,7 +66,7 @@ bool Queue<T>::emtpy() {
 
 template<typename T>
 bool Queue<T>::full() {
-  bool res = ((left == right + 1) || (right == capacity && left == 0));
+  bool res = ((right + 1 == left) || (right + 1 == capacity && left == 0));
   return res;
 }
 
@@ -1,6 +1,9 @@
 #include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include "relation_data.h"
 #include "joinable.h"
+#include "column_filter.h"
 
 RelationData::RelationData(uint64_t row_n, uint64_t col_n) : Array(col_n) {
   for (size_t i = 0U; i != col_n; ++i) {
@@ -13,6 +16,18 @@ void RelationData::free() {
     cols.clear_and_free();
   }
   clear_and_free();
+  max_values.clear_and_free();
+  min_values.clear_and_free();
+  distinct_counts.clear_and_free();
+  histograms.clear_and_free();
+  for (ZoneMap &zones : zone_maps) {
+    zones.free();
+  }
+  zone_maps.clear_and_free();
+  for (JoinInput &index : sorted_indexes) {
+    index.free();
+  }
+  sorted_indexes.clear_and_free();
 }
 
 void RelationData::print(FILE *fp, char delimiter) {
@@ -32,45 +47,213 @@ void RelationData::print(FILE *fp, char delimiter) {
   }
 }
 
-Joinable RelationData::to_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates) {
-  assert(key_index < this->size);
-  size_t row_n = this->operator[](0).size;
-  StretchyBuf<JoinableEntry> list;
-  for (size_t i = 0; i < row_n; ++i) {
-    bool tuple_is_match = true;
-    for (auto filter: filter_predicates) {
-      auto compare_value = this->operator[](filter.lhs.second)[i];
-      switch (filter.op) {
-        case '>':
-          tuple_is_match &= compare_value.v > filter.filter_val;
-          break;
-        case '<':
-          tuple_is_match &= compare_value.v < filter.filter_val;
-          break;
-        case '=':
-          tuple_is_match &= compare_value.v == filter.filter_val;
-          break;
-        default:
-          assert(false); // Not so good.
-          break;
-      }
+double RelationData::range_selectivity(size_t column_index, ColumnRange range) const {
+  if (const Histogram *column_histogram = histogram(column_index))
+    return column_histogram->selectivity(range);
+  uint64_t min = column_min(column_index);
+  uint64_t max = column_max(column_index);
+  size_t distinct = column_distinct(column_index);
+  if (distinct == 0U)
+    distinct = std::min(row_count(), (size_t) (max - min) + 1U);
+  return range.selectivity(min, max, distinct);
+}
+
+FilteredRows RelationData::filter(StretchyBuf<Predicate> &filter_predicates) {
+  RowBitmap rows = RowBitmap::create(row_count(), true);
+  StretchyBuf<ColumnFilter> filters = merge_column_filters(filter_predicates);
+  for (ColumnFilter &filter : filters) {
+    filter.selectivity = range_selectivity(filter.column, filter.range);
+  }
+  order_column_filters(filters);
+  for (ColumnFilter filter : filters) {
+    if (!filter_column(this->operator[](filter.column).data, filter.range, rows, zone_map(filter.column)))
+      break;
+  }
+  filters.free();
+  return FilteredRows::compress(rows);
+}
+
+// Below a row in this many of the sorted index, sorting the rows that passed the filters is cheaper
+// than checking every entry of the index against them.
+static constexpr size_t sorted_index_scan_ratio = 16U;
+
+static size_t sort_threshold() {
+  static size_t threshold = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  return threshold;
+}
+
+static void sort_entries(PackedJoinable &joinable) {
+  if (joinable.size < 2U)
+    return;
+  PackedJoinable aux(joinable.size);
+  aux.size = joinable.size;
+  joinable.sort(aux, sort_threshold());
+  aux.clear_and_free();
+}
+
+static void sort_entries(Joinable &joinable) {
+  if (joinable.size < 2U)
+    return;
+  Joinable aux(joinable.size);
+  aux.size = joinable.size;
+  StretchyBuf<Joinable::SortContext> context_stack{};
+  joinable.sort({aux, context_stack}, sort_threshold());
+  aux.clear_and_free();
+  context_stack.free();
+}
+
+template<typename J, typename MakeEntry>
+static J scan_to_joinable(RelationData &relation, size_t key_index, const FilteredRows *filtered,
+                          MakeEntry make_entry);
+
+/**
+ * Scans the sorted index of a column, keeping the entries of the rows that pass the filters,
+ * so the result is sorted without sorting it. If only a few rows passed, they are sorted instead.
+ */
+template<typename J, typename MakeEntry>
+static J sorted_index_to_joinable(RelationData &relation, size_t key_index, const FilteredRows *filtered,
+                                  MakeEntry make_entry) {
+  const JoinInput &index = relation.sorted_index(key_index);
+  if (filtered == nullptr) {
+    J joinable(std::max(index.size(), (size_t) 1U));
+    for (size_t i = 0; i < index.size(); ++i) {
+      uint64_t key = index.is_packed ? PackedJoinable::key(index.packed.data[i]) : index.wide.data[i].first.v;
+      joinable.push(make_entry(key, index.row_id(i)));
     }
-    if (tuple_is_match) {
-      JoinableEntry entry {this->operator[](key_index)[i], i};
-      list.push(entry);
+    return joinable;
+  }
+  if (filtered->count * sorted_index_scan_ratio < index.size()) {
+    J joinable = scan_to_joinable<J>(relation, key_index, filtered, make_entry);
+    sort_entries(joinable);
+    return joinable;
+  }
+  RowBitmap rows = filtered->to_bitmap();
+  J joinable(std::max(filtered->count, (size_t) 1U));
+  for (size_t i = 0; i < index.size(); ++i) {
+    uint64_t row = index.row_id(i);
+    if (!rows.test(row))
+      continue;
+    uint64_t key = index.is_packed ? PackedJoinable::key(index.packed.data[i]) : index.wide.data[i].first.v;
+    joinable.push(make_entry(key, row));
+  }
+  if (filtered->is_list()) {
+    rows.free();
+  }
+  return joinable;
+}
+
+/**
+ * Writes the entries of the rows that pass the filters in row order, into a joinable of exactly their number.
+ */
+template<typename J, typename MakeEntry>
+static J scan_to_joinable(RelationData &relation, size_t key_index, const FilteredRows *filtered,
+                          MakeEntry make_entry) {
+  size_t row_n = relation.row_count();
+  const u64 *keys = relation[key_index].data;
+  if (filtered == nullptr) {
+    J joinable(std::max(row_n, (size_t) 1U));
+    for (size_t i = 0; i < row_n; ++i) {
+      joinable.push(make_entry(keys[i].v, i));
     }
+    return joinable;
+  }
+  J joinable(std::max(filtered->count, (size_t) 1U));
+  filtered->for_each([&](size_t row) { joinable.push(make_entry(keys[row].v, row)); });
+  return joinable;
+}
+
+Joinable RelationData::to_joinable(size_t key_index, const FilteredRows *rows, bool sorted) {
+  assert(key_index < this->size);
+  auto make_entry = [](uint64_t key, uint64_t row) {
+    return JoinableEntry{key, row};
+  };
+  if (sorted && has_sorted_index(key_index)) {
+    return sorted_index_to_joinable<Joinable>(*this, key_index, rows, make_entry);
   }
-  // Convert list to array.
-  if (list.len == 0)
-    return Joinable::empty();
-  Joinable joinable(list.len);
-  for (auto e: list) {
-    joinable.push(e);
+  return scan_to_joinable<Joinable>(*this, key_index, rows, make_entry);
+}
+
+PackedJoinable RelationData::to_packed_joinable(size_t key_index, const FilteredRows *rows, bool sorted) {
+  assert(key_index < this->size);
+  assert(PackedJoinable::can_pack(column_max(key_index), row_count()));
+  auto make_entry = [](uint64_t key, uint64_t row) {
+    return PackedJoinable::pack(key, row);
+  };
+  if (sorted && has_sorted_index(key_index)) {
+    return sorted_index_to_joinable<PackedJoinable>(*this, key_index, rows, make_entry);
   }
-  list.free();
+  return scan_to_joinable<PackedJoinable>(*this, key_index, rows, make_entry);
+}
+
+Joinable RelationData::to_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates, bool sorted) {
+  if (filter_predicates.len == 0)
+    return to_joinable(key_index, (const FilteredRows *) nullptr, sorted);
+  FilteredRows rows = filter(filter_predicates);
+  Joinable joinable = to_joinable(key_index, &rows, sorted);
+  rows.free();
   return joinable;
 }
 
+PackedJoinable RelationData::to_packed_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates,
+                                                bool sorted) {
+  if (filter_predicates.len == 0)
+    return to_packed_joinable(key_index, (const FilteredRows *) nullptr, sorted);
+  FilteredRows rows = filter(filter_predicates);
+  PackedJoinable joinable = to_packed_joinable(key_index, &rows, sorted);
+  rows.free();
+  return joinable;
+}
+
+void RelationData::allocate_sorted_indexes() {
+  sorted_indexes = Array<JoinInput>(this->size);
+  distinct_counts = Array<u64>(this->size);
+  histograms = Array<Histogram>(this->size);
+  for (size_t i = 0; i < this->size; ++i) {
+    sorted_indexes.push(JoinInput());
+    distinct_counts.push(0U);
+    histograms.push(Histogram{});
+  }
+}
+
+/**
+ * @return The number of distinct keys of a sorted join input.
+ */
+static size_t count_distinct_keys(const JoinInput &index) {
+  size_t distinct = 0U;
+  uint64_t previous = 0U;
+  for (size_t i = 0; i < index.size(); ++i) {
+    uint64_t key = index.key(i);
+    distinct += i == 0U || key != previous;
+    previous = key;
+  }
+  return distinct;
+}
+
+void RelationData::build_sorted_index(size_t column_index) {
+  assert(column_index < sorted_indexes.size);
+  size_t row_n = row_count();
+  const u64 *values = this->operator[](column_index).data;
+  JoinInput &index = sorted_indexes[column_index];
+  index.is_packed = row_n != 0 && PackedJoinable::can_pack(column_max(column_index), row_n - 1U);
+  if (index.is_packed) {
+    index.packed = PackedJoinable(row_n);
+    for (size_t i = 0; i < row_n; ++i) {
+      index.packed.push(PackedJoinable::pack(values[i].v, i));
+    }
+    sort_entries(index.packed);
+    distinct_counts[column_index] = count_distinct_keys(index);
+    histograms[column_index] = Histogram::build(row_n, [&](size_t i) { return index.key(i); });
+    return;
+  }
+  index.wide = Joinable(std::max(row_n, (size_t) 1U));
+  for (size_t i = 0; i < row_n; ++i) {
+    index.wide.push(JoinableEntry{values[i], i});
+  }
+  sort_entries(index.wide);
+  distinct_counts[column_index] = count_distinct_keys(index);
+  histograms[column_index] = Histogram::build(row_n, [&](size_t i) { return index.key(i); });
+}
+
 RelationData RelationData::from_binary_file(const char *filename) {
   int fd = ::open(filename, O_RDONLY);
   uint64_t header[2] = {0};
@@ -84,6 +267,21 @@ RelationData RelationData::from_binary_file(const char *filename) {
     row.size = nr_rows;
     data[i] = row;
   }
+  data.max_values = Array<u64>(nr_cols);
+  data.min_values = Array<u64>(nr_cols);
+  data.zone_maps = Array<ZoneMap>(nr_cols);
+  for (size_t i = 0U; i != nr_cols; ++i) {
+    ZoneMap zones = ZoneMap::build(data[i].data, nr_rows);
+    uint64_t max = 0U;
+    uint64_t min = UINT64_MAX;
+    for (size_t b = 0U; b != zones.block_count(); ++b) {
+      max = std::max(max, zones.maxs[b].v);
+      min = std::min(min, zones.mins[b].v);
+    }
+    data.max_values.push(max);
+    data.min_values.push(nr_rows != 0U ? min : 0U);
+    data.zone_maps.push(zones);
+  }
   close(fd);
   return data;
 }
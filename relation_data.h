@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cstdio>
 #include "array.h"
+#include "column_filter.h"
 #include "common.h"
 #include "joinable.h"
 #include "parse.h"
@@ -14,16 +15,131 @@ struct RelationData : public Array<Array<u64>> {
    * Creates a joinable object from relation data.
    * The "key_index" specifies which column will be used as a join column.
    * The row_ids of the joinable are the index of each relation data tuple.
+   * If "sorted" is set and the column has a sorted index, the joinable is sorted too, else it is in row order.
    *
    * @param key_index The index of the join column.
    * @return A Joinable object.
    */
-  Joinable to_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates);
+  Joinable to_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates, bool sorted = true);
+
+  /**
+   * Same as to_joinable, but creates a packed joinable.
+   * The key column and the row_ids must fit in 32 bits (see PackedJoinable::can_pack).
+   */
+  PackedJoinable to_packed_joinable(size_t key_index, StretchyBuf<Predicate> filter_predicates, bool sorted = true);
+
+  /**
+   * Same as to_joinable, but for the rows that passed the filters already, or all the rows if "rows" is null.
+   */
+  Joinable to_joinable(size_t key_index, const FilteredRows *rows, bool sorted = true);
+
+  PackedJoinable to_packed_joinable(size_t key_index, const FilteredRows *rows, bool sorted = true);
+
+  /**
+   * Evaluates filter predicates on the relation, a column at a time, the most selective filter first.
+   * @return The rows that pass all of them, which must be freed.
+   */
+  FilteredRows filter(StretchyBuf<Predicate> &filter_predicates);
+
+  /**
+   * @return The estimated fraction of the rows whose value of the column is in the range,
+   * from the histogram of the column if it has one, or else as if its values were uniform.
+   */
+  double range_selectivity(size_t column_index, ColumnRange range) const;
+
+  /**
+   * Builds the sorted (value, row-id) index of a column, and its histogram from the sorted values.
+   * It is packed when the values and the row-ids fit. The indexes must be allocated with allocate_sorted_indexes first.
+   */
+  void build_sorted_index(size_t column_index);
+
+  void allocate_sorted_indexes();
+
+  /**
+   * @return True if the sorted index of the column was built.
+   */
+  bool has_sorted_index(size_t column_index) const {
+    if (column_index >= sorted_indexes.size)
+      return false;
+    const JoinInput &index = sorted_indexes[column_index];
+    return index.is_packed || index.wide.data != nullptr;
+  }
+
+  const JoinInput &sorted_index(size_t column_index) const { return sorted_indexes[column_index]; }
+
+  size_t row_count() const { return this->size ? (*this)[0].size : 0U; }
+
+  /**
+   * @return The biggest value of the column, or UINT64_MAX if it isn't known.
+   */
+  uint64_t column_max(size_t column_index) const {
+    return max_values.size ? max_values[column_index].v : UINT64_MAX;
+  }
+
+  /**
+   * @return The smallest value of the column, or 0 if it isn't known.
+   */
+  uint64_t column_min(size_t column_index) const {
+    return min_values.size ? min_values[column_index].v : 0U;
+  }
+
+  /**
+   * @return The number of distinct values of the column, or 0 if it isn't known.
+   * It's counted when the sorted index of the column is built.
+   */
+  size_t column_distinct(size_t column_index) const {
+    return distinct_counts.size ? distinct_counts[column_index].v : 0U;
+  }
+
+  /**
+   * @return The zone map of the column, or nullptr if it isn't known.
+   */
+  const ZoneMap *zone_map(size_t column_index) const {
+    return zone_maps.size ? &zone_maps[column_index] : nullptr;
+  }
+
+  /**
+   * @return The histogram of the column, or nullptr if it isn't known, because its sorted index isn't built.
+   */
+  const Histogram *histogram(size_t column_index) const {
+    return has_sorted_index(column_index) ? &histograms[column_index] : nullptr;
+  }
+
   void print(FILE *fp = stdout, char delimiter = ' ');
 
   static RelationData from_binary_file(const char *filename);
 
   void free();
+
+  /**
+   * The biggest value of every column. It's computed when the relation is loaded from a binary file.
+   */
+  Array<u64> max_values;
+
+  /**
+   * The smallest value of every column, computed along with max_values.
+   */
+  Array<u64> min_values;
+
+  /**
+   * The number of distinct values of every column, or none if the sorted indexes were not built.
+   */
+  Array<u64> distinct_counts;
+
+  /**
+   * The zone map of every column, built along with max_values.
+   */
+  Array<ZoneMap> zone_maps;
+
+  /**
+   * The histogram of every column, or none if the sorted indexes were not built.
+   */
+  Array<Histogram> histograms;
+
+  /**
+   * The sorted index of every column, or none if they were not built.
+   */
+  Array<JoinInput> sorted_indexes;
 };
 
 #endif //SORT_MERGE_JOIN__RELATION_DATA_H_
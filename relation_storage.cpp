@@ -2,13 +2,32 @@
 #include "utils.h"
 #include "report_utils.h"
 
-RelationStorage::RelationStorage(size_t relation_n) : Array(relation_n) {}
+RelationStorage::RelationStorage(size_t relation_n) : Array(relation_n), joinable_cache{nullptr}, filter_cache{nullptr} {}
 
 void RelationStorage::print_relations(uint64_t start_index, uint64_t end_index) {
   for (uint64_t index = start_index; index <= end_index; index++)
     (*this)[index].print();
 }
 
+void RelationStorage::allocate_sorted_indexes() {
+  for (RelationData &relation : *this) {
+    relation.allocate_sorted_indexes();
+  }
+}
+
+void RelationStorage::build_sorted_indexes(TaskScheduler *scheduler, const StretchyBuf<Pair<size_t, size_t>> &columns) {
+  StretchyBuf<Pair<size_t, size_t>> missing;
+  for (size_t i = 0; i < columns.len; ++i) {
+    if (!(*this)[columns.data[i].first].has_sorted_index(columns.data[i].second))
+      missing.push(columns.data[i]);
+  }
+  // The columns are sorted one per task.
+  scheduler->parallel_for(missing.len, [&](size_t i) {
+    (*this)[missing[i].first].build_sorted_index(missing[i].second);
+  });
+  missing.free();
+}
+
 void RelationStorage::free() {
   for (RelationData &data : *this) {
     data.clear_and_free();
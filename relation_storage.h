@@ -6,6 +6,8 @@
 #include "common.h"
 #include "array.h"
 #include "command_interpreter.h"
+#include "filter_cache.h"
+#include "joinable_cache.h"
 
 struct RelationStorage : public Array<RelationData> {
   explicit RelationStorage(size_t relation_n);
@@ -17,7 +19,30 @@ struct RelationStorage : public Array<RelationData> {
    */
   void insert_from_filenames(CommandInterpreter::CommandIterator start, CommandInterpreter::CommandIterator end);
 
+  /**
+   * Allocates the sorted indexes of every relation, without building any of them.
+   */
+  void allocate_sorted_indexes();
+
+  /**
+   * Builds the sorted indexes of the columns that aren't built yet, one column per task of a task scheduler.
+   * Only the join columns of the queries are indexed, as they show up, so the columns that are never joined
+   * take no memory and no load time.
+   * @param columns Pairs of global relation index and column index, without duplicates.
+   */
+  void build_sorted_indexes(TaskScheduler *scheduler, const StretchyBuf<Pair<size_t, size_t>> &columns);
+
   void free();
+
+  /**
+   * The sorted join inputs shared by all the queries, or null if they are not cached.
+   */
+  JoinableCache *joinable_cache;
+
+  /**
+   * The filtered rows of the base relations shared by all the queries, or null if they are not cached.
+   */
+  FilterCache *filter_cache;
 };
 
 #endif //SORT_MERGE_JOIN__RELATIONSTORAGE_H_
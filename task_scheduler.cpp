@@ -1,7 +1,49 @@
 #include <pthread.h>
+#include <algorithm>
 #include "task_scheduler.h"
 #include "report_utils.h"
 
+/**
+ * The shared state of a parallel_for call.
+ * It is reference counted because a helper task may get dequeued
+ * after the parallel_for call that pushed it has already returned.
+ */
+struct ParallelForState {
+  ParallelForState(size_t nr_chunks, size_t ref_count, const std::function<void(size_t)> &callable)
+      : callable{callable}, nr_chunks{nr_chunks}, next_chunk{0U}, done_chunks{0U}, ref_count{ref_count} {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&done_cond, NULL);
+  }
+
+  std::function<void(size_t)> callable;
+  size_t nr_chunks;
+  volatile size_t next_chunk;
+  volatile size_t done_chunks;
+  volatile size_t ref_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t done_cond;
+};
+
+static void run_chunks(ParallelForState *pf_state) {
+  size_t chunk;
+  while ((chunk = __sync_fetch_and_add(&pf_state->next_chunk, 1)) < pf_state->nr_chunks) {
+    pf_state->callable(chunk);
+    if (__sync_add_and_fetch(&pf_state->done_chunks, 1) == pf_state->nr_chunks) {
+      pthread_mutex_lock(&pf_state->mutex);
+      pthread_cond_broadcast(&pf_state->done_cond);
+      pthread_mutex_unlock(&pf_state->mutex);
+    }
+  }
+}
+
+static void release(ParallelForState *pf_state) {
+  if (__sync_sub_and_fetch(&pf_state->ref_count, 1) == 0) {
+    pthread_mutex_destroy(&pf_state->mutex);
+    pthread_cond_destroy(&pf_state->done_cond);
+    delete pf_state;
+  }
+}
+
 static void *worker(void *arg) {
   ThreadState *state = (ThreadState *) arg;
   for (;;) {
@@ -13,7 +55,9 @@ static void *worker(void *arg) {
       pthread_mutex_unlock(&state->queue_mutex);
       break;
     }
-    std::function<void()> &task = state->task_queue.pop();
+    // Move the task out of the queue before unlocking, otherwise its slot
+    // may get overwritten by a producer while we are still running it.
+    std::function<void()> task = std::move(state->task_queue.pop());
     pthread_cond_signal(&state->full_cond);
     pthread_mutex_unlock(&state->queue_mutex);
     task();
@@ -39,4 +83,47 @@ void TaskScheduler::wait_remaining_and_stop() {
   for (size_t i = 0U; i != nr_threads; ++i) {
     pthread_join(threads[i], NULL);
   }
-}
\ No newline at end of file
+}
+
+bool TaskScheduler::try_push(const std::function<void()> &job) {
+  pthread_mutex_lock(&state->queue_mutex);
+  if (state->task_queue.full()) {
+    pthread_mutex_unlock(&state->queue_mutex);
+    return false;
+  }
+  state->task_queue.push(job);
+  pthread_cond_signal(&state->emtpy_cond);
+  pthread_mutex_unlock(&state->queue_mutex);
+  return true;
+}
+
+void TaskScheduler::parallel_for(size_t nr_chunks, const std::function<void(size_t)> &callable) {
+  if (nr_chunks == 0U) return;
+  if (nr_chunks == 1U) {
+    callable(0U);
+    return;
+  }
+  size_t nr_helpers = std::min(nr_threads, nr_chunks - 1U);
+  ParallelForState *pf_state = new ParallelForState(nr_chunks, nr_helpers + 1U, callable);
+  for (size_t i = 0U; i != nr_helpers; ++i) {
+    bool pushed = try_push([pf_state]() {
+      run_chunks(pf_state);
+      release(pf_state);
+    });
+    if (!pushed) {
+      // The queue is full, the chunks of this helper will be run by someone else.
+      release(pf_state);
+    }
+  }
+  run_chunks(pf_state);
+  pthread_mutex_lock(&pf_state->mutex);
+  while (pf_state->done_chunks != nr_chunks) {
+    pthread_cond_wait(&pf_state->done_cond, &pf_state->mutex);
+  }
+  pthread_mutex_unlock(&pf_state->mutex);
+  release(pf_state);
+}
+
+size_t TaskScheduler::thread_count() const {
+  return nr_threads;
+}
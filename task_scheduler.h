@@ -1,3 +1,6 @@
+#ifndef JOB_SCHEDULER__TASK_SCHEDULER_H_
+#define JOB_SCHEDULER__TASK_SCHEDULER_H_
+
 #include <pthread.h>
 #include <functional>
 #include "queue.h"
@@ -244,7 +247,25 @@ struct TaskScheduler {
   template<typename F, typename... Args>
   Future<typename std::result_of<F(Args...)>::type> &add_task(const Task<F, Args...> &task);
 
+  /**
+   * Runs callable(i) for every i in [0, nr_chunks).
+   * The chunks are claimed dynamically by the calling thread and by up to nr_threads helper tasks.
+   * The calling thread takes part in the execution and only waits for chunks that are already running,
+   * so it is safe to call this from inside a task even when every worker is busy.
+   * @param nr_chunks: The number of chunks to execute
+   * @param callable: The callable to execute for every chunk index
+   */
+  void parallel_for(size_t nr_chunks, const std::function<void(size_t)> &callable);
+
+  size_t thread_count() const;
+
  private:
+  /**
+   * Pushes a job to the task queue without blocking
+   * @return: False if the queue was full and the job was not pushed
+   */
+  bool try_push(const std::function<void()> &job);
+
   pthread_t *threads;
   size_t nr_threads;
   ThreadState *state;
@@ -277,4 +298,6 @@ Future<typename std::result_of<F(Args...)>::type> &TaskScheduler::add_task(const
   pthread_cond_signal(&state->emtpy_cond);
   pthread_mutex_unlock(&state->queue_mutex);
   return future;
-}
\ No newline at end of file
+}
+
+#endif //JOB_SCHEDULER__TASK_SCHEDULER_H_
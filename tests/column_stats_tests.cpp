@@ -0,0 +1,68 @@
+#include <cassert>
+#include <cmath>
+#include "../column_stats.h"
+#include "../report_utils.h"
+
+TaskScheduler scheduler{4};
+
+// Well within 4 standard errors of the HyperLogLog sketch.
+static constexpr double max_relative_error = 0.065;
+
+// A relation of two columns: column 0 has "distinct" values, in [from, from + distinct), and column 1 is a constant.
+static RelationStorage create_relation(size_t row_n, uint64_t from, uint64_t distinct) {
+  RelationStorage relations(1);
+  RelationData relation(row_n, 2);
+  for (size_t i = 0; i < row_n; ++i) {
+    relation[0].push(from + (i * 7919U) % distinct);
+    relation[1].push((uint64_t) 42U);
+  }
+  relations.push(relation);
+  return relations;
+}
+
+static void assert_stat(ColumnStat stat, double l, double u, double f, double d) {
+  assert(stat.l == l && stat.u == u && stat.f == f);
+  assert(std::fabs(stat.d - d) / d <= max_relative_error);
+}
+
+static void test_unindexed_columns(size_t row_n, uint64_t distinct) {
+  FUNCTION_TEST();
+  RelationStorage relations = create_relation(row_n, 1000U, distinct);
+  relations.allocate_sorted_indexes();
+  Stats stats = compute_stats(relations, &scheduler);
+  ColumnStat keys = stats.get_column_stat({0, 0});
+  assert_stat(keys, 1000.0, (double) (1000U + distinct - 1U), (double) row_n, (double) distinct);
+  assert(keys.histogram == nullptr);
+  ColumnStat constant = stats.get_column_stat({0, 1});
+  assert_stat(constant, 42.0, 42.0, (double) row_n, 1.0);
+  assert(constant.histogram == nullptr);
+}
+
+static void test_indexed_column() {
+  FUNCTION_TEST();
+  size_t row_n = 300000U;
+  uint64_t distinct = 100000U;
+  RelationStorage relations = create_relation(row_n, 0U, distinct);
+  relations.allocate_sorted_indexes();
+  StretchyBuf<Pair<size_t, size_t>> columns;
+  columns.push({0U, 0U});
+  relations.build_sorted_indexes(&scheduler, columns);
+  columns.free();
+  Stats stats = compute_stats(relations, &scheduler);
+  // The distinct values come from the sketch whether the column is indexed or not, only the histogram differs.
+  ColumnStat keys = stats.get_column_stat({0, 0});
+  assert_stat(keys, 0.0, (double) (distinct - 1U), (double) row_n, (double) distinct);
+  assert(keys.histogram == relations[0].histogram(0));
+  assert(keys.histogram != nullptr);
+  assert(stats.get_column_stat({0, 1}).histogram == nullptr);
+}
+
+int main() {
+  scheduler.start();
+  // A single chunk.
+  test_unindexed_columns(1000U, 500U);
+  // A chunk per thread, their sketches are merged.
+  test_unindexed_columns(2000000U, 700000U);
+  test_indexed_column();
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include "../gather.h"
+#include "../report_utils.h"
+
+/**
+ * Measures the random lookups of a column by row-ids, with plain loops and with the prefetching gathers.
+ * Usage: bench_gather [column size] [number of lookups]
+ * The column should be much bigger than the last level cache, like the columns the queries read.
+ */
+
+static constexpr size_t gather_batch = 1024U;
+
+using benchmark_clock = std::chrono::steady_clock;
+
+static double nanoseconds_per_lookup(benchmark_clock::time_point start, size_t n) {
+  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(benchmark_clock::now() - start);
+  return (double) duration.count() / (double) n;
+}
+
+int main(int argc, char *args[]) {
+  size_t column_size = argc > 1 ? strtoull(args[1], nullptr, 10) : 1U << 25U;
+  size_t n = argc > 2 ? strtoull(args[2], nullptr, 10) : 1U << 24U;
+  auto *column = (u64 *) malloc(column_size * sizeof(u64));
+  auto *rowids = (u64 *) malloc(n * sizeof(u64));
+  auto *out = (u64 *) malloc(n * sizeof(u64));
+  assert(column && rowids && out);
+  std::mt19937_64 random{42};
+  for (size_t i = 0; i < column_size; ++i) {
+    column[i] = random();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    rowids[i] = random() % column_size;
+  }
+  report("%zu lookups in a column of %zu MB", n, column_size * sizeof(u64) >> 20U);
+
+  auto start = benchmark_clock::now();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += column[rowids[i].v].v;
+  }
+  report("sum, plain loop:    %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+
+  start = benchmark_clock::now();
+  uint64_t gathered_sum = gather_sum(column, rowids, n);
+  report("sum, gather_sum:    %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+  assert(sum == gathered_sum);
+
+  start = benchmark_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = column[rowids[i].v];
+  }
+  report("copy, plain loop:   %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+
+  start = benchmark_clock::now();
+  gather(column, rowids, n, out);
+  report("copy, gather:       %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+  for (size_t i = 0; i < n; ++i) {
+    assert(out[i] == column[rowids[i].v]);
+  }
+
+  // The column of a relation behind a selection of the ir, like gather_column walks them.
+  auto *selection = (u64 *) malloc(n * sizeof(u64));
+  auto *batch = (u64 *) malloc(gather_batch * sizeof(u64));
+  assert(selection && batch);
+  for (size_t i = 0; i < n; ++i) {
+    selection[i] = random() % n;
+  }
+  start = benchmark_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = column[rowids[selection[i].v].v];
+  }
+  report("chain, plain loop:  %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+
+  start = benchmark_clock::now();
+  for (size_t from = 0; from < n; from += gather_batch) {
+    size_t batch_n = std::min(gather_batch, n - from);
+    gather(rowids, selection + from, batch_n, batch);
+    gather(column, batch, batch_n, out + from);
+  }
+  report("chain, gather:      %6.2lf ns/lookup", nanoseconds_per_lookup(start, n));
+  for (size_t i = 0; i < n; ++i) {
+    assert(out[i] == column[rowids[selection[i].v].v]);
+  }
+
+  ::free(selection);
+  ::free(batch);
+  ::free(column);
+  ::free(rowids);
+  ::free(out);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#include <cstdlib>
+#include "../generic_join.h"
+#include "../intermediate_result.h"
+#include "../report_utils.h"
+
+TaskScheduler scheduler{4};
+
+// Relations of "column_n" columns with values in [0, value_range).
+static RelationStorage create_relations(size_t relation_n, size_t row_n, size_t column_n, size_t value_range) {
+  RelationStorage relations(relation_n);
+  for (size_t r = 0; r < relation_n; ++r) {
+    RelationData relation(row_n, column_n);
+    relation.max_values = Array<u64>(column_n);
+    for (size_t c = 0; c < column_n; ++c) {
+      uint64_t max = 0;
+      for (size_t i = 0; i < row_n; ++i) {
+        uint64_t value = std::rand() % value_range;
+        relation[c].push(value);
+        max = std::max(max, value);
+      }
+      relation.max_values.push(max);
+    }
+    relations.push(relation);
+  }
+  return relations;
+}
+
+static bool predicate_holds(RelationStorage &relations, const ParseQueryResult &pqr, const size_t *rows,
+                            const Predicate &predicate) {
+  auto value = [&](Pair<int, int> column) {
+    return relations[pqr.actual_relations[column.first]][column.second][rows[column.first]].v;
+  };
+  if (predicate.kind == PRED::JOIN)
+    return value(predicate.lhs) == value(predicate.rhs);
+  switch (predicate.op) {
+    case '>':
+      return value(predicate.lhs) > (uint64_t) predicate.filter_val;
+    case '<':
+      return value(predicate.lhs) < (uint64_t) predicate.filter_val;
+    default:
+      return value(predicate.lhs) == (uint64_t) predicate.filter_val;
+  }
+}
+
+// Enumerates every combination of rows, checking each predicate as soon as its relations are bound.
+static void brute_force(RelationStorage &relations, const ParseQueryResult &pqr, size_t *rows, int relation,
+                        uint64_t *sums) {
+  if (relation == pqr.num_relations) {
+    for (size_t s = 0; s < pqr.sums.size; ++s) {
+      auto pair = pqr.sums[s];
+      sums[s] += relations[pqr.actual_relations[pair.first]][pair.second][rows[pair.first]].v;
+    }
+    return;
+  }
+  size_t row_n = relations[pqr.actual_relations[relation]].row_count();
+  for (rows[relation] = 0; rows[relation] < row_n; ++rows[relation]) {
+    bool is_match = true;
+    for (auto predicate: pqr.predicates) {
+      int last = predicate.lhs.first;
+      if (predicate.kind == PRED::JOIN) {
+        last = std::max(last, predicate.rhs.first);
+      }
+      if (last == relation && !predicate_holds(relations, pqr, rows, predicate)) {
+        is_match = false;
+        break;
+      }
+    }
+    if (is_match) {
+      brute_force(relations, pqr, rows, relation + 1, sums);
+    }
+  }
+}
+
+static void free_query(ParseQueryResult &pqr) {
+  pqr.predicates.clear_and_free();
+  pqr.sums.clear_and_free();
+}
+
+static void test_generic_join(const char *query, size_t row_n, size_t value_range) {
+  FUNCTION_TEST();
+  report("%s", query);
+  RelationStorage relations = create_relations(3, row_n, 3, value_range);
+  ParseQueryResult pqr = parse_query(query);
+  GenericJoin join{relations, pqr};
+  assert(join.is_cyclic());
+  assert(join.can_execute());
+  auto result = join.execute();
+
+  size_t rows[max_relations];
+  uint64_t sums[max_relations * max_columns] = {0};
+  brute_force(relations, pqr, rows, 0, sums);
+  assert(result.len == pqr.sums.size);
+  for (size_t s = 0; s < result.len; ++s) {
+    assert(result[s] == sums[s]);
+  }
+  result.free();
+  free_query(pqr);
+  for (auto &relation: relations) {
+    relation.free();
+  }
+  relations.clear_and_free();
+}
+
+// Big enough for the search to be split among threads; checked against the binary joins of an ir.
+static void test_parallel_generic_join(const char *query, size_t row_n, size_t value_range) {
+  FUNCTION_TEST();
+  report("%s", query);
+  RelationStorage relations = create_relations(3, row_n, 2, value_range);
+  ParseQueryResult pqr = parse_query(query);
+  GenericJoin join{relations, pqr};
+  assert(join.is_cyclic());
+  auto result = join.execute();
+
+  IntermediateResult ir{relations, pqr};
+  for (auto predicate: pqr.predicates) {
+    if (predicate.kind != PRED::JOIN)
+      continue;
+    ir.execute_join(predicate);
+    ir.previous_join->wait();
+  }
+  auto expected = ir.execute_select(pqr.sums);
+  for (size_t s = 0; s < result.len; ++s) {
+    assert(result[s] == expected[s]);
+  }
+  result.free();
+  expected.free();
+  ir.free();
+  free_query(pqr);
+  for (auto &relation: relations) {
+    relation.free();
+  }
+  relations.clear_and_free();
+}
+
+static void test_acyclic_queries() {
+  FUNCTION_TEST();
+  RelationStorage relations = create_relations(3, 10, 3, 10);
+  const char *queries[] = {
+      "0 1 2|0.0=1.0&1.1=2.0|0.1",
+      // A single variable, with two columns of the same relation.
+      "0 1 2|0.0=1.0&1.0=2.0&2.1=0.0|0.1",
+  };
+  for (const char *query: queries) {
+    ParseQueryResult pqr = parse_query(query);
+    assert(!GenericJoin(relations, pqr).is_cyclic());
+    free_query(pqr);
+  }
+  for (auto &relation: relations) {
+    relation.free();
+  }
+  relations.clear_and_free();
+}
+
+int main() {
+  scheduler.start();
+  test_acyclic_queries();
+  // Triangle.
+  test_generic_join("0 1 2|0.0=1.0&1.1=2.0&2.1=0.1|0.2 1.2 2.0", 200, 20);
+  // Triangle with filters and a self join.
+  test_generic_join("0 0 1|0.0=1.1&1.0=2.0&2.1=0.1&0.2>3&2.2<15|0.2 1.2 2.2", 200, 20);
+  // Two predicates between the same relations.
+  test_generic_join("0 1 2|0.0=1.0&0.1=1.1&1.2=2.0|0.2 2.1", 300, 5);
+  // A variable with two columns of the same relation.
+  test_generic_join("0 1 2|0.0=1.0&1.1=2.0&2.1=0.1&0.2=0.0|1.2 2.2", 200, 10);
+  // No results.
+  test_generic_join("0 1 2|0.0=1.0&1.1=2.0&2.1=0.1&0.2>100|0.2", 50, 20);
+  test_parallel_generic_join("0 1 2|0.0=1.0&1.1=2.0&2.1=0.1|0.0 1.1 2.1", 50000, 10000);
+  return 0;
+}
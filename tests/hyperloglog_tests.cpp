@@ -0,0 +1,63 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include "../hyperloglog.h"
+#include "../report_utils.h"
+
+// Well within 4 standard errors of the sketch.
+static constexpr double max_relative_error = 0.065;
+
+static void assert_estimate(const HyperLogLog &sketch, size_t distinct) {
+  double error = std::fabs(sketch.estimate() - (double) distinct) / (double) distinct;
+  assert(error <= max_relative_error);
+}
+
+static void test_estimate() {
+  FUNCTION_TEST();
+  std::mt19937_64 random{7};
+  for (size_t distinct : {1U, 10U, 1000U, 50000U, 2000000U}) {
+    HyperLogLog consecutive;
+    HyperLogLog repeated;
+    HyperLogLog wide;
+    for (size_t i = 0; i < distinct; ++i) {
+      consecutive.add(i);
+      // Every value a few times.
+      repeated.add(i % distinct);
+      repeated.add(i % distinct);
+      wide.add(random());
+    }
+    assert_estimate(consecutive, distinct);
+    assert_estimate(repeated, distinct);
+    assert_estimate(wide, distinct);
+  }
+  HyperLogLog empty;
+  assert(empty.estimate() == 0.0);
+}
+
+static void test_merge() {
+  FUNCTION_TEST();
+  HyperLogLog whole;
+  HyperLogLog lhs;
+  HyperLogLog rhs;
+  // The parts overlap in [60000, 100000).
+  for (uint64_t i = 0; i < 100000; ++i) {
+    whole.add(i);
+    lhs.add(i);
+  }
+  for (uint64_t i = 60000; i < 300000; ++i) {
+    whole.add(i);
+    rhs.add(i);
+  }
+  lhs.merge(rhs);
+  for (size_t i = 0; i < HyperLogLog::register_n; ++i) {
+    assert(lhs.registers[i] == whole.registers[i]);
+  }
+  assert_estimate(lhs, 300000);
+}
+
+int main() {
+  test_estimate();
+  test_merge();
+  return EXIT_SUCCESS;
+}
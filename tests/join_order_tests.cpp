@@ -0,0 +1,238 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include "../join_order.h"
+#include "../report_utils.h"
+
+// Relations of 2 columns with values in [0, 1000000].
+static Stats create_stats(int relation_n, const double *rows, const double (*distinct)[2]) {
+  Stats stats;
+  stats.relations = Array<Array<ColumnStat>>(relation_n);
+  for (int r = 0; r < relation_n; ++r) {
+    Array<ColumnStat> columns(2);
+    for (int c = 0; c < 2; ++c) {
+      columns.push({0, 1000000, rows[r], distinct[r][c]});
+    }
+    stats.relations.push(columns);
+  }
+  return stats;
+}
+
+static void free_stats(Stats stats) {
+  for (Array<ColumnStat> &columns : stats.relations) {
+    columns.clear_and_free();
+  }
+  stats.relations.clear_and_free();
+}
+
+static Predicate join(int lhs, int lhs_column, int rhs, int rhs_column) {
+  Predicate predicate{};
+  predicate.kind = PRED::JOIN;
+  predicate.lhs = {lhs, lhs_column};
+  predicate.rhs = {rhs, rhs_column};
+  return predicate;
+}
+
+static Predicate filter(int relation, int column, char op, int value) {
+  Predicate predicate{};
+  predicate.kind = PRED::FILTER;
+  predicate.lhs = {relation, column};
+  predicate.op = op;
+  predicate.filter_val = value;
+  return predicate;
+}
+
+static ParseQueryResult create_query(int relation_n, std::initializer_list<Predicate> predicates) {
+  ParseQueryResult pqr{};
+  pqr.num_relations = relation_n;
+  for (int r = 0; r < relation_n; ++r) {
+    pqr.actual_relations[r] = r;
+  }
+  if (predicates.size() != 0) {
+    pqr.predicates = Array<Predicate>(predicates.size());
+  }
+  for (const Predicate &predicate : predicates) {
+    pqr.predicates.push(predicate);
+  }
+  return pqr;
+}
+
+static bool joins(const Predicate &predicate, int lhs, int rhs) {
+  return (predicate.lhs.first == lhs && predicate.rhs.first == rhs) ||
+      (predicate.lhs.first == rhs && predicate.rhs.first == lhs);
+}
+
+static void test_selective_join_first() {
+  FUNCTION_TEST();
+  double rows[] = {1e6, 1e6, 1e3};
+  double distinct[][2] = {{1e6, 1e6}, {1e6, 1e6}, {1e3, 1e3}};
+  Stats stats = create_stats(3, rows, distinct);
+  ParseQueryResult pqr = create_query(3, {join(0, 0, 1, 0), join(1, 1, 2, 0)});
+  assert(reorder_joins(pqr, stats));
+  assert(joins(pqr.predicates[0], 1, 2));
+  assert(joins(pqr.predicates[1], 0, 1));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_bushy_tree() {
+  FUNCTION_TEST();
+  // The two ends of the chain are small, the middle join multiplies the rows.
+  double rows[] = {1e3, 1e6, 1e6, 1e3};
+  double distinct[][2] = {{1e6, 1e6}, {1e6, 10}, {10, 1e6}, {1e6, 1e6}};
+  Stats stats = create_stats(4, rows, distinct);
+  ParseQueryResult pqr = create_query(4, {join(1, 1, 2, 0), join(0, 0, 1, 0), join(2, 1, 3, 0)});
+  JoinTree tree;
+  assert(plan_join_tree(pqr, stats, tree));
+  const JoinTree::Node &root = tree.nodes[tree.root];
+  assert(root.relations == 0xF);
+  assert(tree.nodes[root.left].left != -1 && tree.nodes[root.right].left != -1);
+  assert(reorder_joins(pqr, stats));
+  // The joins of both sides run before the join between them.
+  assert(joins(pqr.predicates[2], 1, 2));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_cycle() {
+  FUNCTION_TEST();
+  double rows[] = {1e4, 1e5, 1e3};
+  double distinct[][2] = {{1e4, 1e4}, {1e5, 1e5}, {1e3, 1e3}};
+  Stats stats = create_stats(3, rows, distinct);
+  ParseQueryResult pqr = create_query(3, {join(0, 0, 1, 0), join(1, 1, 2, 0), join(2, 1, 0, 1)});
+  assert(reorder_joins(pqr, stats));
+  // The first two joins bring in all the relations, the last one filters their result.
+  uint32_t relations = 0;
+  for (int i = 0; i < 2; ++i) {
+    relations |= 1U << pqr.predicates[i].lhs.first | 1U << pqr.predicates[i].rhs.first;
+  }
+  assert(relations == 0x7);
+  assert(pqr.predicates.size == 3);
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_filters_before_last_join() {
+  FUNCTION_TEST();
+  double rows[] = {1e6, 1e6, 1e3};
+  double distinct[][2] = {{1e6, 1e6}, {1e6, 1e6}, {1e3, 1e3}};
+  Stats stats = create_stats(3, rows, distinct);
+  ParseQueryResult pqr = create_query(3, {join(2, 0, 2, 1), join(0, 0, 1, 0), join(1, 1, 2, 0)});
+  assert(reorder_joins(pqr, stats));
+  // The predicate within relation 2 filters it once it is joined, and before the last join.
+  assert(joins(pqr.predicates[0], 1, 2));
+  assert(joins(pqr.predicates[1], 2, 2));
+  assert(joins(pqr.predicates[2], 0, 1));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_disconnected_query() {
+  FUNCTION_TEST();
+  double rows[] = {10, 20, 30};
+  double distinct[][2] = {{10, 10}, {20, 20}, {30, 30}};
+  Stats stats = create_stats(3, rows, distinct);
+  ParseQueryResult pqr = create_query(3, {join(0, 0, 1, 0)});
+  assert(!reorder_joins(pqr, stats));
+  assert(joins(pqr.predicates[0], 0, 1));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static double leaf_rows(const JoinTree &tree, int relation) {
+  for (int n = 0; n < tree.node_n; ++n) {
+    if (tree.nodes[n].relations == 1U << relation)
+      return tree.nodes[n].rows;
+  }
+  assert(false);
+  return 0.0;
+}
+
+static void test_filter_estimates() {
+  FUNCTION_TEST();
+  double rows[] = {1e6, 1e6};
+  double distinct[][2] = {{1e6, 1e6}, {1e6, 1e6}};
+  Stats stats = create_stats(2, rows, distinct);
+  // The two filters of a column are a single range of a fifth of its values.
+  ParseQueryResult pqr = create_query(2, {join(0, 0, 1, 0), filter(0, 1, '>', 400000), filter(0, 1, '<', 600001)});
+  JoinTree tree;
+  assert(plan_join_tree(pqr, stats, tree));
+  assert(std::abs(leaf_rows(tree, 0) - 2e5) < 1e3);
+  pqr.predicates.clear_and_free();
+  // Half the rows of the column are 7, which a uniform estimate would give 1 row.
+  Histogram histogram = Histogram::build(1000000, [](size_t i) { return i < 500000 ? (uint64_t) 7 : (uint64_t) i; });
+  stats.relations[1][1].histogram = &histogram;
+  pqr = create_query(2, {join(0, 0, 1, 0), filter(1, 1, '=', 7)});
+  assert(plan_join_tree(pqr, stats, tree));
+  assert(std::abs(leaf_rows(tree, 1) - 5e5) < 1e3);
+  pqr.predicates.clear_and_free();
+  pqr = create_query(2, {join(0, 0, 1, 0), filter(1, 1, '>', 7), filter(1, 1, '<', 750000)});
+  assert(plan_join_tree(pqr, stats, tree));
+  assert(std::abs(leaf_rows(tree, 1) - 25e4) < 1e4);
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_reorder_remaining_joins() {
+  FUNCTION_TEST();
+  double rows[] = {1e3, 1e3, 1e3, 1e3};
+  double distinct[][2] = {{1e3, 1e3}, {1e3, 1e3}, {1e3, 1e3}, {1e3, 1e3}};
+  Stats stats = create_stats(4, rows, distinct);
+  ParseQueryResult pqr = create_query(4, {join(0, 0, 1, 0), join(1, 1, 2, 0), join(2, 1, 3, 0), join(0, 1, 1, 1)});
+  // The join of 0 and 1 is executed, and it turned out much bigger than the join of 2 and 3.
+  JoinedRelations joined[] = {{0x3, 1e9}};
+  // The pending predicate within the intermediate result keeps a thousandth of it.
+  assert(std::abs(estimate_join_rows(pqr, 1, stats, joined, 1, 0x7) - 1e6) < 1.0);
+  assert(reorder_remaining_joins(pqr, 1, stats, joined, 1));
+  assert(joins(pqr.predicates[0], 0, 1));
+  // The predicate within the intermediate result filters it first.
+  assert(joins(pqr.predicates[1], 0, 1));
+  assert(joins(pqr.predicates[2], 2, 3));
+  assert(joins(pqr.predicates[3], 1, 2));
+  // A small intermediate result is joined first.
+  joined[0].rows = 1.0;
+  assert(reorder_remaining_joins(pqr, 2, stats, joined, 1));
+  assert(joins(pqr.predicates[2], 1, 2));
+  assert(joins(pqr.predicates[3], 2, 3));
+  // Nothing is left to plan once all the relations are joined.
+  joined[0].relations = 0xF;
+  assert(!reorder_remaining_joins(pqr, 3, stats, joined, 1));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+static void test_greedy_plan() {
+  FUNCTION_TEST();
+  constexpr int relation_n = max_exhaustive_relations + 2;
+  double rows[relation_n];
+  double distinct[relation_n][2];
+  for (int r = 0; r < relation_n; ++r) {
+    rows[r] = 1000.0 * (r + 1);
+    distinct[r][0] = distinct[r][1] = rows[r];
+  }
+  Stats stats = create_stats(relation_n, rows, distinct);
+  ParseQueryResult pqr = create_query(relation_n, {});
+  pqr.predicates = Array<Predicate>(relation_n - 1);
+  for (int r = 0; r + 1 < relation_n; ++r) {
+    pqr.predicates.push(join(r, 1, r + 1, 0));
+  }
+  JoinTree tree;
+  assert(plan_join_tree(pqr, stats, tree));
+  assert(tree.nodes[tree.root].relations == (1U << relation_n) - 1U);
+  assert(tree.node_n == 2 * relation_n - 1);
+  assert(reorder_joins(pqr, stats));
+  pqr.predicates.clear_and_free();
+  free_stats(stats);
+}
+
+int main() {
+  test_selective_join_first();
+  test_bushy_tree();
+  test_cycle();
+  test_filters_before_last_join();
+  test_disconnected_query();
+  test_filter_estimates();
+  test_reorder_remaining_joins();
+  test_greedy_plan();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+#include <cstdlib>
+#include "../join_planner.h"
+#include "../report_utils.h"
+
+static JoinSideStats side(size_t row_count, bool sorted, uint64_t min_key, uint64_t max_key, size_t distinct_count) {
+  return JoinSideStats{row_count, sorted, min_key, max_key, distinct_count};
+}
+
+static void test_choose_join_algorithm() {
+  FUNCTION_TEST();
+  // A few entries on each side.
+  assert(choose_join_algorithm(side(5, false, 0, 1U << 30U, 5), side(8, false, 0, 1U << 30U, 8), false) ==
+      JoinAlgorithm::NESTED_LOOP);
+  // A small, dense domain on the build side.
+  assert(choose_join_algorithm(side(1000000, false, 0, 1U << 30U, 0), side(50000, false, 0, 20000, 20000), false) ==
+      JoinAlgorithm::DENSE_ARRAY);
+  // A sparse domain on the build side.
+  assert(choose_join_algorithm(side(1000000, false, 0, 1U << 30U, 0), side(50000, false, 0, 3000000, 1000), false) ==
+      JoinAlgorithm::HASH);
+  // Big unsorted inputs with wide keys.
+  assert(choose_join_algorithm(side(1000000, false, 0, 1U << 30U, 0), side(2000000, false, 0, 1U << 30U, 0), false) ==
+      JoinAlgorithm::HASH);
+  // Both inputs are already sorted.
+  assert(choose_join_algorithm(side(1000000, true, 0, 1U << 30U, 0), side(2000000, true, 0, 1U << 30U, 0), false) ==
+      JoinAlgorithm::SORT_MERGE);
+  // A later join reads the sorted result.
+  assert(choose_join_algorithm(side(1000000, false, 0, 1U << 30U, 0), side(2000000, true, 0, 1U << 30U, 0), true) ==
+      JoinAlgorithm::SORT_MERGE);
+}
+
+static void test_filtered_relation_stats() {
+  FUNCTION_TEST();
+  constexpr size_t row_n = 1000;
+  RelationData relation(row_n, 2);
+  relation.max_values = Array<u64>(2);
+  relation.min_values = Array<u64>(2);
+  for (size_t i = 0; i < row_n; ++i) {
+    relation[0].push(100 + i);
+    relation[1].push(i % 10);
+  }
+  relation.min_values.push(100);
+  relation.max_values.push(100 + row_n - 1);
+  relation.min_values.push(0);
+  relation.max_values.push(9);
+
+  StretchyBuf<Predicate> filters{};
+  JoinSideStats stats = JoinSideStats::for_relation(relation, 0, filters, false);
+  assert(stats.row_count == row_n && stats.min_key == 100 && stats.max_key == 100 + row_n - 1);
+
+  // Half of the keys are below 600, so the range of the keys shrinks too.
+  Predicate filter{};
+  filter.kind = PRED::FILTER;
+  filter.lhs = {0, 0};
+  filter.op = '<';
+  filter.filter_val = 600;
+  filters.push(filter);
+  stats = JoinSideStats::for_relation(relation, 0, filters, false);
+  assert(stats.row_count == row_n / 2 && stats.max_key == 599);
+
+  // One of the 10 values of the other column.
+  filter.lhs = {0, 1};
+  filter.op = '=';
+  filter.filter_val = 3;
+  filters.push(filter);
+  stats = JoinSideStats::for_relation(relation, 0, filters, false);
+  assert(stats.row_count == row_n / 20);
+
+  // With "< 600", the keys are a single range of a quarter of them, not two independent filters.
+  filter.lhs = {0, 0};
+  filter.op = '>';
+  filter.filter_val = 349;
+  filters.push(filter);
+  stats = JoinSideStats::for_relation(relation, 0, filters, false);
+  assert(stats.row_count == row_n / 40 && stats.min_key == 350 && stats.max_key == 599);
+
+  // Most of the values of the other column are 3, which its histogram knows.
+  for (size_t i = 0; i < row_n; ++i) {
+    if (i % 10 != 0)
+      relation[1][i] = 3;
+  }
+  relation.allocate_sorted_indexes();
+  relation.build_sorted_index(1);
+  stats = JoinSideStats::for_relation(relation, 0, filters, false);
+  assert(stats.row_count == row_n / 4 * 9 / 10);
+
+  filters.free();
+  relation.free();
+}
+
+static void test_join_profile() {
+  FUNCTION_TEST();
+  JoinProfile profile;
+  profile.record(JoinAlgorithm::HASH, 10, 20, 30);
+  profile.record(JoinAlgorithm::NESTED_LOOP, 1, 2, 2);
+  profile.record(JoinAlgorithm::HASH, 5, 5, 5);
+  assert(profile.count(JoinAlgorithm::HASH) == 2);
+  assert(profile.count(JoinAlgorithm::NESTED_LOOP) == 1);
+  assert(profile.count(JoinAlgorithm::SORT_MERGE) == 0);
+  profile.reset();
+  assert(profile.joins.len == 0);
+  profile.free();
+}
+
+int main() {
+  test_choose_join_algorithm();
+  test_filtered_relation_stats();
+  test_join_profile();
+  return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <algorithm>
 #include "../joinable.h"
 #include "../report_utils.h"
 
@@ -96,23 +97,368 @@ static void test_join(size_t size, bool print_join = false) {
   Join join{};
 
   auto res = join(ldata, rdata);
-  assert(res.len == size);
-  size_t total_size{0U};
-  for (Join::JoinRow &r : res) {
-    total_size += r.second.len;
-  }
+  assert(res.left_count() == size);
+  assert(res.offsets.len == size + 1);
 
   // That is for only this case where we have only every row id only once in every relation
-  assert(total_size == size);
+  assert(res.row_count() == size);
 
   if (print_join) {
-    for (Join::JoinRow &r : res) {
-      for (u64 r_row_id : r.second) {
-        report("Left RowId = %lu, Right RowId = %lu", r.first.v, r_row_id.v);
+    for (size_t i = 0U; i != res.left_count(); ++i) {
+      for (size_t k = res.offsets[i]; k != res.offsets[i + 1]; ++k) {
+        report("Left RowId = %lu, Right RowId = %lu", res.left_row_ids[i].v, res.right_row_ids[k].v);
       }
     }
   }
 
+  res.free();
+
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  context.stack.free();
+}
+
+using RowIdPair = Pair<u64, u64>;
+
+static int compare_row_id_pair(const void *v1, const void *v2) {
+  RowIdPair lhs = *(RowIdPair *) v1;
+  RowIdPair rhs = *(RowIdPair *) v2;
+  return lhs < rhs ? -1 : lhs == rhs ? 0 : 1;
+}
+
+// Flattens a join result to its (left row id, right row id) pairs, sorted.
+static StretchyBuf<RowIdPair> flatten_join_result(JoinResult &res) {
+  StretchyBuf<RowIdPair> pairs{};
+  assert(res.offsets.len == res.left_count() + 1);
+  assert(res.offsets[res.left_count()] == res.row_count());
+  for (size_t i = 0U; i != res.left_count(); ++i) {
+    assert(res.offsets[i] < res.offsets[i + 1]);
+    for (size_t k = res.offsets[i]; k != res.offsets[i + 1]; ++k) {
+      pairs.push(make_pair(res.left_row_ids[i], res.right_row_ids[k]));
+    }
+  }
+  res.free();
+  if (pairs.len)
+    std::qsort(pairs.data, pairs.len, sizeof(RowIdPair), compare_row_id_pair);
+  return pairs;
+}
+
+static void test_hash_join(size_t lsize, size_t rsize, size_t key_range, TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  constexpr size_t sort_threshold = 32 * 1024;
+  Joinable ldata(lsize);
+  Joinable rdata(rsize);
+  Joinable aux(std::max(lsize, rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+
+  srand(42);
+  for (size_t i = 0U; i != lsize; ++i) {
+    ldata.push(make_pair(u64(rand() % key_range), u64(i)));
+  }
+  for (size_t i = 0U; i != rsize; ++i) {
+    rdata.push(make_pair(u64(rand() % key_range), u64(i)));
+  }
+
+  HashJoin hash_join{scheduler};
+  auto hash_res = hash_join(ldata, rdata);
+
+  ldata.sort(context, sort_threshold);
+  context.stack.reset();
+  rdata.sort(context, sort_threshold);
+  Join join{};
+  auto res = join(ldata, rdata);
+
+  StretchyBuf<RowIdPair> hash_pairs = flatten_join_result(hash_res);
+  StretchyBuf<RowIdPair> pairs = flatten_join_result(res);
+  assert(hash_pairs.len == pairs.len);
+  for (size_t i = 0U; i != pairs.len; ++i) {
+    assert(hash_pairs[i] == pairs[i]);
+  }
+
+  hash_pairs.free();
+  pairs.free();
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  context.stack.free();
+}
+
+static void assert_same_join_result(JoinResult &expected, JoinResult &actual) {
+  assert(expected.left_count() == actual.left_count());
+  assert(expected.row_count() == actual.row_count());
+  for (size_t i = 0U; i != expected.left_count(); ++i) {
+    assert(expected.left_row_ids[i] == actual.left_row_ids[i]);
+    assert(expected.offsets[i + 1] == actual.offsets[i + 1]);
+  }
+  for (size_t k = 0U; k != expected.row_count(); ++k) {
+    assert(expected.right_row_ids[k] == actual.right_row_ids[k]);
+  }
+}
+
+static void test_parallel_join(size_t lsize, size_t rsize, size_t key_range, TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  constexpr size_t sort_threshold = 32 * 1024;
+  Joinable ldata(lsize);
+  Joinable rdata(rsize);
+  Joinable aux(std::max(lsize, rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+
+  srand(7);
+  for (size_t i = 0U; i != lsize; ++i) {
+    ldata.push(make_pair(u64(rand() % key_range), u64(i)));
+  }
+  for (size_t i = 0U; i != rsize; ++i) {
+    rdata.push(make_pair(u64(rand() % key_range), u64(i)));
+  }
+  ldata.sort(context, sort_threshold);
+  context.stack.reset();
+  rdata.sort(context, sort_threshold);
+
+  Join serial_join{};
+  Join parallel_join{scheduler};
+  auto serial_res = serial_join(ldata, rdata);
+  auto parallel_res = parallel_join(ldata, rdata);
+
+  // The chunks are written in order, so the output must be identical.
+  assert_same_join_result(serial_res, parallel_res);
+
+  // Every group covers the left rows of one key, each matched with all the right rows of the key.
+  StretchyBuf<JoinGroup> groups = parallel_join.groups(ldata, rdata);
+  size_t left_count = 0U;
+  size_t row_count = 0U;
+  for (JoinGroup group : groups) {
+    assert(ldata[group.lhs_from].first == rdata[group.rhs_from].first);
+    for (size_t i = group.lhs_from; i != group.lhs_to; ++i, ++left_count) {
+      assert(serial_res.left_row_ids[left_count] == ldata[i].second);
+      assert(serial_res.offsets[left_count + 1] - serial_res.offsets[left_count] == group.rhs_to - group.rhs_from);
+    }
+    row_count += (group.lhs_to - group.lhs_from) * (group.rhs_to - group.rhs_from);
+  }
+  assert(left_count == serial_res.left_count());
+  assert(row_count == serial_res.row_count());
+  groups.free();
+
+  serial_res.free();
+  parallel_res.free();
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  context.stack.free();
+}
+
+static void test_simd_join(size_t lsize, size_t rsize, size_t key_range) {
+  FUNCTION_TEST();
+  constexpr size_t sort_threshold = 32 * 1024;
+  Joinable ldata(lsize);
+  Joinable rdata(rsize);
+  Joinable aux(std::max(lsize, rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+
+  srand(13);
+  for (size_t i = 0U; i != lsize; ++i) {
+    // Spread the keys over the whole 64-bit range, to test unsigned comparisons.
+    ldata.push(make_pair(u64((rand() % key_range) * 0x9E3779B97F4A7C1ULL), u64(i)));
+  }
+  for (size_t i = 0U; i != rsize; ++i) {
+    rdata.push(make_pair(u64((rand() % key_range) * 0x9E3779B97F4A7C1ULL), u64(i)));
+  }
+  ldata.sort(context, sort_threshold);
+  context.stack.reset();
+  rdata.sort(context, sort_threshold);
+
+  Join scalar_join{nullptr, Join::MergeKernel::SCALAR};
+  Join simd_join{nullptr, Join::MergeKernel::SIMD};
+  auto scalar_res = scalar_join(ldata, rdata);
+  auto simd_res = simd_join(ldata, rdata);
+  assert_same_join_result(scalar_res, simd_res);
+
+  scalar_res.free();
+  simd_res.free();
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  context.stack.free();
+}
+
+// Sorts keys in [key_base, key_base + key_range) with parallel_sort, or with sort if the scheduler is null.
+static void test_radix_sort(size_t size, uint64_t key_base, uint64_t key_range, TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  Joinable data(size);
+  Joinable copy(size);
+  Joinable aux(size);
+  aux.size = size;
+
+  srand(21);
+  for (size_t i = 0U; i != size; ++i) {
+    uint64_t key = key_base + (((uint64_t) rand() << 32U) | (uint64_t) rand()) % key_range;
+    auto p = make_pair(u64(key), u64(i));
+    data.push(p);
+    copy.push(p);
+  }
+  if (scheduler != nullptr) {
+    data.parallel_sort(scheduler, aux, 32 * 1024);
+  } else {
+    StretchyBuf<Joinable::SortContext> stack{};
+    data.sort({aux, stack}, 32 * 1024);
+  }
+  std::qsort(copy.data, copy.size, sizeof(JoinableEntry), Joinable::compare_entry);
+  // The radix sort orders by key only, row ids of equal keys may end up in any order.
+  for (size_t i = 0U; i != size; ++i) {
+    assert(data[i].first == copy[i].first);
+  }
+  std::qsort(data.data, data.size, sizeof(JoinableEntry), Joinable::compare_entry);
+  for (size_t i = 0U; i != size; ++i) {
+    assert(data[i] == copy[i]);
+  }
+
+  data.clear_and_free();
+  copy.clear_and_free();
+  aux.clear_and_free();
+}
+
+// Joins packed and wide joinables with the same entries. Both must produce the same pairs of row ids.
+static void test_packed_join(size_t lsize, size_t rsize, size_t key_range, TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  constexpr size_t sort_threshold = 32 * 1024;
+  Joinable ldata(lsize);
+  Joinable rdata(rsize);
+  Joinable aux(std::max(lsize, rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+  PackedJoinable packed_ldata(lsize);
+  PackedJoinable packed_rdata(rsize);
+  PackedJoinable packed_aux(std::max(lsize, rsize));
+  packed_aux.size = packed_aux.capacity;
+
+  srand(7);
+  for (size_t i = 0U; i != lsize; ++i) {
+    uint64_t key = rand() % key_range;
+    ldata.push(make_pair(u64(key), u64(i)));
+    packed_ldata.push(PackedJoinable::pack(key, i));
+  }
+  for (size_t i = 0U; i != rsize; ++i) {
+    uint64_t key = rand() % key_range;
+    rdata.push(make_pair(u64(key), u64(i)));
+    packed_rdata.push(PackedJoinable::pack(key, i));
+  }
+
+  ldata.sort(context, sort_threshold);
+  context.stack.reset();
+  rdata.sort(context, sort_threshold);
+  if (scheduler != nullptr) {
+    packed_ldata.parallel_sort(scheduler, packed_aux, sort_threshold);
+    packed_rdata.parallel_sort(scheduler, packed_aux, sort_threshold);
+  } else {
+    packed_ldata.sort(packed_aux, sort_threshold);
+    packed_rdata.sort(packed_aux, sort_threshold);
+  }
+  for (size_t i = 1U; i < lsize; ++i) {
+    assert(PackedJoinable::key(packed_ldata[i - 1]) <= PackedJoinable::key(packed_ldata[i]));
+  }
+
+  auto res = Join{scheduler}(ldata, rdata);
+  auto packed_res = Join{scheduler}(packed_ldata, packed_rdata);
+  auto scalar_packed_res = Join{scheduler, Join::MergeKernel::SCALAR}(packed_ldata, packed_rdata);
+  assert_same_join_result(packed_res, scalar_packed_res);
+  scalar_packed_res.free();
+
+  StretchyBuf<RowIdPair> pairs = flatten_join_result(res);
+  StretchyBuf<RowIdPair> packed_pairs = flatten_join_result(packed_res);
+  assert(pairs.len == packed_pairs.len);
+  for (size_t i = 0U; i != pairs.len; ++i) {
+    assert(pairs[i] == packed_pairs[i]);
+  }
+
+  pairs.free();
+  packed_pairs.free();
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  packed_ldata.clear_and_free();
+  packed_rdata.clear_and_free();
+  packed_aux.clear_and_free();
+  context.stack.free();
+}
+
+// Joins joinables where one key matches many more rows than the others, so its group is split among tasks.
+static void test_skewed_join(size_t lsize, size_t rsize, size_t key_range, size_t hot_lsize, size_t hot_rsize,
+                             TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  constexpr size_t sort_threshold = 32 * 1024;
+  constexpr uint64_t hot_key = 7;
+  Joinable ldata(lsize + hot_lsize);
+  Joinable rdata(rsize + hot_rsize);
+  Joinable aux(std::max(lsize + hot_lsize, rsize + hot_rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+
+  srand(11);
+  for (size_t i = 0U; i != lsize + hot_lsize; ++i) {
+    ldata.push(make_pair(u64(i < hot_lsize ? hot_key : rand() % key_range), u64(i)));
+  }
+  for (size_t i = 0U; i != rsize + hot_rsize; ++i) {
+    rdata.push(make_pair(u64(i < hot_rsize ? hot_key : rand() % key_range), u64(i)));
+  }
+  ldata.sort(context, sort_threshold);
+  context.stack.reset();
+  rdata.sort(context, sort_threshold);
+
+  auto serial_res = Join{}(ldata, rdata);
+  auto parallel_res = Join{scheduler}(ldata, rdata);
+  assert(serial_res.row_count() >= hot_lsize * hot_rsize);
+  assert_same_join_result(serial_res, parallel_res);
+
+  serial_res.free();
+  parallel_res.free();
+  ldata.clear_and_free();
+  rdata.clear_and_free();
+  aux.clear_and_free();
+  context.stack.free();
+}
+
+// Joins unsorted joinables with the nested loop and the dense array joins. Both must produce the pairs of a merge join.
+static void test_small_input_joins(size_t lsize, size_t rsize, uint64_t key_base, size_t key_range,
+                                   TaskScheduler *scheduler) {
+  FUNCTION_TEST();
+  Joinable ldata(lsize);
+  Joinable rdata(rsize);
+  Joinable aux(std::max(lsize, rsize));
+  aux.size = aux.capacity;
+  Joinable::MemoryContext context{aux, StretchyBuf<Joinable::SortContext>()};
+
+  srand(17);
+  for (size_t i = 0U; i != lsize; ++i) {
+    // Some left keys fall outside the range of the right hand side.
+    ldata.push(make_pair(u64(key_base + rand() % (key_range + 2U) - 1U), u64(i)));
+  }
+  for (size_t i = 0U; i != rsize; ++i) {
+    rdata.push(make_pair(u64(key_base + rand() % key_range), u64(i)));
+  }
+  auto nested_loop_res = NestedLoopJoin{}(ldata, rdata);
+  auto dense_res = DenseArrayJoin{scheduler}(ldata, rdata);
+  // Both keep the order of the left hand side.
+  assert_same_join_result(nested_loop_res, dense_res);
+
+  ldata.sort(context, 32 * 1024);
+  context.stack.reset();
+  rdata.sort(context, 32 * 1024);
+  auto res = Join{}(ldata, rdata);
+  StretchyBuf<RowIdPair> pairs = flatten_join_result(res);
+  StretchyBuf<RowIdPair> dense_pairs = flatten_join_result(dense_res);
+  assert(pairs.len == dense_pairs.len);
+  for (size_t i = 0U; i != pairs.len; ++i) {
+    assert(pairs[i] == dense_pairs[i]);
+  }
+
+  pairs.free();
+  dense_pairs.free();
+  res.free();
+  nested_loop_res.free();
+  dense_res.free();
   ldata.clear_and_free();
   rdata.clear_and_free();
   aux.clear_and_free();
@@ -124,5 +470,44 @@ int main() {
   test_joinable_sort_without_using_quicksort(size);
   test_joinable_sort_using_quicksort(size);
   test_join(size);
+  // Selective join, most keys don't match.
+  test_simd_join(100000, 100000, 10000000);
+  // Long runs of equal keys.
+  test_simd_join(100000, 50000, 100);
+  test_simd_join(7, 13, 5);
+  test_packed_join(100000, 50000, 100, nullptr);
+  test_packed_join(100000, 100000, 10000000, nullptr);
+  test_small_input_joins(7, 13, 0, 5, nullptr);
+  test_small_input_joins(100, 300, 1000000, 50, nullptr);
+  test_small_input_joins(3000, 2000, 42, 1000, nullptr);
+
+  TaskScheduler scheduler{4};
+  scheduler.start();
+  test_hash_join(size, size, size, nullptr);
+  test_hash_join(size, 3 * size, 50, nullptr);
+  // Big enough for the build side to get partitioned.
+  test_hash_join(200000, 300000, 100000, &scheduler);
+  test_parallel_join(200000, 300000, 100000, &scheduler);
+  // Few keys, so that most chunk boundaries have to be moved.
+  test_parallel_join(200000, 1000, 30, &scheduler);
+  test_radix_sort(1000000, 0, UINT64_MAX, &scheduler);
+  test_radix_sort(1000000, 0, 1U << 20U, &scheduler);
+  test_radix_sort(1000000, 0, 1000, &scheduler);
+  test_radix_sort(100, 0, 1000, &scheduler);
+  // Only the low bits of the keys vary, so the sort skips the constant high bits.
+  test_radix_sort(1000000, 0xABCD00000000U, 1U << 20U, &scheduler);
+  test_radix_sort(1000000, 0xABCD00000000U, 1U << 20U, nullptr);
+  test_radix_sort(100000, 0xABCD00000000U, 1U << 12U, nullptr);
+  test_packed_join(1000000, 300000, 1U << 20U, &scheduler);
+  // Big enough for the probes of the dense array join to be split among the threads.
+  test_small_input_joins(300000, 1000, 0, 4000, &scheduler);
+  // A hot key with many rows on both sides, and one with a single left row.
+  test_skewed_join(200000, 100000, 100000, 200, 5000, &scheduler);
+  test_skewed_join(200000, 100000, 100000, 1, 3000000, &scheduler);
+  test_skewed_join(200000, 100000, 100000, 2000000, 1, &scheduler);
+  // A single key, nothing to sort.
+  test_radix_sort(100000, 42, 1, &scheduler);
+  test_radix_sort(100000, 42, 1, nullptr);
+  scheduler.wait_remaining_and_stop();
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include <cassert>
+#include "../joinable_cache.h"
+#include "../lru_cache.h"
+#include "../report_utils.h"
+
+// A value that counts how many values are freed.
+struct CountedValue {
+  int id;
+  int *free_count;
+
+  void free() { ++*free_count; }
+};
+
+static void test_eviction_order() {
+  FUNCTION_TEST();
+  int free_count = 0;
+  LruCache<int, CountedValue> cache{3};
+  for (int key = 0; key < 3; ++key) {
+    const CountedValue *value = cache.insert(key, {key, &free_count}, 1);
+    assert(value != nullptr && value->id == key);
+    cache.release(value);
+  }
+  // Use 0, so that 1 is the least recently used.
+  cache.release(cache.acquire(0));
+  cache.release(cache.insert(3, {3, &free_count}, 1));
+  assert(free_count == 1);
+  assert(cache.acquire(1) == nullptr);
+  for (int key : {0, 2, 3}) {
+    const CountedValue *value = cache.acquire(key);
+    assert(value != nullptr && value->id == key);
+    cache.release(value);
+  }
+  assert(cache.hits() == 4 && cache.misses() == 1);
+  cache.free();
+  assert(free_count == 4);
+}
+
+static void test_pinned_values_are_kept() {
+  FUNCTION_TEST();
+  int free_count = 0;
+  LruCache<int, CountedValue> cache{2};
+  const CountedValue *pinned = cache.insert(0, {0, &free_count}, 2);
+  assert(pinned != nullptr);
+  // There is no room while 0 is pinned, the caller keeps the value.
+  assert(cache.insert(1, {1, &free_count}, 1) == nullptr);
+  assert(free_count == 0);
+  cache.release(pinned);
+  cache.release(cache.insert(1, {1, &free_count}, 1));
+  assert(free_count == 1 && cache.used() == 1);
+  // Too big to ever fit.
+  assert(cache.insert(2, {2, &free_count}, 3) == nullptr);
+  cache.free();
+}
+
+static void test_insert_of_cached_key() {
+  FUNCTION_TEST();
+  int free_count = 0;
+  LruCache<int, CountedValue> cache{10};
+  const CountedValue *first = cache.insert(7, {1, &free_count}, 1);
+  // Another thread built the same value, it is freed and the cached one is shared.
+  const CountedValue *second = cache.insert(7, {2, &free_count}, 1);
+  assert(first == second && second->id == 1 && free_count == 1);
+  cache.release(first);
+  cache.release(second);
+  cache.free();
+}
+
+static Predicate filter(int column, char op, int value) {
+  Predicate predicate{};
+  predicate.kind = PRED::FILTER;
+  predicate.lhs = {0, column};
+  predicate.op = op;
+  predicate.filter_val = value;
+  return predicate;
+}
+
+static void test_cache_keys_normalize_filters() {
+  FUNCTION_TEST();
+  StretchyBuf<Predicate> lhs{};
+  lhs.push(filter(1, '>', 5));
+  lhs.push(filter(1, '<', 9));
+  StretchyBuf<Predicate> rhs{};
+  rhs.push(filter(1, '<', 9));
+  rhs.push(filter(1, '>', 5));
+  rhs.push(filter(1, '>', 2));
+  // Both are the range [6, 8] of column 1, for both caches.
+  assert(FilterCacheKey::create(3, lhs) == FilterCacheKey::create(3, rhs));
+  assert(JoinableCacheKey::create(3, 0, false, lhs) == JoinableCacheKey::create(3, 0, false, rhs));
+  assert(!(JoinableCacheKey::create(3, 0, false, lhs) == JoinableCacheKey::create(3, 0, true, rhs)));
+  assert(!(JoinableCacheKey::create(3, 0, false, lhs) == JoinableCacheKey::create(3, 2, false, rhs)));
+  rhs.push(filter(2, '=', 4));
+  assert(!(JoinableCacheKey::create(3, 0, false, lhs) == JoinableCacheKey::create(3, 0, false, rhs)));
+  lhs.free();
+  rhs.free();
+}
+
+int main() {
+  test_eviction_order();
+  test_pinned_values_are_kept();
+  test_insert_of_cached_key();
+  test_cache_keys_normalize_filters();
+  return 0;
+}
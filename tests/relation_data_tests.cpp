@@ -0,0 +1,260 @@
+#include <cmath>
+#include <cstdlib>
+#include "../relation_data.h"
+#include "../column_filter.h"
+#include "../report_utils.h"
+
+static RelationData create_relation(size_t row_n, uint64_t value_range) {
+  RelationData relation(row_n, 2);
+  relation.max_values = Array<u64>(2);
+  for (size_t c = 0; c < 2; ++c) {
+    uint64_t max = 0;
+    for (size_t i = 0; i < row_n; ++i) {
+      uint64_t value = (((uint64_t) std::rand() << 32U) ^ std::rand()) % value_range;
+      relation[c].push(value);
+      max = std::max(max, value);
+    }
+    relation.max_values.push(max);
+  }
+  return relation;
+}
+
+// Compares the entries of two joinables as multisets, the row ids of equal keys may come in any order.
+template<typename J>
+static void assert_same_entries(J lhs, J rhs) {
+  assert(lhs.size == rhs.size);
+  std::qsort(lhs.data, lhs.size, sizeof(lhs.data[0]), [](const void *a, const void *b) {
+    auto x = (const unsigned char *) a;
+    auto y = (const unsigned char *) b;
+    for (size_t k = sizeof(lhs.data[0]); k-- != 0;) {
+      if (x[k] != y[k])
+        return x[k] < y[k] ? -1 : 1;
+    }
+    return 0;
+  });
+  std::qsort(rhs.data, rhs.size, sizeof(rhs.data[0]), [](const void *a, const void *b) {
+    auto x = (const unsigned char *) a;
+    auto y = (const unsigned char *) b;
+    for (size_t k = sizeof(rhs.data[0]); k-- != 0;) {
+      if (x[k] != y[k])
+        return x[k] < y[k] ? -1 : 1;
+    }
+    return 0;
+  });
+  for (size_t i = 0; i < lhs.size; ++i) {
+    assert(lhs[i] == rhs[i]);
+  }
+}
+
+// The filter keeps one in "kept_fraction" of the rows.
+static void test_sorted_index(size_t row_n, uint64_t value_range, uint64_t kept_fraction = 2) {
+  FUNCTION_TEST();
+  RelationData relation = create_relation(row_n, value_range);
+  StretchyBuf<Predicate> filters;
+  Predicate filter{};
+  filter.kind = PRED::FILTER;
+  filter.lhs = {0, 1};
+  filter.op = '<';
+  filter.filter_val = (int) (value_range / kept_fraction);
+  filters.push(filter);
+  StretchyBuf<Predicate> no_filters;
+
+  Joinable unsorted = relation.to_joinable(0, filters);
+  Joinable unsorted_all = relation.to_joinable(0, no_filters);
+  relation.allocate_sorted_indexes();
+  relation.build_sorted_index(0);
+  relation.build_sorted_index(1);
+  assert(relation.sorted_index(0).is_packed == PackedJoinable::can_pack(relation.column_max(0), row_n - 1U));
+  Joinable sorted = relation.to_joinable(0, filters);
+  Joinable sorted_all = relation.to_joinable(0, no_filters);
+  for (size_t i = 1; i < sorted.size; ++i) {
+    assert(sorted[i - 1].first.v <= sorted[i].first.v);
+  }
+  assert_same_entries(sorted, unsorted);
+  assert_same_entries(sorted_all, unsorted_all);
+  // Without asking for sorted entries, they come in row order even with a sorted index.
+  Joinable row_order = relation.to_joinable(0, filters, false);
+  assert(row_order.size == unsorted.size);
+  for (size_t i = 0; i < row_order.size; ++i) {
+    assert(row_order[i].first.v == unsorted[i].first.v && row_order[i].second.v == unsorted[i].second.v);
+  }
+  row_order.clear_and_free();
+  if (relation.sorted_index(0).is_packed) {
+    PackedJoinable packed = relation.to_packed_joinable(0, filters);
+    assert(packed.size == sorted.size);
+    for (size_t i = 1; i < packed.size; ++i) {
+      assert(PackedJoinable::key(packed[i - 1]) <= PackedJoinable::key(packed[i]));
+    }
+    packed.clear_and_free();
+  }
+  sorted.clear_and_free();
+  sorted_all.clear_and_free();
+  unsorted.clear_and_free();
+  unsorted_all.clear_and_free();
+  filters.free();
+  relation.free();
+}
+
+static bool passes_filters(RelationData &relation, size_t row, StretchyBuf<Predicate> &filters) {
+  for (Predicate filter : filters) {
+    uint64_t value = relation[filter.lhs.second][row].v;
+    if ((filter.op == '<' && !(value < (uint64_t) filter.filter_val)) ||
+        (filter.op == '>' && !(value > (uint64_t) filter.filter_val)) ||
+        (filter.op == '=' && value != (uint64_t) filter.filter_val))
+      return false;
+  }
+  return true;
+}
+
+static Predicate create_filter(size_t column, char op, int value) {
+  Predicate filter{};
+  filter.kind = PRED::FILTER;
+  filter.lhs = {0, (int) column};
+  filter.op = op;
+  filter.filter_val = value;
+  return filter;
+}
+
+// Compares the column-at-a-time filters to a row by row evaluation of the predicates.
+// With "clustered", the first column grows with the row and the relation has zone maps to skip its blocks.
+static void test_filters(size_t row_n, uint64_t value_range, bool clustered = false) {
+  FUNCTION_TEST();
+  RelationData relation = create_relation(row_n, value_range);
+  if (clustered) {
+    relation.zone_maps = Array<ZoneMap>(2);
+    for (size_t i = 0; i < row_n; ++i) {
+      relation[0][i] = i * value_range / row_n;
+    }
+    for (size_t c = 0; c < 2; ++c) {
+      relation.zone_maps.push(ZoneMap::build(relation[c].data, row_n));
+    }
+  }
+  int half = (int) (value_range / 2U);
+  Predicate cases[][3] = {
+      {create_filter(1, '<', half)},
+      {create_filter(1, '>', half), create_filter(1, '<', half + 5)},
+      {create_filter(0, '=', 7), create_filter(1, '>', 2)},
+      {create_filter(0, '>', half), create_filter(1, '<', half), create_filter(0, '<', half + 10)},
+      // Empty ranges.
+      {create_filter(1, '<', 0)},
+      {create_filter(0, '>', half), create_filter(0, '<', half)},
+      {create_filter(0, '=', 3), create_filter(0, '=', 4)},
+  };
+  for (auto &filter_case : cases) {
+    StretchyBuf<Predicate> filters;
+    for (Predicate &filter : filter_case) {
+      if (filter.kind == PRED::FILTER)
+        filters.push(filter);
+    }
+    Joinable joinable = relation.to_joinable(0, filters);
+    size_t expected = 0;
+    for (size_t i = 0; i < row_n; ++i) {
+      if (!passes_filters(relation, i, filters))
+        continue;
+      assert(joinable[expected].first == relation[0][i]);
+      assert(joinable[expected].second.v == i);
+      ++expected;
+    }
+    assert(joinable.size == expected);
+    joinable.clear_and_free();
+    filters.free();
+  }
+  relation.free();
+}
+
+static void test_filter_order() {
+  FUNCTION_TEST();
+  StretchyBuf<Predicate> predicates;
+  predicates.push(create_filter(0, '<', 90));
+  predicates.push(create_filter(1, '=', 5));
+  predicates.push(create_filter(0, '>', 10));
+  predicates.push(create_filter(2, '>', 50));
+  StretchyBuf<ColumnFilter> filters = merge_column_filters(predicates);
+  assert(filters.len == 3);
+  for (ColumnFilter &filter : filters) {
+    filter.selectivity = filter.range.selectivity(0, 99, 100);
+  }
+  assert(filters.data[0].range.min == 11 && filters.data[0].range.max == 89);
+  order_column_filters(filters);
+  // Column 1 keeps 1 value, column 2 49 values and column 0 79 values.
+  assert(filters.data[0].column == 1 && filters.data[1].column == 2 && filters.data[2].column == 0);
+  assert(ColumnRange::of(create_filter(0, '<', 0)).selectivity(0, 99, 100) == 0.0);
+  filters.free();
+  predicates.free();
+}
+
+// Half of the rows of column 0 are "heavy", the rest are spread over [0, value_range).
+static void test_histogram(size_t row_n, uint64_t value_range, uint64_t heavy) {
+  FUNCTION_TEST();
+  RelationData relation = create_relation(row_n, value_range);
+  for (size_t i = 0; i < row_n; i += 2) {
+    relation[0][i] = heavy;
+  }
+  relation.max_values[0] = std::max(relation.max_values[0].v, heavy);
+  relation.allocate_sorted_indexes();
+  relation.build_sorted_index(0);
+  const Histogram *histogram = relation.histogram(0);
+  assert(histogram && histogram->row_n == row_n);
+  ColumnRange ranges[] = {{heavy, heavy, false}, {0, value_range / 2, false}, {value_range / 2, UINT64_MAX, false},
+                          {heavy + 1, heavy + value_range / 10, false}, ColumnRange::all()};
+  for (ColumnRange range : ranges) {
+    size_t count = 0;
+    for (size_t i = 0; i < row_n; ++i) {
+      count += range.contains(relation[0][i].v);
+    }
+    double estimate = histogram->selectivity(range);
+    // The skew of the column is in the histogram, a uniform estimate would be off by far more.
+    assert(std::abs(estimate - (double) count / (double) row_n) < 0.05);
+  }
+  assert(histogram->selectivity({value_range + heavy + 1, UINT64_MAX, false}) == 0.0);
+  assert(histogram->selectivity({0, UINT64_MAX, true}) == 0.0);
+  relation.free();
+}
+
+static void test_filtered_rows(size_t row_n, size_t step) {
+  FUNCTION_TEST();
+  RowBitmap rows = RowBitmap::create(row_n, false);
+  for (size_t row = 0; row < row_n; row += step) {
+    rows.words[row / 64] |= UINT64_C(1) << (row % 64);
+  }
+  FilteredRows filtered = FilteredRows::compress(rows);
+  // A list takes 4 bytes per row and a bitmap 8 bytes per 64 rows.
+  assert(filtered.is_list() == (step > 32));
+  assert(filtered.count == (row_n + step - 1) / step);
+  size_t expected = 0;
+  filtered.for_each([&expected, step](size_t row) {
+    assert(row == expected);
+    expected += step;
+  });
+  RowBitmap bitmap = filtered.to_bitmap();
+  for (size_t row = 0; row < row_n; ++row) {
+    assert(bitmap.test(row) == (row % step == 0));
+  }
+  if (filtered.is_list()) {
+    bitmap.free();
+  }
+  filtered.free();
+}
+
+int main() {
+  test_filtered_rows(10000, 3);
+  test_filtered_rows(10000, 100);
+  test_filter_order();
+  test_histogram(100000, 1000000, 7);
+  test_histogram(100000, 100, 50);
+  // Fewer rows than buckets.
+  test_histogram(20, 1000, 500);
+  test_filters(10000, 100);
+  test_filters(1000, 16);
+  test_filters(100000, 1000, true);
+  test_filters(ZoneMap::block_rows * 3 + 10, 50, true);
+  // Rows that don't fill a word of the bitmap.
+  test_filters(37, 10);
+  test_sorted_index(10000, 100);
+  // Few rows pass, so they are sorted rather than picked from the sorted index.
+  test_sorted_index(10000, 1000, 50);
+  // Too wide to be packed.
+  test_sorted_index(10000, UINT64_MAX);
+  test_sorted_index(1, 10);
+  return 0;
+}